@@ -32,6 +32,13 @@ struct countable
     countable() : refcnt(0) {}
     virtual ~countable() {}
 
+protected:
+    // Called when the last reference is released. Override this to
+    // recycle the object rather than delete it.
+    virtual void dispose() {
+        delete this;
+    }
+
 private:
     std::atomic<unsigned> refcnt;
 
@@ -47,9 +54,9 @@ template <typename T> T * retain(T * ptr) {
 template <typename T> void release(T * ptr) {
     unsigned count = std::atomic_fetch_sub_explicit(&ptr->refcnt, 1u, std::memory_order_acq_rel);
     // If the previous refcount was 1, then we have decremented it to 0. We
-    // want to delete in that case.
+    // want to dispose of it in that case.
     if (count == 1) {
-        delete ptr;
+        static_cast<countable *>(ptr)->dispose();
     }
 }
 
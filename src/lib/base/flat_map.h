@@ -0,0 +1,389 @@
+/*
+ * Copyright (c) 2012 James Peach
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FLAT_MAP_H_0B7C53E2_8A3D_4E0C_9F3B_2C6D1E47A9F5
+#define FLAT_MAP_H_0B7C53E2_8A3D_4E0C_9F3B_2C6D1E47A9F5
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <memory>
+#include <utility>
+#include <iterator>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+
+// A sorted associative container that keeps its elements in a single
+// contiguous array. The first N elements live inside the container itself,
+// so small maps never touch the heap. Lookup is a binary search and
+// iteration is in key order, just like std::map.
+//
+// The elements stay where they were inserted and a separate array of
+// indices keeps them in key order, so insertion only shifts the indices,
+// not the elements. Insertion and erasure are still O(n), which is the
+// right trade-off for a few dozen HTTP headers, but moving a pair of
+// strings costs much more than moving an index.
+//
+// NOTE: Inserting or erasing elements invalidates all iterators.
+
+template <typename Key, typename T, unsigned N = 16,
+         typename Compare = std::less<Key> >
+struct flat_map
+{
+    typedef Key                     key_type;
+    typedef T                       mapped_type;
+    typedef std::pair<Key, T>       value_type;
+    typedef size_t                  size_type;
+    typedef uint32_t                index_type;
+
+    // Random access iterator over the index array.
+    template <typename V>
+    struct basic_iterator
+    {
+        typedef std::random_access_iterator_tag iterator_category;
+        typedef typename std::remove_const<V>::type value_type;
+        typedef ptrdiff_t   difference_type;
+        typedef V *         pointer;
+        typedef V &         reference;
+
+        basic_iterator() : base(nullptr), pos(nullptr) {}
+        basic_iterator(V * b, const index_type * p) : base(b), pos(p) {}
+
+        // An iterator converts to a const_iterator.
+        template <typename U>
+        basic_iterator(const basic_iterator<U>& other,
+                typename std::enable_if<
+                    std::is_convertible<U *, V *>::value>::type * = 0)
+            : base(other.base), pos(other.pos) {
+        }
+
+        V& operator*() const { return base[*pos]; }
+        V * operator->() const { return &base[*pos]; }
+        V& operator[](difference_type n) const { return base[pos[n]]; }
+
+        basic_iterator& operator++() { ++pos; return *this; }
+        basic_iterator& operator--() { --pos; return *this; }
+        basic_iterator operator++(int) { basic_iterator tmp(*this); ++pos; return tmp; }
+        basic_iterator operator--(int) { basic_iterator tmp(*this); --pos; return tmp; }
+        basic_iterator& operator+=(difference_type n) { pos += n; return *this; }
+        basic_iterator& operator-=(difference_type n) { pos -= n; return *this; }
+
+        basic_iterator operator+(difference_type n) const {
+            return basic_iterator(base, pos + n);
+        }
+
+        basic_iterator operator-(difference_type n) const {
+            return basic_iterator(base, pos - n);
+        }
+
+        template <typename U> difference_type
+        operator-(const basic_iterator<U>& other) const { return pos - other.pos; }
+
+        template <typename U> bool
+        operator==(const basic_iterator<U>& other) const { return pos == other.pos; }
+        template <typename U> bool
+        operator!=(const basic_iterator<U>& other) const { return pos != other.pos; }
+        template <typename U> bool
+        operator<(const basic_iterator<U>& other) const { return pos < other.pos; }
+        template <typename U> bool
+        operator>(const basic_iterator<U>& other) const { return pos > other.pos; }
+        template <typename U> bool
+        operator<=(const basic_iterator<U>& other) const { return pos <= other.pos; }
+        template <typename U> bool
+        operator>=(const basic_iterator<U>& other) const { return pos >= other.pos; }
+
+        V *                 base;
+        const index_type *  pos;
+    };
+
+    typedef basic_iterator<value_type>          iterator;
+    typedef basic_iterator<const value_type>    const_iterator;
+
+    flat_map()
+        : data(inline_data()), order(inline_order), count(0), capacity(N) {
+    }
+
+    flat_map(const flat_map& other)
+            : data(inline_data()), order(inline_order), count(0), capacity(N) {
+        reserve(other.count);
+        std::uninitialized_copy(other.data, other.data + other.count, data);
+        memcpy(order, other.order, other.count * sizeof(index_type));
+        count = other.count;
+    }
+
+    flat_map(flat_map&& other)
+            : data(inline_data()), order(inline_order), count(0), capacity(N) {
+        steal(other);
+    }
+
+    ~flat_map() {
+        clear();
+        release();
+    }
+
+    flat_map& operator=(const flat_map& other) {
+        if (this != &other) {
+            flat_map tmp(other);
+            clear();
+            steal(tmp);
+        }
+
+        return *this;
+    }
+
+    flat_map& operator=(flat_map&& other) {
+        if (this != &other) {
+            clear();
+            steal(other);
+        }
+
+        return *this;
+    }
+
+    size_type size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    iterator begin() { return iterator(data, order); }
+    iterator end() { return iterator(data, order + count); }
+    const_iterator begin() const { return const_iterator(data, order); }
+    const_iterator end() const { return const_iterator(data, order + count); }
+
+    iterator find(const key_type& key) {
+        const_iterator pos(static_cast<const flat_map *>(this)->find(key));
+        return iterator(data, pos.pos);
+    }
+
+    const_iterator find(const key_type& key) const {
+        // For small maps, a linear scan for equality beats the binary
+        // search, since most keys can be rejected on the length alone.
+        if (count <= linear_search_max) {
+            const_iterator pos(begin());
+            while (pos != end() && !(pos->first == key)) {
+                ++pos;
+            }
+
+            return pos;
+        }
+
+        const_iterator pos(lower_bound(key));
+        return (pos != end() && !less(key, pos->first)) ? pos : end();
+    }
+
+    iterator lower_bound(const key_type& key) {
+        return std::lower_bound(begin(), end(), key, key_less(less));
+    }
+
+    const_iterator lower_bound(const key_type& key) const {
+        return std::lower_bound(begin(), end(), key, key_less(less));
+    }
+
+    // Search with a key of another type, which saves making a key_type
+    // just to look it up. The comparison must order like Compare.
+    template <typename K, typename Less> iterator
+    lower_bound(const K& key, Less cmp) {
+        return std::lower_bound(begin(), end(), key, cmp);
+    }
+
+    template <typename K, typename Less> const_iterator
+    lower_bound(const K& key, Less cmp) const {
+        return std::lower_bound(begin(), end(), key, cmp);
+    }
+
+    // Insert the value if the key is not already present. Return the
+    // position of the element with the key and whether it was inserted.
+    std::pair<iterator, bool> insert(value_type value) {
+        iterator pos(lower_bound(value.first));
+        if (pos != end() && !less(value.first, pos->first)) {
+            return std::make_pair(pos, false);
+        }
+
+        return std::make_pair(insert_at(pos, std::move(value)), true);
+    }
+
+    // Insert the value before the hint, which must be the lower bound of
+    // the key, saving the search. The key must not be present. This is
+    // for callers that have already searched with a key of another type.
+    iterator insert(iterator hint, value_type value) {
+        return insert_at(hint, std::move(value));
+    }
+
+    mapped_type& operator[](const key_type& key) {
+        iterator pos(lower_bound(key));
+        if (pos != end() && !less(key, pos->first)) {
+            return pos->second;
+        }
+
+        return insert_at(pos, value_type(key, mapped_type()))->second;
+    }
+
+    mapped_type& operator[](key_type&& key) {
+        iterator pos(lower_bound(key));
+        if (pos != end() && !less(key, pos->first)) {
+            return pos->second;
+        }
+
+        return insert_at(pos, value_type(std::move(key), mapped_type()))->second;
+    }
+
+    iterator erase(iterator pos) {
+        index_type * slot = const_cast<index_type *>(pos.pos);
+        index_type hole = *slot;
+        index_type last = count - 1;
+
+        // Fill the hole with the last element so that the elements stay
+        // contiguous, then point its index at the new place.
+        if (hole != last) {
+            data[hole] = std::move(data[last]);
+            *std::find(order, order + count, last) = hole;
+        }
+
+        data[last].~value_type();
+        memmove(slot, slot + 1, (order + count - slot - 1) * sizeof(index_type));
+        --count;
+        return pos;
+    }
+
+    size_type erase(const key_type& key) {
+        iterator pos(find(key));
+        if (pos == end()) {
+            return 0;
+        }
+
+        erase(pos);
+        return 1;
+    }
+
+    void clear() {
+        for (size_type i = 0; i < count; ++i) {
+            data[i].~value_type();
+        }
+
+        count = 0;
+    }
+
+    void reserve(size_type n) {
+        if (n <= capacity) {
+            return;
+        }
+
+        value_type * ptr = (value_type *)malloc(n * sizeof(value_type));
+        index_type * idx = (index_type *)malloc(n * sizeof(index_type));
+        if (ptr == nullptr || idx == nullptr) {
+            free(ptr);
+            free(idx);
+            throw std::bad_alloc();
+        }
+
+        for (size_type i = 0; i < count; ++i) {
+            new (&ptr[i]) value_type(std::move(data[i]));
+            data[i].~value_type();
+        }
+
+        memcpy(idx, order, count * sizeof(index_type));
+        release();
+
+        data = ptr;
+        order = idx;
+        capacity = n;
+    }
+
+private:
+    enum : size_type { linear_search_max = 32 };
+
+    typedef typename std::aligned_storage<
+        sizeof(value_type), alignof(value_type)>::type storage_type;
+
+    struct key_less {
+        explicit key_less(const Compare& c) : cmp(c) {}
+        bool operator()(const value_type& v, const key_type& k) const {
+            return cmp(v.first, k);
+        }
+        const Compare& cmp;
+    };
+
+    value_type * inline_data() {
+        return reinterpret_cast<value_type *>(storage);
+    }
+
+    bool is_inline() const {
+        return data == reinterpret_cast<const value_type *>(storage);
+    }
+
+    // Free the heap arrays, if we have them. The elements must already
+    // have been destroyed or moved.
+    void release() {
+        if (!is_inline()) {
+            free(data);
+            free(order);
+        }
+    }
+
+    iterator insert_at(iterator pos, value_type&& value) {
+        size_type offset = pos.pos - order;
+
+        if (count == capacity) {
+            reserve(capacity * 2);
+        }
+
+        // The new element goes at the end of the elements and its index
+        // goes into the hole we open at pos.
+        new (&data[count]) value_type(std::move(value));
+        memmove(order + offset + 1, order + offset,
+                (count - offset) * sizeof(index_type));
+        order[offset] = count;
+
+        ++count;
+        return iterator(data, order + offset);
+    }
+
+    // Take the elements of other, leaving it empty. We must be empty.
+    void steal(flat_map& other) {
+        if (other.is_inline()) {
+            reserve(other.count);
+            for (size_type i = 0; i < other.count; ++i) {
+                new (&data[i]) value_type(std::move(other.data[i]));
+            }
+            memcpy(order, other.order, other.count * sizeof(index_type));
+            count = other.count;
+            other.clear();
+        } else {
+            release();
+
+            data = other.data;
+            order = other.order;
+            count = other.count;
+            capacity = other.capacity;
+            other.data = other.inline_data();
+            other.order = other.inline_order;
+            other.count = 0;
+            other.capacity = N;
+        }
+    }
+
+    value_type *    data;
+    index_type *    order;
+    size_type       count;
+    size_type       capacity;
+    Compare         less;
+    storage_type    storage[N];
+    index_type      inline_order[N];
+};
+
+#endif /* FLAT_MAP_H_0B7C53E2_8A3D_4E0C_9F3B_2C6D1E47A9F5 */
+/* vim: set sw=4 ts=4 tw=79 et : */
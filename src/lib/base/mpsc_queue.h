@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2012 James Peach
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MPSC_QUEUE_H_5A0E7C39_1B84_4F2D_9C6E_83D2F1A4B07E
+#define MPSC_QUEUE_H_5A0E7C39_1B84_4F2D_9C6E_83D2F1A4B07E
+
+#include <atomic>
+
+// Lock-free intrusive queue with many producers and a single consumer. T
+// must have a "T * next" member, which belongs to the queue while the
+// element is queued.
+//
+// Producers push onto a stack with a single compare-and-swap. The consumer
+// takes the whole stack with one exchange and reverses it, so elements come
+// out in the order they were pushed and the consumer never contends with
+// the producers element by element. There is no ABA problem, because
+// nothing but the consumer ever removes elements, and it removes them all.
+template <typename T>
+struct mpsc_queue
+{
+    mpsc_queue() : head(nullptr) {}
+
+    // Push an element. Return true if the queue was empty, in which case
+    // the consumer might be idle and the producer should wake it.
+    bool push(T * elem) {
+        T * top = head.load(std::memory_order_relaxed);
+        do {
+            elem->next = top;
+        } while (!head.compare_exchange_weak(top, elem,
+                    std::memory_order_release, std::memory_order_relaxed));
+
+        return top == nullptr;
+    }
+
+    // Take every queued element, as a list linked through "next" in the
+    // order they were pushed. Only the consumer may call this.
+    T * pop_all() {
+        T * top = head.exchange(nullptr, std::memory_order_acquire);
+        T * list = nullptr;
+
+        while (top) {
+            T * next = top->next;
+            top->next = list;
+            list = top;
+            top = next;
+        }
+
+        return list;
+    }
+
+    bool empty() const {
+        return head.load(std::memory_order_relaxed) == nullptr;
+    }
+
+private:
+    mpsc_queue(const mpsc_queue&); // disable
+    mpsc_queue& operator=(const mpsc_queue&); // disable
+
+    std::atomic<T *> head;
+};
+
+#endif /* MPSC_QUEUE_H_5A0E7C39_1B84_4F2D_9C6E_83D2F1A4B07E */
+/* vim: set sw=4 ts=4 tw=79 et : */
@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2012 James Peach
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ARENA_H_6D1F0B2A_93C4_4E7B_A85D_0C27E4F9B316
+#define ARENA_H_6D1F0B2A_93C4_4E7B_A85D_0C27E4F9B316
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <new>
+#include <string>
+#include <algorithm>
+#include <utility>
+
+namespace spdy {
+
+// Bump-pointer allocator for state that lives exactly as long as a stream:
+// the request URL and the response header block.
+// Allocating is a pointer increment and nothing is freed individually;
+// reset() releases everything at once. Memory comes from a list of malloc'd
+// chunks, and an allocation that is bigger than a chunk gets a chunk of its
+// own.
+struct arena
+{
+private:
+    struct chunk;
+
+public:
+    enum : size_t {
+        default_chunk_size = 4096,
+        default_alignment = 2 * sizeof(void *)
+    };
+
+    explicit arena(size_t chunk = default_chunk_size)
+        : head(nullptr), current(nullptr), chunk_size(chunk),
+        base(0), peak(0) {
+    }
+
+    ~arena() {
+        release(head);
+    }
+
+    void * allocate(size_t n, size_t align = default_alignment) {
+        if (current) {
+            size_t offset = align_up(current->used, align);
+            if (offset + n <= current->size) {
+                current->used = offset + n;
+                account();
+                return current->bytes() + offset;
+            }
+        }
+
+        return allocate_slow(n, align);
+    }
+
+    // Release everything that was allocated. The first chunk is kept so
+    // that the arena can be reused without going back to malloc.
+    void reset() {
+        if (head) {
+            release(head->next);
+            head->next = nullptr;
+            head->used = 0;
+        }
+
+        current = head;
+        base = 0;
+    }
+
+    // Bytes currently allocated, including alignment padding.
+    size_t used() const {
+        return base + (current ? current->used : 0);
+    }
+
+    // The most bytes that were ever allocated at once.
+    size_t high_water() const {
+        return peak;
+    }
+
+    // Rewind the arena when the scope ends, releasing anything that was
+    // allocated inside the scope. Use this for scratch space that doesn't
+    // need to live as long as the stream.
+    struct scope
+    {
+        explicit scope(arena& a)
+            : owner(a), mark(a.current),
+            used(a.current ? a.current->used : 0), base(a.base) {
+        }
+
+        ~scope() {
+            owner.current = mark ? mark : owner.head;
+            if (owner.current) {
+                owner.current->used = used;
+            }
+            owner.base = base;
+        }
+
+    private:
+        scope(const scope&); // disable
+        scope& operator=(const scope&); // disable
+
+        arena&          owner;
+        chunk *         mark;
+        size_t          used;
+        size_t          base;
+    };
+
+private:
+    struct chunk
+    {
+        chunk * next;
+        size_t  size;
+        size_t  used;
+
+        uint8_t * bytes() {
+            return reinterpret_cast<uint8_t *>(this) + header_size();
+        }
+    };
+
+    static size_t header_size() {
+        return align_up(sizeof(chunk), default_alignment);
+    }
+
+    static size_t align_up(size_t n, size_t align) {
+        return (n + align - 1) & ~(align - 1);
+    }
+
+    static void release(chunk * c) {
+        while (c) {
+            chunk * next = c->next;
+            free(c);
+            c = next;
+        }
+    }
+
+    void account() {
+        peak = std::max(peak, used());
+    }
+
+    void * allocate_slow(size_t n, size_t align) {
+        // Chunk memory is aligned to default_alignment, so bigger
+        // alignments need some slack.
+        size_t need = n + (align > default_alignment ? align : 0);
+
+        // Move on to the next chunk if we have already got one that is big
+        // enough (e.g. after a scope rewound), else chain in a new one.
+        chunk * next = current ? current->next : head;
+        if (next == nullptr || next->size < need) {
+            size_t size = std::max(chunk_size, need);
+            chunk * c = (chunk *)malloc(header_size() + size);
+            if (c == nullptr) {
+                throw std::bad_alloc();
+            }
+
+            c->size = size;
+            c->used = 0;
+            c->next = next;
+            if (current) {
+                current->next = c;
+            } else {
+                head = c;
+            }
+
+            next = c;
+        }
+
+        if (current) {
+            base += current->used;
+        }
+
+        current = next;
+        current->used = 0;
+
+        uintptr_t addr = (uintptr_t)current->bytes();
+        size_t offset = align_up(addr, align) - addr;
+        current->used = offset + n;
+        account();
+        return current->bytes() + offset;
+    }
+
+    arena(const arena&); // disable
+    arena& operator=(const arena&); // disable
+
+    chunk *     head;
+    chunk *     current;
+    size_t      chunk_size;
+    size_t      base;   // bytes used in the chunks before current
+    size_t      peak;
+};
+
+// Standard allocator that takes memory from an arena. Deallocation is a
+// no-op, since the arena releases everything at once. Without an arena it
+// falls back to the heap, so containers that use it work the same whether
+// or not they are attached to a stream.
+template <typename T>
+struct arena_allocator
+{
+    typedef T               value_type;
+    typedef T *             pointer;
+    typedef const T *       const_pointer;
+    typedef T&              reference;
+    typedef const T&        const_reference;
+    typedef size_t          size_type;
+    typedef ptrdiff_t       difference_type;
+
+    template <typename U> struct rebind {
+        typedef arena_allocator<U> other;
+    };
+
+    arena_allocator() : owner(nullptr) {}
+    explicit arena_allocator(spdy::arena * a) : owner(a) {}
+
+    template <typename U>
+    arena_allocator(const arena_allocator<U>& other) : owner(other.owner) {}
+
+    T * allocate(size_t n, const void * = nullptr) {
+        if (owner) {
+            // Containers of char can still put a header with size_t fields
+            // at the front (e.g. the reference-counted std::string).
+            return (T *)owner->allocate(n * sizeof(T),
+                    std::max(alignof(T), alignof(void *)));
+        }
+
+        T * ptr = (T *)malloc(n * sizeof(T));
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+
+        return ptr;
+    }
+
+    void deallocate(T * ptr, size_t) {
+        if (owner == nullptr) {
+            free(ptr);
+        }
+    }
+
+    size_t max_size() const {
+        return size_t(-1) / sizeof(T);
+    }
+
+    template <typename U, typename... Args>
+    void construct(U * ptr, Args&&... args) {
+        new ((void *)ptr) U(std::forward<Args>(args)...);
+    }
+
+    template <typename U>
+    void destroy(U * ptr) {
+        ptr->~U();
+    }
+
+    T * address(T& ref) const { return &ref; }
+    const T * address(const T& ref) const { return &ref; }
+
+    spdy::arena * owner;
+};
+
+template <typename T, typename U> inline bool
+operator==(const arena_allocator<T>& lhs, const arena_allocator<U>& rhs)
+{
+    return lhs.owner == rhs.owner;
+}
+
+template <typename T, typename U> inline bool
+operator!=(const arena_allocator<T>& lhs, const arena_allocator<U>& rhs)
+{
+    return lhs.owner != rhs.owner;
+}
+
+typedef std::basic_string<char, std::char_traits<char>,
+        arena_allocator<char> > arena_string;
+
+inline bool
+operator==(const arena_string& lhs, const std::string& rhs)
+{
+    return lhs.size() == rhs.size() && lhs.compare(0, lhs.size(),
+            rhs.data(), rhs.size()) == 0;
+}
+
+inline bool
+operator==(const std::string& lhs, const arena_string& rhs)
+{
+    return rhs == lhs;
+}
+
+} // namespace spdy
+
+#endif /* ARENA_H_6D1F0B2A_93C4_4E7B_A85D_0C27E4F9B316 */
+/* vim: set sw=4 ts=4 tw=79 et : */
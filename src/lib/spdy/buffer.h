@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2012 James Peach
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BUFFER_H_8E2F4C71_3A9B_4D56_A0E8_5B1C7F3D92A6
+#define BUFFER_H_8E2F4C71_3A9B_4D56_A0E8_5B1C7F3D92A6
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <algorithm>
+
+namespace spdy {
+
+// Growable raw byte buffer that we can decompress and marshall straight
+// into. Unlike std::vector, growing the buffer never initializes the new
+// bytes, and capacity is separate from size: prepare() makes room for
+// more bytes and commit() accounts for the bytes that were written there.
+//
+// The buffer can start out in caller-provided storage (see
+// inline_byte_buffer) and only moves to the heap if it outgrows that.
+// clear() keeps the capacity, so a long-lived buffer can be reused as
+// scratch space without reallocating.
+struct byte_buffer
+{
+    byte_buffer()
+        : ptr(nullptr), nbytes(0), nalloc(0), storage(nullptr) {
+    }
+
+    // Start out using the given storage, which must outlive the buffer.
+    byte_buffer(void * mem, size_t len)
+        : ptr((uint8_t *)mem), nbytes(0), nalloc(len), storage(ptr) {
+    }
+
+    ~byte_buffer() {
+        if (ptr != storage) {
+            free(ptr);
+        }
+    }
+
+    uint8_t * data() { return ptr; }
+    const uint8_t * data() const { return ptr; }
+
+    size_t size() const { return nbytes; }
+    size_t capacity() const { return nalloc; }
+    size_t available() const { return nalloc - nbytes; }
+    bool empty() const { return nbytes == 0; }
+
+    void clear() {
+        nbytes = 0;
+    }
+
+    // Make sure there is room for n bytes, preserving the contents.
+    void reserve(size_t n) {
+        if (n > nalloc) {
+            grow(n);
+        }
+    }
+
+    // Set the size to n bytes. Any new bytes are uninitialized.
+    void resize(size_t n) {
+        reserve(n);
+        nbytes = n;
+    }
+
+    // Return a pointer to at least n bytes of uninitialized space after the
+    // current contents. The space might be larger than n; available()
+    // returns the actual size.
+    uint8_t * prepare(size_t n) {
+        reserve(nbytes + n);
+        return ptr + nbytes;
+    }
+
+    // Add n bytes that were written to the space returned by prepare().
+    void commit(size_t n) {
+        nbytes += n;
+    }
+
+    void append(const void * src, size_t n) {
+        memcpy(prepare(n), src, n);
+        commit(n);
+    }
+
+private:
+    byte_buffer(const byte_buffer&); // disable
+    byte_buffer& operator=(const byte_buffer&); // disable
+
+    void grow(size_t n) {
+        uint8_t * mem;
+
+        n = std::max(n, nalloc * 2);
+        if (ptr == storage) {
+            if ((mem = (uint8_t *)malloc(n)) && nbytes) {
+                memcpy(mem, ptr, nbytes);
+            }
+        } else {
+            mem = (uint8_t *)realloc(ptr, n);
+        }
+
+        if (mem == nullptr) {
+            throw std::bad_alloc();
+        }
+
+        ptr = mem;
+        nalloc = n;
+    }
+
+    uint8_t *   ptr;
+    size_t      nbytes;
+    size_t      nalloc;
+    uint8_t *   storage;    // caller-provided initial storage
+};
+
+// A byte_buffer that starts out with N bytes of inline storage, which puts
+// small buffers on the stack.
+template <size_t N>
+struct inline_byte_buffer : public byte_buffer
+{
+    inline_byte_buffer() : byte_buffer(bytes, N) {
+    }
+
+private:
+    uint8_t bytes[N];
+};
+
+} // namespace spdy
+
+#endif /* BUFFER_H_8E2F4C71_3A9B_4D56_A0E8_5B1C7F3D92A6 */
+/* vim: set sw=4 ts=4 tw=79 et : */
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2012 James Peach
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CODEC_H_FBC63262_2209_4532_8E72_D8E1F60E447F
+#define CODEC_H_FBC63262_2209_4532_8E72_D8E1F60E447F
+
+#include "spdy.h"
+
+namespace spdy {
+
+// Name/value header block codec for one protocol version. The length field
+// width comes from version_traits, so the encode and decode loops don't
+// look at the version at all. Instantiated for SPDY/2 and SPDY/3 in
+// message.cc.
+template <protocol_version V>
+struct codec
+{
+    typedef version_traits<V> traits;
+    typedef typename traits::length_type length_type;
+
+    // Return the number of bytes the block takes before compression.
+    static size_t nbytes(const key_value_block&);
+
+    // Serialize the block into scratch and compress it into the buffer,
+    // which should be sized with compressor.bound(nbytes()).
+    static size_t marshall(zstream<compress>&, const key_value_block&,
+            byte_buffer& scratch, uint8_t *, size_t);
+
+    // Serialize the block without compressing it. The buffer must hold
+    // nbytes() bytes. Return the number of bytes written.
+    static size_t serialize(const key_value_block&, uint8_t *, size_t);
+
+    // Parse a header block that has already been decompressed. Fail
+    // without visiting any headers if the block has more than max_headers
+    // headers, unless max_headers is zero.
+    static parse_status parse(const uint8_t *, size_t,
+            const key_value_block::visitor_type&, unsigned max_headers = 0);
+};
+
+// Runtime handle on a codec instantiation. A session looks this up once,
+// when the first SYN_STREAM tells it which protocol version the client
+// speaks, and uses it for every header block after that.
+struct header_codec
+{
+    virtual ~header_codec() {}
+
+    virtual size_t nbytes(const key_value_block&) const = 0;
+    virtual size_t marshall(zstream<compress>&, const key_value_block&,
+            byte_buffer&, uint8_t *, size_t) const = 0;
+    virtual size_t serialize(const key_value_block&,
+            uint8_t *, size_t) const = 0;
+    virtual parse_status parse(const uint8_t *, size_t,
+            const key_value_block::visitor_type&,
+            unsigned max_headers) const = 0;
+
+    const protocol_version  version;
+    const unsigned          syn_reply_size;
+    const char * const      status_header;
+    const char * const      version_header;
+    const zdictionary&      dictionary;
+
+    // Return the codec for the given version, or null if we don't speak it.
+    static const header_codec * get(unsigned version);
+
+    // Compress a header block that was serialized with serialize(). The
+    // buffer should be sized with compressor.bound(). This is the second
+    // half of marshall(), for callers that serialize the block in one
+    // place and compress it in another.
+    static size_t deflate(zstream<compress>&, const uint8_t *, size_t,
+            uint8_t *, size_t);
+
+protected:
+    template <typename Traits>
+    header_codec(protocol_version v, const Traits&)
+        : version(v), syn_reply_size(Traits::syn_reply_size),
+        status_header(Traits::status_header()),
+        version_header(Traits::version_header()),
+        dictionary(Traits::dictionary()) {
+    }
+
+private:
+    header_codec(const header_codec&); // disable
+    header_codec& operator=(const header_codec&); // disable
+};
+
+} // namespace spdy
+
+#endif /* CODEC_H_FBC63262_2209_4532_8E72_D8E1F60E447F */
+/* vim: set sw=4 ts=4 tw=79 et : */
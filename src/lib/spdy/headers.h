@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2012 James Peach
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HEADERS_H_4C9A71E3_0F62_4B8D_9E35_D28A6B1F07C4
+#define HEADERS_H_4C9A71E3_0F62_4B8D_9E35_D28A6B1F07C4
+
+#include <stddef.h>
+#include <stdint.h>
+#include <strings.h>
+
+namespace spdy {
+
+// Well-known SPDY and HTTP header names.
+enum header_id : uint8_t
+{
+    HEADER_UNKNOWN = 0,
+
+    // Request and status line headers. SPDY/2 spells these as plain header
+    // names and SPDY/3 prefixes them with ':'.
+    HEADER_HOST,
+    HEADER_METHOD,
+    HEADER_PATH,                // "url" in SPDY/2
+    HEADER_SCHEME,
+    HEADER_STATUS,
+    HEADER_VERSION,
+
+    // Hop-by-hop headers, which MUST NOT be sent over SPDY.
+    HEADER_CONNECTION,
+    HEADER_KEEP_ALIVE,
+    HEADER_PROXY_CONNECTION,
+    HEADER_TRANSFER_ENCODING,
+
+    HEADER_ACCEPT,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_ACCEPT_LANGUAGE,
+    HEADER_ACCEPT_RANGES,
+    HEADER_AGE,
+    HEADER_AUTHORIZATION,
+    HEADER_CACHE_CONTROL,
+    HEADER_CONTENT_ENCODING,
+    HEADER_CONTENT_LENGTH,
+    HEADER_CONTENT_TYPE,
+    HEADER_COOKIE,
+    HEADER_DATE,
+    HEADER_ETAG,
+    HEADER_EXPIRES,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_IF_NONE_MATCH,
+    HEADER_LAST_MODIFIED,
+    HEADER_LOCATION,
+    HEADER_REFERER,
+    HEADER_SERVER,
+    HEADER_SET_COOKIE,
+    HEADER_USER_AGENT,
+    HEADER_VARY,
+    HEADER_VIA,
+
+    HEADER_ID_MAX
+};
+
+struct known_header
+{
+    const char *    name;
+    size_t          len;
+    header_id       id;
+};
+
+#define KNOWN_HEADER(name, id) { name, sizeof(name) - 1, id }
+
+constexpr known_header known_headers[] =
+{
+    KNOWN_HEADER("host", HEADER_HOST),
+    KNOWN_HEADER("method", HEADER_METHOD),
+    KNOWN_HEADER("url", HEADER_PATH),
+    KNOWN_HEADER("scheme", HEADER_SCHEME),
+    KNOWN_HEADER("status", HEADER_STATUS),
+    KNOWN_HEADER("version", HEADER_VERSION),
+
+    KNOWN_HEADER(":host", HEADER_HOST),
+    KNOWN_HEADER(":method", HEADER_METHOD),
+    KNOWN_HEADER(":path", HEADER_PATH),
+    KNOWN_HEADER(":scheme", HEADER_SCHEME),
+    KNOWN_HEADER(":status", HEADER_STATUS),
+    KNOWN_HEADER(":version", HEADER_VERSION),
+
+    KNOWN_HEADER("connection", HEADER_CONNECTION),
+    KNOWN_HEADER("keep-alive", HEADER_KEEP_ALIVE),
+    KNOWN_HEADER("proxy-connection", HEADER_PROXY_CONNECTION),
+    KNOWN_HEADER("transfer-encoding", HEADER_TRANSFER_ENCODING),
+
+    KNOWN_HEADER("accept", HEADER_ACCEPT),
+    KNOWN_HEADER("accept-encoding", HEADER_ACCEPT_ENCODING),
+    KNOWN_HEADER("accept-language", HEADER_ACCEPT_LANGUAGE),
+    KNOWN_HEADER("accept-ranges", HEADER_ACCEPT_RANGES),
+    KNOWN_HEADER("age", HEADER_AGE),
+    KNOWN_HEADER("authorization", HEADER_AUTHORIZATION),
+    KNOWN_HEADER("cache-control", HEADER_CACHE_CONTROL),
+    KNOWN_HEADER("content-encoding", HEADER_CONTENT_ENCODING),
+    KNOWN_HEADER("content-length", HEADER_CONTENT_LENGTH),
+    KNOWN_HEADER("content-type", HEADER_CONTENT_TYPE),
+    KNOWN_HEADER("cookie", HEADER_COOKIE),
+    KNOWN_HEADER("date", HEADER_DATE),
+    KNOWN_HEADER("etag", HEADER_ETAG),
+    KNOWN_HEADER("expires", HEADER_EXPIRES),
+    KNOWN_HEADER("if-modified-since", HEADER_IF_MODIFIED_SINCE),
+    KNOWN_HEADER("if-none-match", HEADER_IF_NONE_MATCH),
+    KNOWN_HEADER("last-modified", HEADER_LAST_MODIFIED),
+    KNOWN_HEADER("location", HEADER_LOCATION),
+    KNOWN_HEADER("referer", HEADER_REFERER),
+    KNOWN_HEADER("server", HEADER_SERVER),
+    KNOWN_HEADER("set-cookie", HEADER_SET_COOKIE),
+    KNOWN_HEADER("user-agent", HEADER_USER_AGENT),
+    KNOWN_HEADER("vary", HEADER_VARY),
+    KNOWN_HEADER("via", HEADER_VIA),
+};
+
+#undef KNOWN_HEADER
+
+namespace detail {
+
+constexpr unsigned header_slots = 128;
+constexpr unsigned nknown_headers =
+    sizeof(known_headers) / sizeof(known_headers[0]);
+
+constexpr unsigned
+header_fold(char c)
+{
+    return (unsigned char)c | 0x20;
+}
+
+// Case-insensitive hash of the length and the first, middle and last
+// characters. The multipliers were picked by searching for values that
+// give every name in known_headers a distinct slot; the static_assert
+// below checks that this still holds. If you add a header and it fires,
+// search for new multipliers.
+constexpr unsigned
+header_hash(const char * name, size_t len)
+{
+    return (len * 3 + header_fold(name[0]) * 2 +
+            header_fold(name[len / 2]) * 2 +
+            header_fold(name[len - 1]) * 3) & (header_slots - 1);
+}
+
+constexpr unsigned
+header_hash(unsigned i)
+{
+    return header_hash(known_headers[i].name, known_headers[i].len);
+}
+
+// Return true if no entry in [j, n) collides with entry i.
+constexpr bool
+header_hash_unique(unsigned i, unsigned j)
+{
+    return j == nknown_headers ||
+        (header_hash(i) != header_hash(j) && header_hash_unique(i, j + 1));
+}
+
+constexpr bool
+header_hash_perfect(unsigned i = 0)
+{
+    return i == nknown_headers ||
+        (header_hash_unique(i, i + 1) && header_hash_perfect(i + 1));
+}
+
+static_assert(header_hash_perfect(), "known header hash collision");
+static_assert(nknown_headers < 255, "too many known headers");
+
+// Return the known_headers index that hashes to the given slot, or
+// nknown_headers if the slot is empty.
+constexpr uint8_t
+header_slot(unsigned slot, unsigned i = 0)
+{
+    return i == nknown_headers ? nknown_headers :
+        (header_hash(i) == slot ? i : header_slot(slot, i + 1));
+}
+
+// Expand header_slot() over every slot to build the hash table at compile
+// time.
+template <unsigned N, unsigned... Slots>
+struct header_slot_table : header_slot_table<N - 1, N - 1, Slots...>
+{
+};
+
+template <unsigned... Slots>
+struct header_slot_table<0, Slots...>
+{
+    static constexpr uint8_t slots[sizeof...(Slots)] = { header_slot(Slots)... };
+};
+
+template <unsigned... Slots>
+constexpr uint8_t header_slot_table<0, Slots...>::slots[sizeof...(Slots)];
+
+} // namespace detail
+
+// Return the ID of the given header name, or HEADER_UNKNOWN. Names are
+// matched case-insensitively so that this works for the canonical names
+// that the ATS MIME API returns as well as for SPDY header names, which
+// must be lower-case.
+inline header_id
+lookup_header(const char * name, size_t len)
+{
+    unsigned slot;
+
+    if (len == 0) {
+        return HEADER_UNKNOWN;
+    }
+
+    slot = detail::header_slot_table<detail::header_slots>::slots[
+        detail::header_hash(name, len)];
+    if (slot == detail::nknown_headers) {
+        return HEADER_UNKNOWN;
+    }
+
+    const known_header& known = known_headers[slot];
+    return (known.len == len && strncasecmp(known.name, name, len) == 0)
+        ? known.id : HEADER_UNKNOWN;
+}
+
+inline bool
+is_request_line_header(header_id id)
+{
+    return id >= HEADER_HOST && id <= HEADER_VERSION;
+}
+
+inline bool
+is_hop_by_hop_header(header_id id)
+{
+    return id >= HEADER_CONNECTION && id <= HEADER_TRANSFER_ENCODING;
+}
+
+} // namespace spdy
+
+#endif /* HEADERS_H_4C9A71E3_0F62_4B8D_9E35_D28A6B1F07C4 */
+/* vim: set sw=4 ts=4 tw=79 et : */
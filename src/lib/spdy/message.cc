@@ -15,7 +15,9 @@
  */
 
 #include "spdy.h"
+#include "codec.h"
 #include "zstream.h"
+#include "normalize.h"
 #include <base/logging.h>
 
 #include <stdexcept>
@@ -67,10 +69,21 @@ spdy::message_header::parse(
 {
     message_header header;
 
-    if (len < message_header::size) {
+    if (try_parse(ptr, len, header) != PARSE_OK) {
         throw protocol_error(std::string("short frame header"));
     }
 
+    return header;
+}
+
+spdy::parse_status
+spdy::message_header::try_parse(
+        const uint8_t __restrict * ptr, size_t len, message_header& header)
+{
+    if (len < message_header::size) {
+        return PARSE_SHORT_FRAME;
+    }
+
     header.is_control = ((*ptr) & 0x80u) ? true : false;
     if (header.is_control) {
         uint32_t val;
@@ -87,7 +100,7 @@ spdy::message_header::parse(
         header.datalen = (val & 0x00ffffffu);
     }
 
-    return header;
+    return PARSE_OK;
 }
 
 size_t
@@ -116,15 +129,26 @@ spdy::syn_stream_message::parse(
 {
     syn_stream_message msg;
 
-    if (len < syn_stream_message::size) {
+    if (try_parse(ptr, len, msg) != PARSE_OK) {
         throw protocol_error(std::string("short syn_stream message"));
     }
 
+    return msg;
+}
+
+spdy::parse_status
+spdy::syn_stream_message::try_parse(
+        const uint8_t __restrict * ptr, size_t len, syn_stream_message& msg)
+{
+    if (len < syn_stream_message::size) {
+        return PARSE_SHORT_FRAME;
+    }
+
     msg.stream_id = extract_stream_id(ptr);
     msg.associated_id = extract_stream_id(ptr);
     msg.priority = extract<uint8_t>(ptr) >> 5;  // top 3 bits are priority
     (void)extract<uint8_t>(ptr); // skip unused byte
-    return msg;
+    return PARSE_OK;
 }
 
 spdy::goaway_message
@@ -133,28 +157,70 @@ spdy::goaway_message::parse(
 {
     goaway_message msg;
 
-    if (len < goaway_message::size) {
+    if (try_parse(ptr, len, msg) != PARSE_OK) {
         throw protocol_error(std::string("short goaway_stream message"));
     }
 
-    msg.last_stream_id = extract_stream_id(ptr);
-    msg.status_code = extract_stream_id(ptr);
     return msg;
 }
 
+spdy::parse_status
+spdy::goaway_message::try_parse(
+        const uint8_t __restrict * ptr, size_t len, goaway_message& msg)
+{
+    if (len < size(PROTOCOL_VERSION_2)) {
+        return PARSE_SHORT_FRAME;
+    }
+
+    msg.last_stream_id = extract_stream_id(ptr);
+    msg.status_code = (len < size(PROTOCOL_VERSION_3))
+        ? 0 : ntohl(extract<uint32_t>(ptr));
+    return PARSE_OK;
+}
+
+size_t
+spdy::goaway_message::marshall(
+        protocol_version            version,
+        const goaway_message&       msg,
+        uint8_t __restrict *        ptr,
+        size_t                      len)
+{
+    if (len < size(version)) {
+        throw protocol_error(std::string("short goaway buffer"));
+    }
+
+    insert_stream_id(msg.last_stream_id, ptr);
+    if (version != PROTOCOL_VERSION_2) {
+        insert<uint32_t>(htonl(msg.status_code), ptr);
+    }
+
+    return size(version);
+}
+
 spdy::rst_stream_message
 spdy::rst_stream_message::parse(
         const uint8_t __restrict * ptr, size_t len)
 {
     rst_stream_message msg;
 
-    if (len < rst_stream_message::size) {
+    if (try_parse(ptr, len, msg) != PARSE_OK) {
         throw protocol_error(std::string("short rst_stream message"));
     }
 
+    return msg;
+}
+
+spdy::parse_status
+spdy::rst_stream_message::try_parse(
+        const uint8_t __restrict * ptr, size_t len, rst_stream_message& msg)
+{
+    if (len < rst_stream_message::size) {
+        return PARSE_SHORT_FRAME;
+    }
+
     msg.stream_id = extract_stream_id(ptr);
     msg.status_code = extract_stream_id(ptr);
-    return msg;
+    return PARSE_OK;
 }
 
 size_t
@@ -166,7 +232,7 @@ spdy::rst_stream_message::marshall(
     }
 
     insert_stream_id(msg.stream_id, ptr);
-    insert<uint32_t>(msg.status_code, ptr);
+    insert<uint32_t>(htonl(msg.status_code), ptr);
     return rst_stream_message::size;
 }
 
@@ -206,23 +272,32 @@ spdy::syn_reply_message::marshall(
 // +------------------------------------+
 // |           (repeats)                |
 
-static spdy::zstream_error
-decompress_headers(
+spdy::zstream_error
+spdy::decompress_headers(
         spdy::zstream<spdy::decompress>& decompressor,
-        std::vector<uint8_t>& bytes)
+        spdy::byte_buffer& bytes,
+        size_t limit)
 {
     ssize_t nbytes;
 
     do {
-        size_t avail;
-        size_t old = bytes.size();
-        bytes.resize(bytes.size() + getpagesize());
-        avail = bytes.size() - old;
-        nbytes = decompressor.consume(&bytes[old], avail);
+        // Inflate straight into the spare capacity, growing by a page
+        // when it runs low. Leave room for one byte past the limit so
+        // that we can tell when zlib has more to give.
+        uint8_t * ptr = bytes.prepare(bytes.available() < 256 ? getpagesize() : 0);
+        size_t room = bytes.available();
+
+        if (limit) {
+            room = std::min(room, limit + 1 - std::min(limit, bytes.size()));
+        }
+
+        nbytes = decompressor.consume(ptr, room);
         if (nbytes > 0) {
-            bytes.resize(old + nbytes);
-        } else {
-            bytes.resize(old);
+            bytes.commit(nbytes);
+        }
+
+        if (limit && bytes.size() > limit) {
+            return spdy::z_buffer_error;
         }
     } while (nbytes > 0);
 
@@ -233,171 +308,356 @@ decompress_headers(
     return spdy::z_ok;
 }
 
-static ssize_t
-marshall_string_v2(
-        spdy::zstream<spdy::compress>&  compressor,
-        const std::string&              strval,
-        uint8_t *                       ptr,
-        size_t                          len,
-        unsigned                        flags)
-{
-    size_t      nbytes = 0;
-    ssize_t     status;
-    uint16_t    tmp16;
+// Header block length fields are 16 bits in SPDY/2 and 32 bits in SPDY/3.
+template <typename T> T
+extract_length(const uint8_t __restrict * &ptr);
 
-    tmp16 = htons(strval.size());
-    compressor.input(&tmp16, sizeof(tmp16));
-    status = compressor.consume(ptr + nbytes, len - nbytes, flags);
-    if (status < 0) {
-        return status;
-    }
+template <> uint16_t
+extract_length<uint16_t>(const uint8_t __restrict * &ptr) {
+    return ntohs(extract<uint16_t>(ptr));
+}
 
-    nbytes += status;
+template <> uint32_t
+extract_length<uint32_t>(const uint8_t __restrict * &ptr) {
+    return ntohl(extract<uint32_t>(ptr));
+}
 
-    compressor.input(strval.c_str(), strval.size());
-    status = compressor.consume(ptr + nbytes, len - nbytes, flags);
-    if (status < 0) {
-        return status;
-    }
+template <typename T> void
+insert_length(size_t len, uint8_t __restrict * &ptr);
 
-    nbytes += status;
-    return nbytes;
+template <> void
+insert_length<uint16_t>(size_t len, uint8_t __restrict * &ptr) {
+    insert<uint16_t>(htons(len), ptr);
 }
 
-static ssize_t
-marshall_name_value_pairs_v2(
+template <> void
+insert_length<uint32_t>(size_t len, uint8_t __restrict * &ptr) {
+    insert<uint32_t>(htonl(len), ptr);
+}
+
+template <typename T> void
+insert_string(const spdy::arena_string& strval, uint8_t __restrict * &ptr)
+{
+    insert_length<T>(strval.size(), ptr);
+    memcpy(ptr, strval.data(), strval.size());
+    std::advance(ptr, strval.size());
+}
+
+// Compress a serialized header block with a single deflate() call.
+// Feeding zlib each length and string separately costs several deflate()
+// calls per header.
+static size_t
+deflate_header_block(
         spdy::zstream<spdy::compress>&  compressor,
-        const spdy::key_value_block&    kvblock,
+        const uint8_t *                 block,
+        size_t                          blocklen,
         uint8_t *                       ptr,
         size_t                          len)
 {
-    size_t      nbytes = 0;
-    ssize_t     status;
-    uint16_t    tmp16;
+    ssize_t nbytes;
 
-    tmp16 = htons(kvblock.size());
-    compressor.input(&tmp16, sizeof(tmp16));
-    status = compressor.consume(ptr + nbytes, len - nbytes, 0);
-    if (status < 0) {
-        return status;
+    compressor.input(block, blocklen);
+    nbytes = compressor.consume(ptr, len, Z_SYNC_FLUSH);
+    if (nbytes < 0 || !compressor.drained() || (size_t)nbytes == len) {
+        // If we filled the buffer, zlib might have more to flush, and we
+        // have no way to get it. Callers should size the buffer with
+        // marshall_bound().
+        throw std::runtime_error("marshalling failure");
     }
 
-    nbytes += status;
+    return nbytes;
+}
 
-    for (auto kv(kvblock.begin()); kv != kvblock.end(); ++kv) {
-        status = marshall_string_v2(
-                compressor, kv->first, ptr + nbytes, len - nbytes, 0);
-        if (status < 0) {
-            return status;
-        }
+template <spdy::protocol_version V> size_t
+spdy::codec<V>::nbytes(const key_value_block& kvblock)
+{
+    size_t nbytes = sizeof(length_type);
 
-        nbytes += status;
+    for (auto ptr(kvblock.begin()); ptr != kvblock.end(); ++ptr) {
+        nbytes += sizeof(length_type) + ptr->first.size();
+        nbytes += sizeof(length_type) + ptr->second.size();
+    }
 
-        status = marshall_string_v2(
-                compressor, kv->second, ptr + nbytes, len - nbytes, 0);
-        if (status < 0) {
-            return status;
-        }
+    return nbytes;
+}
+
+template <spdy::protocol_version V> size_t
+spdy::codec<V>::marshall(
+        zstream<compress>&          compressor,
+        const key_value_block&      kvblock,
+        byte_buffer&                scratch,
+        uint8_t *                   ptr,
+        size_t                      len)
+{
+    scratch.resize(nbytes(kvblock));
+    serialize(kvblock, scratch.data(), scratch.size());
+    return deflate_header_block(compressor, scratch.data(), scratch.size(),
+            ptr, len);
+}
 
-        nbytes += status;
+template <spdy::protocol_version V> size_t
+spdy::codec<V>::serialize(
+        const key_value_block&      kvblock,
+        uint8_t *                   ptr,
+        size_t                      len)
+{
+    uint8_t __restrict * out = ptr;
+
+    if (len < nbytes(kvblock)) {
+        throw std::runtime_error("marshalling failure");
     }
 
-    do  {
-        status = compressor.consume(ptr + nbytes, len - nbytes, Z_SYNC_FLUSH);
-        if (status < 0) {
-            return status;
-        }
-        nbytes += status;
-    } while (status != 0);
+    insert_length<length_type>(kvblock.size(), out);
+    for (auto kv(kvblock.begin()); kv != kvblock.end(); ++kv) {
+        insert_string<length_type>(kv->first, out);
+        insert_string<length_type>(kv->second, out);
+    }
 
-    return nbytes;
+    return std::distance(ptr, out);
 }
 
-static spdy::key_value_block
-parse_name_value_pairs_v2(
-        const uint8_t __restrict * ptr, size_t len)
+template <spdy::protocol_version V> spdy::parse_status
+spdy::codec<V>::parse(
+        const uint8_t __restrict *          ptr,
+        size_t                              len,
+        const key_value_block::visitor_type& visit,
+        unsigned                            max_headers)
 {
-    int32_t npairs;
     const uint8_t __restrict * end = ptr + len;
+    size_t npairs;
 
-    spdy::key_value_block kvblock;
+    if (len < sizeof(length_type)) {
+        return PARSE_SHORT_HEADER_BLOCK;
+    }
 
-    if (len < sizeof(int32_t)) {
-        // XXX throw
+    // Each pair needs at least two length fields, so we can reject a
+    // bogus pair count before visiting any of the headers.
+    npairs = extract_length<length_type>(ptr);
+    if ((size_t)std::distance(ptr, end) / (2 * sizeof(length_type)) < npairs) {
+        return PARSE_SHORT_HEADER_BLOCK;
     }
 
-    npairs = ntohs(extract<int16_t>(ptr));
-    if (npairs < 1) {
-        //
+    if (max_headers && npairs > max_headers) {
+        return PARSE_TOO_MANY_HEADERS;
     }
 
     while (npairs--) {
-        std::string key;
-        std::string val;
-        int32_t nbytes;
+        string_ref key;
+        string_ref val;
+        size_t nbytes;
 
-        if (std::distance(ptr, end) < 8) {
-            // XXX
+        if ((size_t)std::distance(ptr, end) < sizeof(length_type)) {
+            return PARSE_SHORT_HEADER_BLOCK;
         }
 
-        nbytes = ntohs(extract<uint16_t>(ptr));
-        if (std::distance(ptr, end) < nbytes) {
-            // XXX
+        nbytes = extract_length<length_type>(ptr);
+        if ((size_t)std::distance(ptr, end) < nbytes + sizeof(length_type)) {
+            return PARSE_SHORT_HEADER_BLOCK;
         }
 
-        key.assign((const char *)ptr, nbytes);
+        key = string_ref((const char *)ptr, nbytes);
         std::advance(ptr, nbytes);
 
-        nbytes = ntohs(extract<uint16_t>(ptr));
-        if (std::distance(ptr, end) < nbytes) {
-            // XXX
+        nbytes = extract_length<length_type>(ptr);
+        if ((size_t)std::distance(ptr, end) < nbytes) {
+            return PARSE_SHORT_HEADER_BLOCK;
         }
 
-        val.assign((const char *)ptr, nbytes);
+        val = string_ref((const char *)ptr, nbytes);
         std::advance(ptr, nbytes);
 
-        // XXX Extract this assignment section into a lambda. This would let us
-        // parse the kvblock into a key_value_block, or straight into the
-        // corresponding ATS data structures.
-        if (key == "host") {
-            kvblock.url().hostport = val;
-        } else if (key == "scheme") {
-            kvblock.url().scheme = val;
-        } else if (key == "url") {
-            kvblock.url().path = val;
-        } else if (key == "method") {
-            kvblock.url().method = val;
-        } else if (key == "version") {
-            kvblock.url().version = val;
-        } else {
-            kvblock.headers[key] = val;
-        }
+        visit(key, val);
     }
 
-    return kvblock;
+    return PARSE_OK;
 }
 
-spdy::key_value_block
+template struct spdy::codec<spdy::PROTOCOL_VERSION_2>;
+template struct spdy::codec<spdy::PROTOCOL_VERSION_3>;
+
+template <spdy::protocol_version V>
+struct versioned_codec : public spdy::header_codec
+{
+    typedef spdy::codec<V> codec_type;
+
+    versioned_codec() : header_codec(V, spdy::version_traits<V>()) {
+    }
+
+    size_t nbytes(const spdy::key_value_block& kvblock) const {
+        return codec_type::nbytes(kvblock);
+    }
+
+    size_t marshall(spdy::zstream<spdy::compress>& compressor,
+            const spdy::key_value_block& kvblock, spdy::byte_buffer& scratch,
+            uint8_t * ptr, size_t len) const {
+        return codec_type::marshall(compressor, kvblock, scratch, ptr, len);
+    }
+
+    size_t serialize(const spdy::key_value_block& kvblock,
+            uint8_t * ptr, size_t len) const {
+        return codec_type::serialize(kvblock, ptr, len);
+    }
+
+    spdy::parse_status parse(const uint8_t * ptr, size_t len,
+            const spdy::key_value_block::visitor_type& visit,
+            unsigned max_headers) const {
+        return codec_type::parse(ptr, len, visit, max_headers);
+    }
+};
+
+static const versioned_codec<spdy::PROTOCOL_VERSION_2> codec_v2;
+static const versioned_codec<spdy::PROTOCOL_VERSION_3> codec_v3;
+
+const spdy::header_codec *
+spdy::header_codec::get(unsigned version)
+{
+    switch (version) {
+    case PROTOCOL_VERSION_2: return &codec_v2;
+    case PROTOCOL_VERSION_3: return &codec_v3;
+    default: return nullptr;
+    }
+}
+
+size_t
+spdy::header_codec::deflate(
+        zstream<compress>&  compressor,
+        const uint8_t *     block,
+        size_t              blocklen,
+        uint8_t *           ptr,
+        size_t              len)
+{
+    return deflate_header_block(compressor, block, blocklen, ptr, len);
+}
+
+bool
+spdy::url_components::assign(
+        header_id           id,
+        const string_ref&   value)
+{
+    switch (id) {
+    case HEADER_HOST:
+        hostport.assign(value.ptr, value.len);
+        return true;
+    case HEADER_SCHEME:
+        scheme.assign(value.ptr, value.len);
+        return true;
+    case HEADER_PATH:
+        path.assign(value.ptr, value.len);
+        return true;
+    case HEADER_METHOD:
+        method.assign(value.ptr, value.len);
+        return true;
+    case HEADER_VERSION:
+        version.assign(value.ptr, value.len);
+        return true;
+    default:
+        return false;
+    }
+}
+
+void
+spdy::url_components::clear()
+{
+    // Swap in fresh strings rather than calling clear(), which might keep
+    // the arena storage.
+    arena_allocator<char> alloc(method.get_allocator());
+
+    method = arena_string(alloc);
+    scheme = arena_string(alloc);
+    hostport = arena_string(alloc);
+    path = arena_string(alloc);
+    version = arena_string(alloc);
+}
+
+void
 spdy::key_value_block::parse(
         protocol_version            version,
         zstream<decompress>&        decompressor,
         const uint8_t __restrict *  ptr,
-        size_t                      len)
+        size_t                      len,
+        const visitor_type&         visit)
 {
-    std::vector<uint8_t>    bytes;
-    key_value_block         kvblock;
-
-    if (version != PROTOCOL_VERSION_2) {
-        // XXX support v3 and throw a proper damn error.
+    switch (try_parse(version, decompressor, ptr, len, visit)) {
+    case PARSE_OK:
+        return;
+    case PARSE_UNSUPPORTED_VERSION:
         throw std::runtime_error("unsupported version");
+    case PARSE_CORRUPT_HEADER_BLOCK:
+        throw protocol_error(std::string("corrupt header block"));
+    default:
+        throw protocol_error(std::string("short header block"));
     }
+}
+
+spdy::parse_status
+spdy::key_value_block::try_parse(
+        protocol_version            version,
+        zstream<decompress>&        decompressor,
+        const uint8_t __restrict *  ptr,
+        size_t                      len,
+        const visitor_type&         visit)
+{
+    inline_byte_buffer<4096> bytes;
 
     decompressor.input(ptr, len);
     if (decompress_headers(decompressor, bytes) != z_ok) {
-        // XXX
+        return PARSE_CORRUPT_HEADER_BLOCK;
     }
 
-    return parse_name_value_pairs_v2(&bytes[0], bytes.size());
+    return try_parse(version, bytes.data(), bytes.size(), visit);
+}
+
+void
+spdy::key_value_block::parse(
+        protocol_version            version,
+        const uint8_t __restrict *  ptr,
+        size_t                      len,
+        const visitor_type&         visit)
+{
+    switch (try_parse(version, ptr, len, visit)) {
+    case PARSE_OK:
+        return;
+    case PARSE_UNSUPPORTED_VERSION:
+        throw std::runtime_error("unsupported version");
+    default:
+        throw protocol_error(std::string("short header block"));
+    }
+}
+
+spdy::parse_status
+spdy::key_value_block::try_parse(
+        protocol_version            version,
+        const uint8_t __restrict *  ptr,
+        size_t                      len,
+        const visitor_type&         visit)
+{
+    const header_codec * codec = header_codec::get(version);
+
+    if (codec == nullptr) {
+        return PARSE_UNSUPPORTED_VERSION;
+    }
+
+    return codec->parse(ptr, len, visit, 0 /* no limit */);
+}
+
+spdy::key_value_block
+spdy::key_value_block::parse(
+        protocol_version            version,
+        zstream<decompress>&        decompressor,
+        const uint8_t __restrict *  ptr,
+        size_t                      len)
+{
+    key_value_block kvblock;
+
+    parse(version, decompressor, ptr, len,
+        [&kvblock, version](const string_ref& key, const string_ref& val) {
+            if (!kvblock.url().assign(version, key, val)) {
+                kvblock[key].assign(val.ptr, val.len);
+            }
+        }
+    );
+
+    return kvblock;
 }
 
 size_t
@@ -405,67 +665,117 @@ spdy::key_value_block::marshall(
         protocol_version            version,
         spdy::zstream<compress>&    compressor,
         const key_value_block&      kvblock,
+        byte_buffer&                scratch,
         uint8_t *                   ptr,
         size_t                      len)
 {
-    ssize_t nbytes;
+    const header_codec * codec = header_codec::get(version);
 
-    if (version != PROTOCOL_VERSION_2) {
-        // XXX support v3 and throw a proper damn error.
+    if (codec == nullptr) {
         throw std::runtime_error("unsupported version");
     }
 
-    nbytes = marshall_name_value_pairs_v2(compressor, kvblock, ptr, len);
-    if (nbytes < 0) {
-        throw std::runtime_error("marshalling failure");
-    }
+    return codec->marshall(compressor, kvblock, scratch, ptr, len);
+}
 
-    return nbytes;
+size_t
+spdy::key_value_block::marshall(
+        protocol_version            version,
+        spdy::zstream<compress>&    compressor,
+        const key_value_block&      kvblock,
+        uint8_t *                   ptr,
+        size_t                      len)
+{
+    inline_byte_buffer<2048> scratch;
+    return marshall(version, compressor, kvblock, scratch, ptr, len);
+}
+
+size_t
+spdy::key_value_block::marshall_bound(
+        protocol_version            version,
+        spdy::zstream<compress>&    compressor) const
+{
+    return compressor.bound(nbytes(version));
 }
 
 size_t
 spdy::key_value_block::nbytes(protocol_version version) const
 {
-    size_t nbytes = 0;
-    size_t lensz;
+    const header_codec * codec = header_codec::get(version);
 
-    // Length fields are 2 bytes in SPDYv2 and 4 in later versions.
-    switch (version) {
-    case PROTOCOL_VERSION_3: lensz = 4; break;
-    case PROTOCOL_VERSION_2: lensz = 2; break;
-    default:
+    if (codec == nullptr) {
         throw std::runtime_error("unsupported version");
     }
 
-    nbytes += lensz;
-    for (auto ptr(begin()); ptr != end(); ++ptr) {
-        nbytes += lensz + ptr->first.size();
-        nbytes += lensz + ptr->second.size();
+    return codec->nbytes(*this);
+}
+
+// Order header names against a key without making a string for the key,
+// since that might have to allocate.
+static inline bool
+key_less(const spdy::key_value_block::map_type::value_type& kv,
+        const spdy::string_ref& key)
+{
+    const spdy::arena_string& name(kv.first);
+    int cmp = memcmp(name.data(), key.ptr, std::min(name.size(), key.len));
+    return cmp < 0 || (cmp == 0 && name.size() < key.len);
+}
+
+static inline bool
+key_equal(const spdy::arena_string& name, const spdy::string_ref& key)
+{
+    return name.size() == key.len && memcmp(name.data(), key.ptr, key.len) == 0;
+}
+
+void
+spdy::key_value_block::insert(
+        const string_ref&   key,
+        const string_ref&   value)
+{
+    arena_string name(key.ptr, key.len, alloc);
+
+    if (!name.empty()) {
+        normalize_header_name(name.data(), &name[0], name.size());
     }
 
-    return nbytes;
+    string_ref ref(name.data(), name.size());
+    iterator pos(headers.lower_bound(ref, key_less));
+    if (pos != headers.end() && key_equal(pos->first, ref)) {
+        pos->second.assign(value.ptr, value.len);
+        return;
+    }
+
+    headers.insert(pos, map_type::value_type(std::move(name),
+                arena_string(value.ptr, value.len, alloc)));
 }
 
-struct lowercase : public std::unary_function<char, char>
+spdy::arena_string&
+spdy::key_value_block::operator[](const string_ref& key)
 {
-    char operator() (char c) const {
-        // Return the lowercase ASCII only if it's in the uppercase
-        // ASCII range.
-        if (c > 0x40 && c < 0x5b) {
-            return c + 0x20;
-        }
+    iterator pos(headers.lower_bound(key, key_less));
 
-        return c;
+    if (pos != headers.end() && key_equal(pos->first, key)) {
+        return pos->second;
     }
-};
 
-void
-spdy::key_value_block::insert(
-        std::string key,
-        std::string value)
+    // Don't use headers[], since the new value would be allocated from the
+    // heap rather than from our arena. We already know where the key goes,
+    // so don't search again.
+    return headers.insert(pos, map_type::value_type(
+                arena_string(key.ptr, key.len, alloc),
+                arena_string(alloc)))->second;
+}
+
+spdy::key_value_block::const_iterator
+spdy::key_value_block::find(const string_ref& key) const
 {
-    std::transform(key.begin(), key.end(), key.begin(), lowercase());
-    headers[key] = value;
+    const_iterator pos(headers.lower_bound(key, key_less));
+
+    if (pos != headers.end() && key_equal(pos->first, key)) {
+        return pos;
+    }
+
+    return headers.end();
 }
 
 spdy::ping_message
@@ -474,14 +784,25 @@ spdy::ping_message::parse(
 {
     ping_message msg;
 
-    if (len < ping_message::size) {
+    if (try_parse(ptr, len, msg) != PARSE_OK) {
         throw protocol_error(std::string("short ping message"));
     }
 
-    msg.ping_id = ntohl(extract<uint32_t>(ptr));
     return msg;
 }
 
+spdy::parse_status
+spdy::ping_message::try_parse(
+        const uint8_t __restrict * ptr, size_t len, ping_message& msg)
+{
+    if (len < ping_message::size) {
+        return PARSE_SHORT_FRAME;
+    }
+
+    msg.ping_id = ntohl(extract<uint32_t>(ptr));
+    return PARSE_OK;
+}
+
 size_t
 spdy::ping_message::marshall(
         const ping_message& msg, uint8_t __restrict * ptr, size_t len)
@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2012 James Peach
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "normalize.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+
+// The vector kernels are written once against these wrappers, which map
+// onto AVX2 or SSE2 intrinsics. Byte compares are signed, so bytes with
+// the high bit set compare less than any ASCII character.
+#if defined(__AVX2__)
+typedef __m256i vec;
+#define vec_load(p)         _mm256_loadu_si256((const __m256i *)(p))
+#define vec_store(p, v)     _mm256_storeu_si256((__m256i *)(p), v)
+#define vec_set(c)          _mm256_set1_epi8(c)
+#define vec_zero()          _mm256_setzero_si256()
+#define vec_or(a, b)        _mm256_or_si256(a, b)
+#define vec_and(a, b)       _mm256_and_si256(a, b)
+#define vec_add(a, b)       _mm256_add_epi8(a, b)
+#define vec_eq(a, c)        _mm256_cmpeq_epi8(a, vec_set(c))
+#define vec_gt(a, c)        _mm256_cmpgt_epi8(a, vec_set(c))
+#define vec_lt(a, c)        _mm256_cmpgt_epi8(vec_set(c), a)
+#define vec_any(v)          (_mm256_movemask_epi8(v) != 0)
+#else
+typedef __m128i vec;
+#define vec_load(p)         _mm_loadu_si128((const __m128i *)(p))
+#define vec_store(p, v)     _mm_storeu_si128((__m128i *)(p), v)
+#define vec_set(c)          _mm_set1_epi8(c)
+#define vec_zero()          _mm_setzero_si128()
+#define vec_or(a, b)        _mm_or_si128(a, b)
+#define vec_and(a, b)       _mm_and_si128(a, b)
+#define vec_add(a, b)       _mm_add_epi8(a, b)
+#define vec_eq(a, c)        _mm_cmpeq_epi8(a, vec_set(c))
+#define vec_gt(a, c)        _mm_cmpgt_epi8(a, vec_set(c))
+#define vec_lt(a, c)        _mm_cmplt_epi8(a, vec_set(c))
+#define vec_any(v)          (_mm_movemask_epi8(v) != 0)
+#endif
+
+// Mask of the bytes in [lo, hi].
+#define vec_range(v, lo, hi) vec_and(vec_gt(v, (lo) - 1), vec_lt(v, (hi) + 1))
+
+// Most header names are shorter than a vector, so we want to handle the
+// tail with a vector too, but without reading past the end of the input.
+// Instead of padding, we fill the vector with overlapping pieces of the
+// input, so that every lane holds one of its bytes and there is nothing
+// to mask off. The checks don't care about duplicate bytes, and storing
+// the pieces back writes the same value to a duplicated byte twice.
+static inline __m128i
+load_short(const uint8_t * ptr, size_t len)
+{
+    uint32_t lo, hi;
+
+    if (len >= 8) {
+        return _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)ptr),
+                _mm_loadl_epi64((const __m128i *)(ptr + len - 8)));
+    }
+
+    if (len >= 4) {
+        memcpy(&lo, ptr, 4);
+        memcpy(&hi, ptr + len - 4, 4);
+        return _mm_set_epi32(hi, lo, hi, lo);
+    }
+
+    // The first, middle and last bytes cover up to 3 bytes.
+    lo = ptr[0] | (ptr[len / 2] << 8) | (ptr[len - 1] << 16) | (ptr[0] << 24);
+    return _mm_set1_epi32(lo);
+}
+
+static inline void
+store_short(uint8_t * ptr, size_t len, __m128i v)
+{
+    uint32_t lo, hi;
+
+    if (len >= 8) {
+        _mm_storel_epi64((__m128i *)(ptr + len - 8), _mm_unpackhi_epi64(v, v));
+        _mm_storel_epi64((__m128i *)ptr, v);
+        return;
+    }
+
+    lo = _mm_cvtsi128_si32(v);
+    if (len >= 4) {
+        hi = _mm_cvtsi128_si32(_mm_srli_si128(v, 4));
+        memcpy(ptr + len - 4, &hi, 4);
+        memcpy(ptr, &lo, 4);
+        return;
+    }
+
+    ptr[len - 1] = lo >> 16;
+    ptr[len / 2] = lo >> 8;
+    ptr[0] = lo;
+}
+
+#if defined(__AVX2__)
+
+static inline vec
+vec_load_short(const uint8_t * ptr, size_t len)
+{
+    if (len >= 16) {
+        return _mm256_inserti128_si256(_mm256_castsi128_si256(
+                    _mm_loadu_si128((const __m128i *)ptr)),
+                _mm_loadu_si128((const __m128i *)(ptr + len - 16)), 1);
+    }
+
+    return _mm256_broadcastsi128_si256(load_short(ptr, len));
+}
+
+static inline void
+vec_store_short(uint8_t * ptr, size_t len, vec v)
+{
+    if (len >= 16) {
+        _mm_storeu_si128((__m128i *)(ptr + len - 16),
+                _mm256_extracti128_si256(v, 1));
+        _mm_storeu_si128((__m128i *)ptr, _mm256_castsi256_si128(v));
+        return;
+    }
+
+    store_short(ptr, len, _mm256_castsi256_si128(v));
+}
+
+#else
+
+#define vec_load_short(p, n)        load_short(p, n)
+#define vec_store_short(p, n, v)    store_short(p, n, v)
+
+#endif
+
+static inline void
+name_kernel(vec v, vec& upper, vec& invalid, vec& lowered)
+{
+    vec u = vec_range(v, 'A', 'Z');
+
+    // Controls, space, DEL and non-ASCII, then the separators.
+    vec bad = vec_or(vec_lt(v, 0x21), vec_eq(v, 0x7f));
+    bad = vec_or(bad, vec_or(vec_eq(v, '"'), vec_eq(v, ',')));
+    bad = vec_or(bad, vec_or(vec_eq(v, '/'), vec_eq(v, '{')));
+    bad = vec_or(bad, vec_eq(v, '}'));
+    bad = vec_or(bad, vec_range(v, '(', ')'));
+    bad = vec_or(bad, vec_range(v, ':', '@'));
+    bad = vec_or(bad, vec_range(v, '[', ']'));
+
+    upper = u;
+    invalid = bad;
+    lowered = vec_add(v, vec_and(u, vec_set(0x20)));
+}
+
+static unsigned
+vector_header_name(const uint8_t * src, uint8_t * dst, size_t len)
+{
+    vec         upper = vec_zero();
+    vec         invalid = vec_zero();
+    vec         u, bad, lowered;
+    unsigned    flags = 0;
+    size_t      i;
+
+    for (i = 0; i + sizeof(vec) <= len; i += sizeof(vec)) {
+        name_kernel(vec_load(src + i), u, bad, lowered);
+        upper = vec_or(upper, u);
+        invalid = vec_or(invalid, bad);
+
+        if (dst) {
+            vec_store(dst + i, lowered);
+        }
+    }
+
+    // Finish with a vector that ends at the end of the input. If the
+    // input is at least a vector long, this overlaps the bytes we have
+    // done already, which is harmless even when lowering in place.
+    if (i < len && len >= sizeof(vec)) {
+        i = len - sizeof(vec);
+        name_kernel(vec_load(src + i), u, bad, lowered);
+        upper = vec_or(upper, u);
+        invalid = vec_or(invalid, bad);
+
+        if (dst) {
+            vec_store(dst + i, lowered);
+        }
+    } else if (i < len) {
+        name_kernel(vec_load_short(src, len), u, bad, lowered);
+        upper = vec_or(upper, u);
+        invalid = vec_or(invalid, bad);
+
+        if (dst) {
+            vec_store_short(dst, len, lowered);
+        }
+    }
+
+    if (vec_any(upper)) {
+        flags |= spdy::HEADER_NAME_UPPERCASE;
+    }
+
+    if (vec_any(invalid)) {
+        flags |= spdy::HEADER_NAME_INVALID;
+    }
+
+    return flags;
+}
+
+static unsigned
+vector_header_value(const uint8_t * src, size_t len)
+{
+    vec         nul = vec_zero();
+    vec         crlf = vec_zero();
+    unsigned    flags = 0;
+    size_t      i;
+
+    for (i = 0; i + sizeof(vec) <= len; i += sizeof(vec)) {
+        vec v = vec_load(src + i);
+
+        nul = vec_or(nul, vec_eq(v, '\0'));
+        crlf = vec_or(crlf, vec_or(vec_eq(v, '\r'), vec_eq(v, '\n')));
+    }
+
+    if (i < len) {
+        vec v = (len >= sizeof(vec)) ?
+            vec_load(src + len - sizeof(vec)) : vec_load_short(src, len);
+
+        nul = vec_or(nul, vec_eq(v, '\0'));
+        crlf = vec_or(crlf, vec_or(vec_eq(v, '\r'), vec_eq(v, '\n')));
+    }
+
+    if (vec_any(nul)) {
+        flags |= spdy::HEADER_VALUE_NUL;
+    }
+
+    if (vec_any(crlf)) {
+        flags |= spdy::HEADER_VALUE_CRLF;
+    }
+
+    return flags;
+}
+
+#define header_name_kernel vector_header_name
+#define header_value_kernel vector_header_value
+
+#else
+
+// HTTP token characters are the visible ASCII characters except for the
+// separators (RFC 2616, section 2.2).
+static inline bool
+is_token_char(uint8_t c)
+{
+    switch (c) {
+    case '"': case '(': case ')': case ',': case '/': case ':': case ';':
+    case '<': case '=': case '>': case '?': case '@': case '[': case '\\':
+    case ']': case '{': case '}':
+        return false;
+    default:
+        return c > 0x20 && c < 0x7f;
+    }
+}
+
+static unsigned
+scalar_header_name(const uint8_t * src, uint8_t * dst, size_t len)
+{
+    unsigned flags = 0;
+
+    for (size_t i = 0; i < len; ++i) {
+        uint8_t c = src[i];
+
+        if (c >= 'A' && c <= 'Z') {
+            flags |= spdy::HEADER_NAME_UPPERCASE;
+            c += 0x20;
+        } else if (!is_token_char(c)) {
+            flags |= spdy::HEADER_NAME_INVALID;
+        }
+
+        if (dst) {
+            dst[i] = c;
+        }
+    }
+
+    return flags;
+}
+
+static unsigned
+scalar_header_value(const uint8_t * src, size_t len)
+{
+    unsigned flags = 0;
+
+    for (size_t i = 0; i < len; ++i) {
+        switch (src[i]) {
+        case '\0':
+            flags |= spdy::HEADER_VALUE_NUL;
+            break;
+        case '\r': case '\n':
+            flags |= spdy::HEADER_VALUE_CRLF;
+            break;
+        }
+    }
+
+    return flags;
+}
+
+#define header_name_kernel scalar_header_name
+#define header_value_kernel scalar_header_value
+
+#endif
+
+unsigned
+spdy::normalize_header_name(const char * name, char * dst, size_t len)
+{
+    const uint8_t * src = (const uint8_t *)name;
+    uint8_t *       out = (uint8_t *)dst;
+
+    // SPDY/3 request and status line headers have a leading ':'.
+    if (len > 1 && src[0] == ':') {
+        if (out) {
+            *out++ = ':';
+        }
+
+        ++src;
+        --len;
+    }
+
+    if (len == 0) {
+        return HEADER_NAME_INVALID;
+    }
+
+    return header_name_kernel(src, out, len);
+}
+
+unsigned
+spdy::check_header_value(const char * value, size_t len)
+{
+    return header_value_kernel((const uint8_t *)value, len);
+}
+
+/* vim: set sw=4 ts=4 tw=79 et : */
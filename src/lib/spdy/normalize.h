@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2012 James Peach
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NORMALIZE_H_A3E05C8F_71D4_4F29_B6E1_94C2D85A0B3E
+#define NORMALIZE_H_A3E05C8F_71D4_4F29_B6E1_94C2D85A0B3E
+
+#include <stddef.h>
+
+namespace spdy {
+
+// Header name and value checks. The kernels are vectorized with AVX2 or
+// SSE2, depending on what the compiler targets, with a scalar fallback.
+enum header_check : unsigned
+{
+    HEADER_NAME_UPPERCASE   = 0x01, // name has upper-case ASCII
+    HEADER_NAME_INVALID     = 0x02, // name is empty or is not an HTTP token
+    HEADER_VALUE_NUL        = 0x04, // value has a NUL (value separator)
+    HEADER_VALUE_CRLF       = 0x08, // value has a CR or LF
+};
+
+// Check that the header name is an HTTP token, optionally with a leading
+// ':' for SPDY/3 names. If dst is not null, store the lower-cased name
+// there; dst can be the same as name. Return the header_check flags.
+unsigned normalize_header_name(const char * name, char * dst, size_t len);
+
+// Check the header value for NUL, CR and LF. Return the header_check
+// flags.
+unsigned check_header_value(const char * value, size_t len);
+
+// Lower-case the name in place and check both name and value.
+inline unsigned
+normalize_header(char * name, size_t nlen, const char * value, size_t vlen)
+{
+    return normalize_header_name(name, name, nlen) |
+        check_header_value(value, vlen);
+}
+
+// Check a header that we received, without modifying it.
+inline unsigned
+check_header(const char * name, size_t nlen, const char * value, size_t vlen)
+{
+    return normalize_header_name(name, nullptr, nlen) |
+        check_header_value(value, vlen);
+}
+
+} // namespace spdy
+
+#endif /* NORMALIZE_H_A3E05C8F_71D4_4F29_B6E1_94C2D85A0B3E */
+/* vim: set sw=4 ts=4 tw=79 et : */
@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2012 James Peach
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "reader.h"
+#include <algorithm>
+#include <string.h>
+
+// Return the size of the fixed frame body that precedes the compressed
+// header block, or 0 if this frame type does not have a header block.
+static size_t
+header_block_offset(const spdy::message_header& hdr)
+{
+    spdy::protocol_version version =
+        (spdy::protocol_version)hdr.control.version;
+
+    switch (hdr.control.type) {
+    case spdy::CONTROL_SYN_STREAM:
+        return spdy::syn_stream_message::size;
+    case spdy::CONTROL_SYN_REPLY:
+        return spdy::syn_reply_message::size(version);
+    case spdy::CONTROL_HEADERS:
+        // Stream-ID, plus 2 unused bytes in SPDYv2.
+        return (version == spdy::PROTOCOL_VERSION_2) ? 6 : 4;
+    default:
+        return 0;
+    }
+}
+
+spdy::frame_reader::frame_reader(zstream<decompress>& z, const frame_limits& l)
+    : decompressor(z), limits(l), state(frame_header), error(PARSE_OK), hdr(),
+    nhbytes(0), nfixed(0),
+    remaining(0), body(), hblock()
+{
+}
+
+void
+spdy::frame_reader::reset()
+{
+    state = frame_header;
+    nhbytes = nfixed = remaining = 0;
+
+    // Keep the buffer capacity around for the next frame.
+    body.clear();
+    hblock.clear();
+}
+
+void
+spdy::frame_reader::fail(parse_status status)
+{
+    error = status;
+    state = frame_error;
+}
+
+void
+spdy::frame_reader::begin_body()
+{
+    remaining = hdr.datalen;
+
+    // DATA frames are not buffered, so only control frames count against
+    // the frame size limit.
+    if (hdr.is_control && limits.max_frame_size &&
+            hdr.datalen > limits.max_frame_size) {
+        fail(PARSE_FRAME_TOO_LARGE);
+        return;
+    }
+
+    if (hdr.is_control) {
+        nfixed = header_block_offset(hdr);
+        if (nfixed == 0) {
+            nfixed = hdr.datalen;
+        }
+
+        nfixed = std::min<size_t>(nfixed, hdr.datalen);
+        body.reserve(nfixed);
+        state = frame_body;
+    } else {
+        state = frame_data;
+    }
+
+    if (remaining == 0) {
+        state = frame_complete;
+    }
+}
+
+size_t
+spdy::frame_reader::consume(const uint8_t * ptr, size_t len)
+{
+    size_t count = 0;
+    size_t nbytes;
+
+    if (state == frame_complete) {
+        reset();
+    }
+
+    while (count < len && state != frame_complete && state != frame_error) {
+        switch (state) {
+        case frame_header:
+            nbytes = std::min(len - count, sizeof(hbytes) - nhbytes);
+            memcpy(hbytes + nhbytes, ptr + count, nbytes);
+            nhbytes += nbytes;
+            count += nbytes;
+
+            if (nhbytes == sizeof(hbytes)) {
+                message_header::try_parse(hbytes, sizeof(hbytes), hdr);
+                begin_body();
+            }
+
+            break;
+
+        case frame_body:
+            nbytes = std::min(len - count, nfixed - body.size());
+            body.append(ptr + count, nbytes);
+            remaining -= nbytes;
+            count += nbytes;
+
+            if (remaining == 0) {
+                state = frame_complete;
+            } else if (body.size() == nfixed) {
+                state = frame_header_block;
+            }
+
+            break;
+
+        case frame_header_block:
+            nbytes = std::min(len - count, remaining);
+            decompressor.input(ptr + count, nbytes);
+            switch (decompress_headers(decompressor, hblock,
+                        limits.max_header_bytes)) {
+            case z_ok:
+                break;
+            case z_buffer_error:
+                fail(PARSE_HEADER_BLOCK_TOO_LARGE);
+                return count;
+            default:
+                fail(PARSE_CORRUPT_HEADER_BLOCK);
+                return count;
+            }
+
+            remaining -= nbytes;
+            count += nbytes;
+
+            if (remaining == 0) {
+                state = frame_complete;
+            }
+
+            break;
+
+        case frame_data:
+            nbytes = std::min(len - count, remaining);
+            remaining -= nbytes;
+            count += nbytes;
+
+            if (remaining == 0) {
+                state = frame_complete;
+            }
+
+            break;
+
+        case frame_complete:
+        case frame_error:
+            break;
+        }
+    }
+
+    return count;
+}
+
+/* vim: set sw=4 ts=4 tw=79 et : */
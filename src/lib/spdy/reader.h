@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2012 James Peach
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef READER_H_6F1D2A4B_93C7_4E8A_B5D0_7A2E9C3F1B64
+#define READER_H_6F1D2A4B_93C7_4E8A_B5D0_7A2E9C3F1B64
+
+#include "spdy.h"
+
+namespace spdy {
+
+// Resumable SPDY frame reader. The reader accepts bytes in whatever chunks
+// the transport happens to have them, so a frame can be split across any
+// number of buffer blocks. The frame header and any fixed-size frame body
+// are gathered into internal buffers. Compressed header blocks are fed
+// chunk by chunk through the decompressor, so they are never linearized.
+// DATA frame payloads are skipped.
+//
+// The reader never throws on malformed input. If the header block fails to
+// inflate, or a frame breaks the limits, the reader stops in an error state
+// and status() says why. We can't skip the rest of a header block without
+// inflating it, so the decompressor state is lost at that point and the
+// session is unusable.
+struct frame_reader
+{
+    explicit frame_reader(zstream<decompress>&,
+            const frame_limits& = frame_limits());
+
+    // Consume bytes up to the end of the current frame, returning the
+    // number of bytes consumed. If complete() is true after this, the frame
+    // is available until the next call to consume().
+    size_t consume(const uint8_t *, size_t);
+
+    bool complete() const {
+        return state == frame_complete;
+    }
+
+    bool failed() const {
+        return state == frame_error;
+    }
+
+    parse_status status() const {
+        return error;
+    }
+
+    const message_header& header() const {
+        return hdr;
+    }
+
+    // The frame body, or for frames that carry a header block, just the
+    // fixed part of the frame body that precedes the header block.
+    const uint8_t * payload() const { return body.data(); }
+    size_t payload_size() const { return body.size(); }
+
+    // The decompressed name/value header block.
+    const uint8_t * header_block() const { return hblock.data(); }
+    size_t header_block_size() const { return hblock.size(); }
+
+private:
+    enum state_type : unsigned {
+        frame_header,       // gathering the frame header
+        frame_body,         // gathering the fixed part of the frame body
+        frame_header_block, // decompressing the header block
+        frame_data,         // skipping the DATA frame payload
+        frame_complete,
+        frame_error         // stuck on a malformed frame
+    };
+
+    frame_reader(const frame_reader&); // disable
+    frame_reader& operator=(const frame_reader&); // disable
+
+    void reset();
+    void begin_body();
+
+    void fail(parse_status);
+
+    zstream<decompress>&    decompressor;
+    const frame_limits      limits;
+    state_type              state;
+    parse_status            error;
+    message_header          hdr;
+    uint8_t                 hbytes[message_header::size];
+    size_t                  nhbytes;    // frame header bytes gathered
+    size_t                  nfixed;     // size of the fixed frame body
+    size_t                  remaining;  // frame body bytes to go
+    byte_buffer             body;
+    byte_buffer             hblock;
+};
+
+} // namespace spdy
+
+#endif /* READER_H_6F1D2A4B_93C7_4E8A_B5D0_7A2E9C3F1B64 */
+/* vim: set sw=4 ts=4 tw=79 et : */
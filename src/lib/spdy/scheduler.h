@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2012 James Peach
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SCHEDULER_H_9C41E07B_6D2A_4B8F_A3E5_17F0C82D4B69
+#define SCHEDULER_H_9C41E07B_6D2A_4B8F_A3E5_17F0C82D4B69
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "stream_table.h"
+
+namespace spdy {
+
+// Per-stream output queues, drawn from by strict priority and round-robin
+// among the streams at the same priority. Priority 0 is the highest, as in
+// the SYN_STREAM priority field.
+//
+// Elements are intrusive; T must have a "T * next" member, which belongs to
+// the scheduler while the element is queued. A stream's queue exists only
+// while it holds elements, and a stream keeps the priority it had when its
+// queue was created. pop() takes one element from the stream at the front
+// of the highest non-empty priority level and moves that stream to the back
+// of its level, so streams at the same priority take turns element by
+// element.
+template <typename T>
+struct output_scheduler
+{
+    enum : unsigned { levels = 8 };
+
+    output_scheduler() : active(0), count(0) {
+        std::fill(rings, rings + levels, nullptr);
+    }
+
+    ~output_scheduler() {
+        for (auto ptr(queues.begin()); ptr != queues.end(); ++ptr) {
+            delete ptr->second;
+        }
+    }
+
+    // Number of queued elements.
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    void push(unsigned stream_id, unsigned priority, T * elem) {
+        stream_queue * q = queues.find(stream_id);
+
+        if (q == nullptr) {
+            std::unique_ptr<stream_queue> tmp(new stream_queue(stream_id,
+                        std::min(priority, levels - 1u)));
+            queues.insert(stream_id, tmp.get());
+            q = tmp.release();
+            activate(q);
+        }
+
+        elem->next = nullptr;
+        if (q->tail) {
+            q->tail->next = elem;
+        } else {
+            q->head = elem;
+        }
+
+        q->tail = elem;
+        ++count;
+    }
+
+    // Take the next element to write, or return null if there are none.
+    T * pop() {
+        if (active == 0) {
+            return nullptr;
+        }
+
+        unsigned level = __builtin_ctz(active);
+        stream_queue * q = rings[level]->ring_next;
+        T * elem = q->head;
+
+        q->head = elem->next;
+        elem->next = nullptr;
+        --count;
+
+        if (q->head) {
+            // Round-robin: the next stream at this level goes first.
+            rings[level] = q;
+        } else {
+            deactivate(q);
+            queues.erase(q->stream_id);
+            delete q;
+        }
+
+        return elem;
+    }
+
+    // Remove a stream's queue and return its elements, in the order they
+    // were pushed and linked through "next", or null if it has none. The
+    // caller owns the elements.
+    T * erase(unsigned stream_id) {
+        stream_queue * q = queues.erase(stream_id);
+
+        if (q == nullptr) {
+            return nullptr;
+        }
+
+        deactivate(q);
+        for (T * elem = q->head; elem; elem = elem->next) {
+            --count;
+        }
+
+        T * head = q->head;
+        delete q;
+        return head;
+    }
+
+private:
+    struct stream_queue
+    {
+        stream_queue(unsigned id, unsigned p)
+            : head(nullptr), tail(nullptr), ring_next(nullptr),
+            stream_id(id), priority(p) {
+        }
+
+        T *             head;
+        T *             tail;
+        stream_queue *  ring_next;  // next stream at the same priority
+        unsigned        stream_id;
+        unsigned        priority;
+    };
+
+    // Add the queue to the back of its priority level. Each level is a
+    // circular list, and rings[] points at its last queue.
+    void activate(stream_queue * q) {
+        stream_queue *& tail = rings[q->priority];
+
+        if (tail) {
+            q->ring_next = tail->ring_next;
+            tail->ring_next = q;
+        } else {
+            q->ring_next = q;
+            active |= 1u << q->priority;
+        }
+
+        tail = q;
+    }
+
+    // Remove the queue from its priority level. pop() always removes the
+    // queue at the front, which follows the tail, so only erase() has to
+    // walk the ring.
+    void deactivate(stream_queue * q) {
+        stream_queue *& tail = rings[q->priority];
+        stream_queue * prev = tail;
+
+        while (prev->ring_next != q) {
+            prev = prev->ring_next;
+        }
+
+        if (prev == q) {
+            tail = nullptr;
+            active &= ~(1u << q->priority);
+        } else {
+            prev->ring_next = q->ring_next;
+            if (tail == q) {
+                tail = prev;
+            }
+        }
+    }
+
+    output_scheduler(const output_scheduler&); // disable
+    output_scheduler& operator=(const output_scheduler&); // disable
+
+    stream_table<stream_queue>  queues;
+    stream_queue *              rings[levels];
+    unsigned                    active;     // bitmask of non-empty levels
+    size_t                      count;
+};
+
+// Queue of stream IDs that are waiting to be started, ordered by priority
+// and then by arrival. Priority 0 is the highest. This is a binary heap in
+// a vector, so an idle session costs nothing but an empty vector.
+struct dispatch_queue
+{
+    dispatch_queue() : seqno(0) {}
+
+    size_t size() const { return heap.size(); }
+    bool empty() const { return heap.empty(); }
+
+    void push(unsigned stream_id, unsigned priority) {
+        // The sequence number breaks ties, so streams of the same priority
+        // come out in the order they were pushed.
+        uint64_t key = ((uint64_t)priority << 32) | seqno++;
+
+        heap.push_back(entry(key, stream_id));
+        std::push_heap(heap.begin(), heap.end(), std::greater<entry>());
+    }
+
+    // Take the stream that should start next. Return 0, which is never a
+    // valid stream ID, if the queue is empty.
+    unsigned pop() {
+        unsigned stream_id;
+
+        if (heap.empty()) {
+            return 0;
+        }
+
+        std::pop_heap(heap.begin(), heap.end(), std::greater<entry>());
+        stream_id = heap.back().second;
+        heap.pop_back();
+        return stream_id;
+    }
+
+private:
+    typedef std::pair<uint64_t, unsigned> entry;
+
+    std::vector<entry>  heap;
+    uint32_t            seqno;
+};
+
+} // namespace spdy
+
+#endif /* SCHEDULER_H_9C41E07B_6D2A_4B8F_A3E5_17F0C82D4B69 */
+/* vim: set sw=4 ts=4 tw=79 et : */
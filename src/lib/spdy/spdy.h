@@ -19,10 +19,17 @@
 
 #include <inttypes.h>
 #include <stddef.h>
+#include <string.h>
+#include <algorithm>
 #include <stdexcept>
 #include <string>
-#include <map>
+#include <vector>
+#include <functional>
 
+#include <base/flat_map.h>
+#include "arena.h"
+#include "buffer.h"
+#include "headers.h"
 #include "zstream.h"
 
 namespace spdy {
@@ -42,12 +49,67 @@ namespace spdy {
         FLAG_COMPRESSED     = 2
    };
 
+    // Per-version protocol details. The header block codec is specialized
+    // on these at compile time (see codec.h).
+    template <protocol_version V> struct version_traits;
+
+    template <> struct version_traits<PROTOCOL_VERSION_2>
+    {
+        typedef uint16_t length_type;   // header block length fields
+        enum : unsigned {
+            syn_reply_size = 6,         // Stream-ID and 2 unused bytes
+            goaway_size = 4             // no status code
+        };
+
+        static const char * status_header() { return "status"; }
+        static const char * version_header() { return "version"; }
+        static const zdictionary& dictionary() { return dictionary_v2; }
+    };
+
+    template <> struct version_traits<PROTOCOL_VERSION_3>
+    {
+        typedef uint32_t length_type;
+        enum : unsigned {
+            syn_reply_size = 4,
+            goaway_size = 8
+        };
+
+        static const char * status_header() { return ":status"; }
+        static const char * version_header() { return ":version"; }
+        static const zdictionary& dictionary() { return dictionary_v3; }
+    };
+
     struct protocol_error : public std::runtime_error {
         explicit protocol_error(const std::string& msg)
             : std::runtime_error(msg) {
         }
     };
 
+    // Result of the try_parse() functions. These never throw, so that a
+    // flood of malformed frames doesn't cost us an exception unwind each.
+    enum parse_status : unsigned {
+        PARSE_OK = 0,
+        PARSE_SHORT_FRAME,          // too short for the fixed frame fields
+        PARSE_SHORT_HEADER_BLOCK,   // name/value block is truncated
+        PARSE_CORRUPT_HEADER_BLOCK, // name/value block failed to inflate
+        PARSE_UNSUPPORTED_VERSION,
+        PARSE_FRAME_TOO_LARGE,      // over frame_limits::max_frame_size
+        PARSE_HEADER_BLOCK_TOO_LARGE, // over frame_limits::max_header_bytes
+        PARSE_TOO_MANY_HEADERS      // over frame_limits::max_headers
+    };
+
+    // Limits on what a peer can make us buffer. A small compressed header
+    // block can inflate to megabytes, so we cap the decompressed size as
+    // well as the frame size. Zero means no limit.
+    struct frame_limits
+    {
+        frame_limits()
+            : max_frame_size(0), max_header_bytes(0), max_headers(0) {}
+        unsigned max_frame_size;    // control frame length
+        unsigned max_header_bytes;  // decompressed header block length
+        unsigned max_headers;       // name/value pairs in a header block
+    };
+
     enum control_frame_type : unsigned {
         CONTROL_SYN_STREAM      = 1,
         CONTROL_SYN_REPLY       = 2,
@@ -106,10 +168,60 @@ namespace spdy {
         uint32_t    datalen;
 
         static message_header parse(const uint8_t *, size_t);
+        static parse_status try_parse(const uint8_t *, size_t, message_header&);
         static size_t marshall(const message_header&, uint8_t *, size_t);
         enum : unsigned { size = 8 }; /* bytes */
     };
 
+    // Cuts a response body into DATA frame payloads. Frames are target
+    // bytes long, except that the last frame of a batch takes whatever is
+    // left rather than wait for more content. The body ends at the end of
+    // the content length if we know it, else at the end of the origin
+    // response, and the frame that ends it carries FIN.
+    struct data_framer
+    {
+        enum : unsigned {
+            // A DATA frame of this size fills one maximum size TLS record.
+            default_target = 16384 - message_header::size
+        };
+
+        // A negative content length means that it is unknown.
+        explicit data_framer(size_t t = default_target, int64_t length = -1)
+            : target(t), remaining(length) {
+        }
+
+        // Take the next frame from nbytes of buffered content, where eos
+        // says that no more content will come. Return the payload length,
+        // and set fin if the frame ends the body. A tail shorter than the
+        // target is held back until more content fills the frame, unless
+        // it ends the body or flush is set. Content past the content
+        // length is never framed. A zero length without fin means there is
+        // nothing to send yet.
+        size_t next(size_t nbytes, bool eos, bool flush, bool& fin) {
+            if (remaining >= 0 && (uint64_t)remaining < nbytes) {
+                nbytes = remaining;
+            }
+
+            size_t len = std::min(nbytes, target);
+            bool last = (int64_t)len == remaining || (eos && len == nbytes);
+
+            if (len < target && !last && !flush) {
+                fin = false;
+                return 0;
+            }
+
+            if (remaining >= 0) {
+                remaining -= len;
+            }
+
+            fin = last;
+            return len;
+        }
+
+        size_t  target;
+        int64_t remaining;  // content bytes left to frame, or -1
+    };
+
     // SYN_STREAM frame:
     //
     // +------------------------------------+
@@ -141,6 +253,7 @@ namespace spdy {
         unsigned header_count;
 
         static syn_stream_message parse(const uint8_t *, size_t);
+        static parse_status try_parse(const uint8_t *, size_t, syn_stream_message&);
         enum : unsigned { size = 10 }; /* bytes */
     };
 
@@ -173,7 +286,11 @@ namespace spdy {
         static size_t marshall(protocol_version, const syn_reply_message&, uint8_t *, size_t);
 
         static unsigned size(protocol_version v) {
-            return (v == PROTOCOL_VERSION_2) ? 6 : 4; /* bytes */
+            if (v == PROTOCOL_VERSION_2) {
+                return version_traits<PROTOCOL_VERSION_2>::syn_reply_size;
+            }
+
+            return version_traits<PROTOCOL_VERSION_3>::syn_reply_size;
         }
     };
 
@@ -188,6 +305,8 @@ namespace spdy {
     // +----------------------------------+
     // |          Status code             |
     // +----------------------------------+
+    //
+    // The status code is new in SPDYv3.
 
     struct goaway_message
     {
@@ -195,7 +314,16 @@ namespace spdy {
         unsigned status_code;
 
         static goaway_message parse(const uint8_t *, size_t);
-        enum : unsigned { size = 8 }; /* bytes */
+        static parse_status try_parse(const uint8_t *, size_t, goaway_message&);
+        static size_t marshall(protocol_version, const goaway_message&, uint8_t *, size_t);
+
+        static unsigned size(protocol_version v) {
+            if (v == PROTOCOL_VERSION_2) {
+                return version_traits<PROTOCOL_VERSION_2>::goaway_size;
+            }
+
+            return version_traits<PROTOCOL_VERSION_3>::goaway_size;
+        }
     };
 
     struct rst_stream_message
@@ -204,6 +332,7 @@ namespace spdy {
         unsigned status_code;
 
         static rst_stream_message parse(const uint8_t *, size_t);
+        static parse_status try_parse(const uint8_t *, size_t, rst_stream_message&);
         static size_t marshall(const rst_stream_message&, uint8_t *, size_t);
         enum : unsigned { size = 8 }; /* bytes */
     };
@@ -213,67 +342,167 @@ namespace spdy {
         unsigned ping_id;
 
         static ping_message parse(const uint8_t *, size_t);
+        static parse_status try_parse(const uint8_t *, size_t, ping_message&);
         static size_t marshall(const ping_message&, uint8_t *, size_t);
         enum : unsigned { size = 4 }; /* bytes */
     };
 
+    // A reference to a run of bytes that we don't own, typically a header
+    // name or value inside a decompressed header block.
+    struct string_ref
+    {
+        const char *    ptr;
+        size_t          len;
+
+        string_ref() : ptr(nullptr), len(0) {}
+        string_ref(const char * p, size_t n) : ptr(p), len(n) {}
+        string_ref(const char * s) : ptr(s), len(strlen(s)) {}
+        string_ref(const std::string& s) : ptr(s.data()), len(s.size()) {}
+        string_ref(const arena_string& s) : ptr(s.data()), len(s.size()) {}
+
+        bool empty() const { return len == 0; }
+        std::string str() const { return std::string(ptr, len); }
+
+        bool operator==(const char * s) const {
+            return strlen(s) == len && memcmp(ptr, s, len) == 0;
+        }
+    };
+
+    // Return the ID of the given header name, or HEADER_UNKNOWN. The
+    // request and status line headers are only known by the spelling of the
+    // given protocol version, so that a SPDY/3 "url" header is not mistaken
+    // for the request path.
+    inline header_id
+    lookup_header(protocol_version version, const char * name, size_t len) {
+        header_id id = lookup_header(name, len);
+
+        if (is_request_line_header(id) &&
+                (name[0] == ':') != (version == PROTOCOL_VERSION_3)) {
+            return HEADER_UNKNOWN;
+        }
+
+        return id;
+    }
+
+    // The request line of a SYN_STREAM. The strings are allocated from the
+    // given arena, if any, so that they go away with the stream.
     struct url_components
     {
-        std::string method;
-        std::string scheme;
-        std::string hostport;
-        std::string path;
-        std::string version;
+        explicit url_components(arena * a = nullptr)
+            : method(arena_allocator<char>(a)), scheme(arena_allocator<char>(a)),
+            hostport(arena_allocator<char>(a)), path(arena_allocator<char>(a)),
+            version(arena_allocator<char>(a)) {
+        }
+
+        arena_string method;
+        arena_string scheme;
+        arena_string hostport;
+        arena_string path;
+        arena_string version;
 
         bool is_complete() const {
             return !(method.empty() && scheme.empty() && hostport.empty() &&
                     path.empty() && version.empty());
         }
+
+        // If name is one of the request line headers of the given protocol
+        // version, store the value and return true.
+        bool assign(protocol_version version,
+                const string_ref& name, const string_ref& value) {
+            return assign(lookup_header(version, name.ptr, name.len), value);
+        }
+
+        bool assign(header_id id, const string_ref& value);
+
+        // Drop the strings. This must be done before the arena that they
+        // were allocated from is reset.
+        void clear();
     };
 
     struct key_value_block
     {
-        typedef std::map<std::string, std::string> map_type;
+        // Most header blocks have 10-30 headers, so keep them inline to
+        // avoid allocating. Keeping the keys sorted gives slightly better
+        // compression when we marshall the block. The names and values are
+        // allocated from the block's arena, if it has one.
+        typedef flat_map<arena_string, arena_string, 24> map_type;
         typedef map_type::const_iterator const_iterator;
         typedef map_type::iterator iterator;
 
+        // Header block visitor. The name and value refer to the decompressed
+        // header block and are only valid for the duration of the call.
+        typedef std::function<void (const string_ref&, const string_ref&)>
+            visitor_type;
+
+        explicit key_value_block(arena * a = nullptr)
+            : components(a), headers(), alloc(a) {
+        }
+
         map_type::size_type size() const {
             return headers.size();
         }
 
-        bool exists(const std::string& key) const {
-            return headers.find(key) != headers.end();
+        bool exists(const string_ref& key) const {
+            return find(key) != headers.end();
         }
 
         // Insert the lower-cased key.
-        void insert(std::string key, std::string value);
+        void insert(const string_ref& key, const string_ref& value);
 
-        std::string& operator[] (const std::string& key) {
-            return headers[key];
-        }
+        arena_string& operator[] (const string_ref& key);
 
-        const std::string& operator[] (const std::string& key) const {
-            return headers[key];
+        const arena_string& operator[] (const string_ref& key) const {
+            static const arena_string none;
+            const_iterator pos(find(key));
+            return pos == headers.end() ? none : pos->second;
         }
 
-        // Return the number of marshalling bytes this kvblock needs.
+        // Return the number of marshalling bytes this kvblock needs before
+        // compression.
         size_t nbytes(protocol_version) const;
 
+        // Return the maximum number of bytes marshall() can produce for this
+        // kvblock.
+        size_t marshall_bound(protocol_version, zstream<compress>&) const;
+
         const_iterator begin() const { return headers.begin(); }
         const_iterator end() const { return headers.end(); }
 
         url_components& url() { return components; }
         const url_components& url() const { return components; }
 
-        url_components components;
-        mutable /* XXX */ map_type headers;
+        url_components          components;
+        map_type                headers;
+        arena_allocator<char>   alloc;
 
         static key_value_block parse(protocol_version, zstream<decompress>&,
                 const uint8_t *, size_t);
+        static void parse(protocol_version, zstream<decompress>&,
+                const uint8_t *, size_t, const visitor_type&);
+        static parse_status try_parse(protocol_version, zstream<decompress>&,
+                const uint8_t *, size_t, const visitor_type&);
+        // Parse a header block that has already been decompressed.
+        static void parse(protocol_version, const uint8_t *, size_t,
+                const visitor_type&);
+        static parse_status try_parse(protocol_version, const uint8_t *,
+                size_t, const visitor_type&);
         static size_t marshall(protocol_version, zstream<compress>&,
                 const key_value_block&, uint8_t *, size_t);
+        // Marshall using the given buffer to hold the uncompressed header
+        // block. Reusing the buffer avoids allocating for each header block.
+        static size_t marshall(protocol_version, zstream<compress>&,
+                const key_value_block&, byte_buffer&,
+                uint8_t *, size_t);
+
+    private:
+        const_iterator find(const string_ref&) const;
     };
 
+    // Decompress all the pending decompressor input, appending the output
+    // to bytes. If limit is not zero, stop with z_buffer_error as soon as
+    // the output would grow past limit bytes.
+    zstream_error decompress_headers(zstream<decompress>&, byte_buffer&,
+            size_t limit = 0);
 
 } // namespace spdy
 
@@ -285,5 +514,8 @@ stringof<spdy::control_frame_type>(const spdy::control_frame_type&);
 template<> std::string
 stringof<spdy::error>(const spdy::error&);
 
+template<> std::string
+stringof<spdy::parse_status>(const spdy::parse_status&);
+
 #endif /* SPDY_H_57211D6A_F320_42E3_8205_89E651B4A5DB */
 /* vim: set sw=4 ts=4 tw=79 et : */
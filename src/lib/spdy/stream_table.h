@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2012 James Peach
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef STREAM_TABLE_H_2E8B4D17_C05A_4F93_B6D2_7A1E39C4F850
+#define STREAM_TABLE_H_2E8B4D17_C05A_4F93_B6D2_7A1E39C4F850
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <new>
+#include <utility>
+
+namespace spdy {
+
+// Open-addressed table of a session's streams, keyed by stream ID.
+//
+// A client opens streams with odd, increasing IDs, so (stream_id >> 1)
+// numbers them consecutively and we can use it as the hash directly. As
+// long as fewer streams are open than there are slots, the open streams
+// land in consecutive slots and a lookup is a single probe. Collisions
+// (from a long-lived stream that is a multiple of the table size older
+// than a new one) are resolved by linear probing, and erase() shifts the
+// probe chain back, so there are no tombstones. The table only allocates
+// when it grows, which it does at half full.
+//
+// Stream ID 0 is never valid, so it marks an empty slot.
+//
+// NOTE: Inserting or erasing elements invalidates all iterators.
+template <typename T>
+struct stream_table
+{
+    typedef std::pair<unsigned, T *>    value_type;
+    typedef size_t                      size_type;
+
+    struct iterator
+    {
+        iterator(value_type * p, value_type * e) : ptr(p), end(e) {
+            skip();
+        }
+
+        value_type& operator*() const { return *ptr; }
+        value_type * operator->() const { return ptr; }
+
+        iterator& operator++() {
+            ++ptr;
+            skip();
+            return *this;
+        }
+
+        bool operator==(const iterator& rhs) const { return ptr == rhs.ptr; }
+        bool operator!=(const iterator& rhs) const { return ptr != rhs.ptr; }
+
+    private:
+        void skip() {
+            while (ptr != end && ptr->first == 0) {
+                ++ptr;
+            }
+        }
+
+        value_type * ptr;
+        value_type * end;
+    };
+
+    explicit stream_table(size_type n = 16)
+            : slots(nullptr), mask(0), count(0) {
+        resize(round_up(n));
+    }
+
+    ~stream_table() {
+        free(slots);
+    }
+
+    size_type size() const { return count; }
+    bool empty() const { return count == 0; }
+    size_type capacity() const { return mask + 1; }
+
+    iterator begin() { return iterator(slots, slots + capacity()); }
+    iterator end() { return iterator(slots + capacity(), slots + capacity()); }
+
+    // Return the stream with the given ID, or null.
+    T * find(unsigned stream_id) const {
+        if (stream_id == 0) {
+            return nullptr;
+        }
+
+        for (size_type i = slot(stream_id); ; i = (i + 1) & mask) {
+            if (slots[i].first == stream_id) {
+                return slots[i].second;
+            }
+
+            if (slots[i].first == 0) {
+                return nullptr;
+            }
+        }
+    }
+
+    // Insert the stream unless the ID is already present. Return true if
+    // it was inserted.
+    bool insert(unsigned stream_id, T * stream) {
+        if (stream_id == 0) {
+            return false;
+        }
+
+        if ((count + 1) * 2 > capacity()) {
+            resize(capacity() * 2);
+        }
+
+        size_type i = slot(stream_id);
+        for (; slots[i].first != 0; i = (i + 1) & mask) {
+            if (slots[i].first == stream_id) {
+                return false;
+            }
+        }
+
+        slots[i] = value_type(stream_id, stream);
+        ++count;
+        return true;
+    }
+
+    // Remove the stream with the given ID and return it, or return null if
+    // it is not present.
+    T * erase(unsigned stream_id) {
+        size_type i;
+        T * stream;
+
+        if (stream_id == 0) {
+            return nullptr;
+        }
+
+        for (i = slot(stream_id); slots[i].first != stream_id; i = (i + 1) & mask) {
+            if (slots[i].first == 0) {
+                return nullptr;
+            }
+        }
+
+        stream = slots[i].second;
+
+        // Walk the rest of the probe chain and move back any entry that
+        // would no longer be reachable through the hole at i.
+        for (size_type j = (i + 1) & mask; slots[j].first != 0; j = (j + 1) & mask) {
+            size_type home = slot(slots[j].first);
+            if (((j - home) & mask) >= ((j - i) & mask)) {
+                slots[i] = slots[j];
+                i = j;
+            }
+        }
+
+        slots[i] = value_type(0, nullptr);
+        --count;
+        return stream;
+    }
+
+private:
+    static size_type round_up(size_type n) {
+        size_type cap = 2;
+        while (cap < n) {
+            cap *= 2;
+        }
+
+        return cap;
+    }
+
+    size_type slot(unsigned stream_id) const {
+        return (stream_id >> 1) & mask;
+    }
+
+    void resize(size_type n) {
+        value_type * old = slots;
+        size_type oldcap = old ? capacity() : 0;
+
+        slots = (value_type *)calloc(n, sizeof(value_type));
+        if (slots == nullptr) {
+            slots = old;
+            throw std::bad_alloc();
+        }
+
+        mask = n - 1;
+        count = 0;
+
+        for (size_type i = 0; i < oldcap; ++i) {
+            if (old[i].first != 0) {
+                insert(old[i].first, old[i].second);
+            }
+        }
+
+        free(old);
+    }
+
+    stream_table(const stream_table&); // disable
+    stream_table& operator=(const stream_table&); // disable
+
+    value_type *    slots;
+    size_type       mask;
+    size_type       count;
+};
+
+} // namespace spdy
+
+#endif /* STREAM_TABLE_H_2E8B4D17_C05A_4F93_B6D2_7A1E39C4F850 */
+/* vim: set sw=4 ts=4 tw=79 et : */
@@ -53,4 +53,22 @@ stringof<spdy::error>(const spdy::error& e)
     return detail::match(error_names, (unsigned)e);
 }
 
+template<> std::string
+stringof<spdy::parse_status>(const spdy::parse_status& status)
+{
+    static const detail::named_value<unsigned> status_names[] =
+    {
+        { "PARSE_OK", 0 },
+        { "PARSE_SHORT_FRAME", 1 },
+        { "PARSE_SHORT_HEADER_BLOCK", 2 },
+        { "PARSE_CORRUPT_HEADER_BLOCK", 3 },
+        { "PARSE_UNSUPPORTED_VERSION", 4 },
+        { "PARSE_FRAME_TOO_LARGE", 5 },
+        { "PARSE_HEADER_BLOCK_TOO_LARGE", 6 },
+        { "PARSE_TOO_MANY_HEADERS", 7 }
+    };
+
+    return detail::match(status_names, (unsigned)status);
+}
+
 /* vim: set sw=4 ts=4 tw=79 et : */
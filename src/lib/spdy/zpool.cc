@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2012 James Peach
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "zpool.h"
+#include <stdlib.h>
+#include <pthread.h>
+#include <atomic>
+
+// Each block carries a header recording its size, so that we know which
+// size class to return it to. The header is padded to keep the block that
+// we hand to zlib suitably aligned.
+union block_header
+{
+    size_t      size;
+    void *      next;   // freelist link when the block is pooled
+    long double align;
+};
+
+struct size_class
+{
+    size_t          size;
+    block_header *  head;
+};
+
+struct thread_pool
+{
+    enum : unsigned { nclasses = 8 };
+
+    size_class  classes[nclasses];
+    size_t      nbytes; // bytes cached in the freelists
+
+    thread_pool() : nbytes(0) {
+        for (unsigned i = 0; i < nclasses; ++i) {
+            classes[i].size = 0;
+            classes[i].head = nullptr;
+        }
+    }
+
+    ~thread_pool() {
+        for (unsigned i = 0; i < nclasses; ++i) {
+            while (classes[i].head) {
+                block_header * blk = classes[i].head;
+                classes[i].head = (block_header *)blk->next;
+                free(blk);
+            }
+        }
+    }
+
+    // Return the class for this size, claiming an unused class if there
+    // isn't one yet. Return null if we ran out of classes.
+    size_class * lookup(size_t size) {
+        for (unsigned i = 0; i < nclasses; ++i) {
+            if (classes[i].size == size) {
+                return &classes[i];
+            }
+
+            if (classes[i].size == 0) {
+                classes[i].size = size;
+                return &classes[i];
+            }
+        }
+
+        return nullptr;
+    }
+};
+
+static std::atomic<uint64_t>    pool_hits(0);
+static std::atomic<uint64_t>    pool_misses(0);
+static std::atomic<size_t>      pool_limit(4u * 1024u * 1024u);
+
+static pthread_key_t            pool_key;
+static pthread_once_t           pool_once = PTHREAD_ONCE_INIT;
+
+static void
+destroy_pool(void * ptr)
+{
+    delete (thread_pool *)ptr;
+}
+
+static void
+create_pool_key()
+{
+    pthread_key_create(&pool_key, destroy_pool);
+}
+
+static thread_pool *
+current_pool()
+{
+    thread_pool * pool;
+
+    pthread_once(&pool_once, create_pool_key);
+    pool = (thread_pool *)pthread_getspecific(pool_key);
+    if (pool == nullptr) {
+        pool = new thread_pool();
+        pthread_setspecific(pool_key, pool);
+    }
+
+    return pool;
+}
+
+static voidpf
+pool_alloc(voidpf, uInt items, uInt size)
+{
+    thread_pool *   pool = current_pool();
+    size_t          nbytes = (size_t)items * size;
+    size_class *    sc = pool->lookup(nbytes);
+    block_header *  blk;
+
+    if (sc && sc->head) {
+        blk = sc->head;
+        sc->head = (block_header *)blk->next;
+        pool->nbytes -= nbytes;
+        std::atomic_fetch_add_explicit(&pool_hits, (uint64_t)1, std::memory_order_relaxed);
+    } else {
+        blk = (block_header *)malloc(sizeof(block_header) + nbytes);
+        if (blk == nullptr) {
+            return Z_NULL;
+        }
+
+        std::atomic_fetch_add_explicit(&pool_misses, (uint64_t)1, std::memory_order_relaxed);
+    }
+
+    blk->size = nbytes;
+    return blk + 1;
+}
+
+static void
+pool_free(voidpf, voidpf ptr)
+{
+    thread_pool *   pool = current_pool();
+    block_header *  blk = (block_header *)ptr - 1;
+    size_t          nbytes = blk->size;
+    size_class *    sc = pool->lookup(nbytes);
+
+    if (sc && pool->nbytes + nbytes <= pool_limit.load(std::memory_order_relaxed)) {
+        blk->next = sc->head;
+        sc->head = blk;
+        pool->nbytes += nbytes;
+    } else {
+        free(blk);
+    }
+}
+
+static const spdy::zallocator pool_allocator = { pool_alloc, pool_free, Z_NULL };
+
+const spdy::zallocator *
+spdy::zpool::allocator()
+{
+    return &pool_allocator;
+}
+
+spdy::zpool::statistics
+spdy::zpool::stats()
+{
+    statistics s;
+
+    s.hits = pool_hits.load(std::memory_order_relaxed);
+    s.misses = pool_misses.load(std::memory_order_relaxed);
+    return s;
+}
+
+void
+spdy::zpool::limit(size_t nbytes)
+{
+    pool_limit.store(nbytes, std::memory_order_relaxed);
+}
+
+/* vim: set sw=4 ts=4 tw=79 et : */
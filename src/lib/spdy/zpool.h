@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2012 James Peach
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ZPOOL_H_2D84C1F0_5B7E_4A39_8E62_C0F3A9D71B58
+#define ZPOOL_H_2D84C1F0_5B7E_4A39_8E62_C0F3A9D71B58
+
+#include "zstream.h"
+
+namespace spdy {
+
+// Per-thread pool of zlib state blocks. For a given set of parameters,
+// zlib allocates the same handful of block sizes for every stream, and the
+// deflate window and hash tables run to hundreds of KB per session.
+// Recycling the blocks saves those malloc() and free() calls on each SPDY
+// session. Blocks are returned to the pool of the thread that frees them,
+// so there is no locking.
+struct zpool
+{
+    struct statistics
+    {
+        uint64_t    hits;       // allocations satisfied from a pool
+        uint64_t    misses;     // allocations that went to malloc()
+    };
+
+    // Return an allocator that uses the calling thread's pool.
+    static const zallocator * allocator();
+
+    // Return the hit and miss counts summed across all threads.
+    static statistics stats();
+
+    // Set the maximum number of bytes each thread keeps in its pool.
+    static void limit(size_t nbytes);
+};
+
+} // namespace spdy
+
+#endif /* ZPOOL_H_2D84C1F0_5B7E_4A39_8E62_C0F3A9D71B58 */
+/* vim: set sw=4 ts=4 tw=79 et : */
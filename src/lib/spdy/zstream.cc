@@ -18,7 +18,7 @@
 
 namespace spdy {
 
-const uint8_t dictionary[] =
+static const uint8_t dictionary_v2_bytes[] =
 "optionsgetheadpostputdeletetraceacceptaccept-charsetaccept-encodingaccept-"
 "languageauthorizationexpectfromhostif-modified-sinceif-matchif-none-matchi"
 "f-rangeif-unmodifiedsincemax-forwardsproxy-authorizationrangerefererteuser"
@@ -33,16 +33,110 @@ const uint8_t dictionary[] =
 "ation/xhtmltext/plainpublicmax-agecharset=iso-8859-1utf-8gzipdeflateHTTP/1"
 ".1statusversionurl";
 
-#if NOTYET
-unsigned long dictionary_id()
+// SPDY/3 prefixes each word with a 32-bit length, like a header block.
+static const uint8_t dictionary_v3_bytes[] =
+"\0\0\0\007" "options"
+"\0\0\0\004" "head"
+"\0\0\0\004" "post"
+"\0\0\0\003" "put"
+"\0\0\0\006" "delete"
+"\0\0\0\005" "trace"
+"\0\0\0\006" "accept"
+"\0\0\0\016" "accept-charset"
+"\0\0\0\017" "accept-encoding"
+"\0\0\0\017" "accept-language"
+"\0\0\0\015" "accept-ranges"
+"\0\0\0\003" "age"
+"\0\0\0\005" "allow"
+"\0\0\0\015" "authorization"
+"\0\0\0\015" "cache-control"
+"\0\0\0\012" "connection"
+"\0\0\0\014" "content-base"
+"\0\0\0\020" "content-encoding"
+"\0\0\0\020" "content-language"
+"\0\0\0\016" "content-length"
+"\0\0\0\020" "content-location"
+"\0\0\0\013" "content-md5"
+"\0\0\0\015" "content-range"
+"\0\0\0\014" "content-type"
+"\0\0\0\004" "date"
+"\0\0\0\004" "etag"
+"\0\0\0\006" "expect"
+"\0\0\0\007" "expires"
+"\0\0\0\004" "from"
+"\0\0\0\004" "host"
+"\0\0\0\010" "if-match"
+"\0\0\0\021" "if-modified-since"
+"\0\0\0\015" "if-none-match"
+"\0\0\0\010" "if-range"
+"\0\0\0\023" "if-unmodified-since"
+"\0\0\0\015" "last-modified"
+"\0\0\0\010" "location"
+"\0\0\0\014" "max-forwards"
+"\0\0\0\006" "pragma"
+"\0\0\0\022" "proxy-authenticate"
+"\0\0\0\023" "proxy-authorization"
+"\0\0\0\005" "range"
+"\0\0\0\007" "referer"
+"\0\0\0\013" "retry-after"
+"\0\0\0\006" "server"
+"\0\0\0\002" "te"
+"\0\0\0\007" "trailer"
+"\0\0\0\021" "transfer-encoding"
+"\0\0\0\007" "upgrade"
+"\0\0\0\012" "user-agent"
+"\0\0\0\004" "vary"
+"\0\0\0\003" "via"
+"\0\0\0\007" "warning"
+"\0\0\0\020" "www-authenticate"
+"\0\0\0\006" "method"
+"\0\0\0\003" "get"
+"\0\0\0\006" "status"
+"\0\0\0\006" "200 OK"
+"\0\0\0\007" "version"
+"\0\0\0\010" "HTTP/1.1"
+"\0\0\0\003" "url"
+"\0\0\0\006" "public"
+"\0\0\0\012" "set-cookie"
+"\0\0\0\012" "keep-alive"
+"\0\0\0\006" "origin"
+"10010120120220520630030230330430530630740240540640740840941041141241341441"
+"5416417502504505203 Non-Authoritative Information204 No Content301 Moved P"
+"ermanently400 Bad Request401 Unauthorized403 Forbidden404 Not Found500 Int"
+"ernal Server Error501 Not Implemented503 Service UnavailableJan Feb Mar Ap"
+"r May Jun Jul Aug Sept Oct Nov Dec 00:00:00 Mon, Tue, Wed, Thu, Fri, Sat, "
+"Sun, GMTchunked,text/html,image/png,image/jpg,image/gif,application/xml,ap"
+"plication/xhtml+xml,text/plain,text/javascript,publicprivatemax-age=gzip,d"
+"eflate,sdchcharset=utf-8charset=iso-8859-1,utf-,*,enq=0.";
+
+// The spec says that the trailing NULL is not included in the SPDY/2
+// dictionary, but in practice, Chrome does include it. The SPDY/3
+// dictionary has no trailing NULL.
+const zdictionary dictionary_v2 =
 {
-    unsigned long id;
+    dictionary_v2_bytes, sizeof(dictionary_v2_bytes)
+};
 
-    id = adler32(0L, Z_NULL, 0);
-    id = adler32(id, dictionary, sizeof(dictionary));
-    return id;
+const zdictionary dictionary_v3 =
+{
+    dictionary_v3_bytes, sizeof(dictionary_v3_bytes) - 1
+};
+
+// The peer tells us which dictionary it used by its Adler-32 checksum.
+static const zdictionary *
+lookup_dictionary(uLong id)
+{
+    static const uLong v2 = adler32(adler32(0L, Z_NULL, 0),
+            dictionary_v2.bytes, dictionary_v2.size);
+    static const uLong v3 = adler32(adler32(0L, Z_NULL, 0),
+            dictionary_v3.bytes, dictionary_v3.size);
+
+    if (id == v3) {
+        return &dictionary_v3;
+    }
+
+    return (id == v2) ? &dictionary_v2 : nullptr;
 }
-#endif
 
 static zstream_error map_zerror(int error)
 {
@@ -62,18 +156,19 @@ static zstream_error map_zerror(int error)
     return z[error];
 }
 
-zstream_error decompress::init(z_stream * zstr)
+zstream_error decompress::init(z_stream * zstr, const options& opts)
 {
-    return map_zerror(inflateInit(zstr));
+    return map_zerror(inflateInit2(zstr, opts.window_bits));
 }
 
 zstream_error decompress::transact(z_stream * zstr, int flush)
 {
     int ret = inflate(zstr, flush);
     if (ret == Z_NEED_DICT) {
-        // The spec says that the trailing NULL is not included in the
-        // dictionary, but in practice, Chrome does include it.
-        ret = inflateSetDictionary(zstr, dictionary, sizeof(dictionary));
+        const zdictionary * dict = lookup_dictionary(zstr->adler);
+
+        ret = dict ? inflateSetDictionary(zstr, dict->bytes, dict->size)
+            : Z_DATA_ERROR;
         if (ret == Z_OK) {
             ret = inflate(zstr, flush);
         }
@@ -87,29 +182,23 @@ zstream_error decompress::destroy(z_stream * zstr)
     return map_zerror(inflateEnd(zstr));
 }
 
-zstream_error compress::init(z_stream * zstr)
+zstream_error compress::init(z_stream * zstr, const options& opts)
 {
     zstream_error status;
 
-    status = map_zerror(deflateInit(zstr, Z_DEFAULT_COMPRESSION));
+    status = map_zerror(deflateInit2(zstr, opts.level, Z_DEFLATED,
+                opts.window_bits, opts.mem_level, Z_DEFAULT_STRATEGY));
     if (status != z_ok) {
         return status;
     }
 
-    return map_zerror(deflateSetDictionary(zstr, dictionary, sizeof(dictionary)));
+    return map_zerror(deflateSetDictionary(zstr,
+                opts.dictionary->bytes, opts.dictionary->size));
 }
 
 zstream_error compress::transact(z_stream * zstr, int flush)
 {
-    int ret = deflate(zstr, flush);
-    if (ret == Z_NEED_DICT) {
-        ret = deflateSetDictionary(zstr, dictionary, sizeof(dictionary));
-        if (ret == Z_OK) {
-            ret = deflate(zstr, flush);
-        }
-    }
-
-    return map_zerror(ret);
+    return map_zerror(deflate(zstr, flush));
 }
 
 zstream_error compress::destroy(z_stream * zstr)
@@ -117,5 +206,12 @@ zstream_error compress::destroy(z_stream * zstr)
     return map_zerror(deflateEnd(zstr));
 }
 
+size_t compress::bound(z_stream * zstr, size_t nbytes)
+{
+    // deflateBound() assumes Z_FINISH. A Z_SYNC_FLUSH ends with an empty
+    // stored block, which can take a few more bytes.
+    return deflateBound(zstr, nbytes) + 8;
+}
+
 } // namespace spdy
 /* vim: set sw=4 ts=4 tw=79 et : */
@@ -36,15 +36,40 @@ enum zstream_error
     z_version_error
 };
 
+// Preset zlib dictionary. SPDY primes the header block compression with a
+// dictionary of common header names and values, which changed in SPDY/3.
+struct zdictionary
+{
+    const uint8_t * bytes;
+    size_t          size;
+};
+
+extern const zdictionary dictionary_v2;
+extern const zdictionary dictionary_v3;
+
+// zlib memory allocator hook. The functions and opaque pointer are handed
+// straight to zlib.
+struct zallocator
+{
+    alloc_func  zalloc;
+    free_func   zfree;
+    void *      opaque;
+};
+
 template <typename ZlibMechanism>
 struct zstream : public ZlibMechanism
 {
-    zstream() {
+    typedef typename ZlibMechanism::options options;
+
+    // Use the given allocator for the zlib state, or the zlib default
+    // allocator if null.
+    explicit zstream(const zallocator * alloc = nullptr,
+            const options& opts = options()) {
         memset(&stream, 0, sizeof(stream));
-        stream.zalloc = Z_NULL;
-        stream.zfree = Z_NULL;
-        stream.opaque = Z_NULL;
-        ZlibMechanism::init(&stream);
+        stream.zalloc = alloc ? alloc->zalloc : Z_NULL;
+        stream.zfree = alloc ? alloc->zfree : Z_NULL;
+        stream.opaque = alloc ? alloc->opaque : Z_NULL;
+        ZlibMechanism::init(&stream, opts);
     }
 
     bool drained() const {
@@ -86,6 +111,12 @@ struct zstream : public ZlibMechanism
         return -ret;
     }
 
+    // Return the maximum number of output bytes that a single Z_SYNC_FLUSH
+    // of nbytes of input can produce.
+    size_t bound(size_t nbytes) {
+        return ZlibMechanism::bound(&stream, nbytes);
+    }
+
     ~zstream() {
         ZlibMechanism::destroy(&stream);
     }
@@ -99,16 +130,38 @@ private:
 
 struct decompress
 {
-    zstream_error init(z_stream * zstr);
+    struct options
+    {
+        options() : window_bits(MAX_WBITS) {}
+        int window_bits;    // base two log of the window size (8..15)
+    };
+
+    zstream_error init(z_stream * zstr, const options& opts);
     zstream_error transact(z_stream * zstr, int flush);
     zstream_error destroy(z_stream * zstr);
 };
 
 struct compress
 {
-    zstream_error init(z_stream * zstr);
+    // The defaults are what deflateInit() uses. Smaller windows and memory
+    // levels trade compression ratio for a smaller per-session footprint.
+    // The deflate state takes about (1 << (window_bits + 2)) +
+    // (1 << (mem_level + 9)) bytes.
+    struct options
+    {
+        options()
+            : level(Z_DEFAULT_COMPRESSION), window_bits(MAX_WBITS),
+            mem_level(8), dictionary(&dictionary_v2) {}
+        int level;          // compression level (-1..9)
+        int window_bits;    // base two log of the window size (9..15)
+        int mem_level;      // memory for the compression state (1..9)
+        const zdictionary * dictionary;
+    };
+
+    zstream_error init(z_stream * zstr, const options& opts);
     zstream_error transact(z_stream * zstr, int flush);
     zstream_error destroy(z_stream * zstr);
+    size_t bound(z_stream * zstr, size_t nbytes);
 };
 
 } // namespace spdy
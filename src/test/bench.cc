@@ -0,0 +1,1026 @@
+/*
+ * Copyright (c) 2012 James Peach
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// bench.cc - Microbenchmarks for the SPDY protocol library.
+
+#include <spdy/spdy.h>
+#include <spdy/codec.h>
+#include <spdy/zpool.h>
+#include <spdy/normalize.h>
+#include <spdy/stream_table.h>
+#include <base/flat_map.h>
+#include <base/logging.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cctype>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+static volatile size_t sink;
+
+// Run fn for the given number of iterations and print the mean cost of
+// each iteration. The iterations are split into batches and we report the
+// fastest batch, so that other processes on the machine don't skew the
+// comparisons.
+template <typename Fn> void
+measure(const char * name, unsigned iterations, Fn fn)
+{
+    const unsigned batches = 20;
+    unsigned count = std::max(iterations / batches, 1u);
+    double best = 0;
+
+    for (unsigned b = 0; b < batches; ++b) {
+        auto start = std::chrono::steady_clock::now();
+
+        for (unsigned i = 0; i < count; ++i) {
+            fn();
+        }
+
+        auto end = std::chrono::steady_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(end - start).count();
+
+        best = (b == 0) ? ns : std::min(best, ns);
+    }
+
+    printf("%-48s %10.1f ns/op\n", name, best / count);
+}
+
+struct header
+{
+    const char * name;
+    const char * value;
+};
+
+// Request headers from a Chrome page load, in the order Chrome sends them.
+static const header request_headers[] =
+{
+    { "user-agent", "Mozilla/5.0 (Macintosh; Intel Mac OS X 10_8_2) AppleWebKit/537.11 (KHTML, like Gecko) Chrome/23.0.1271.64 Safari/537.11" },
+    { "accept", "text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8" },
+    { "referer", "http://www.example.com/index.html" },
+    { "accept-encoding", "gzip,deflate,sdch" },
+    { "accept-language", "en-US,en;q=0.8" },
+    { "accept-charset", "ISO-8859-1,utf-8;q=0.7,*;q=0.3" },
+    { "cookie", "__utma=1.1234567890.1350000000.1350000000.1350000000.1; __utmz=1.1350000000.1.1.utmcsr=(direct)|utmccn=(direct)|utmcmd=(none); session=8d4c0a0e6f" },
+    { "cache-control", "max-age=0" },
+    { "if-modified-since", "Tue, 30 Oct 2012 18:43:02 GMT" },
+    { "if-none-match", "\"1f4d-4cd4b1c3a7680\"" },
+};
+
+// Response headers from a typical origin server, in the order ATS hands
+// them to us.
+static const header response_headers[] =
+{
+    { "date", "Fri, 02 Nov 2012 04:27:52 GMT" },
+    { "server", "Apache/2.2.22 (Unix) mod_ssl/2.2.22 OpenSSL/0.9.8r" },
+    { "last-modified", "Tue, 30 Oct 2012 18:43:02 GMT" },
+    { "etag", "\"1f4d-4cd4b1c3a7680\"" },
+    { "accept-ranges", "bytes" },
+    { "content-length", "8013" },
+    { "cache-control", "max-age=3600, public" },
+    { "expires", "Fri, 02 Nov 2012 05:27:52 GMT" },
+    { "vary", "Accept-Encoding" },
+    { "content-encoding", "gzip" },
+    { "content-type", "text/html; charset=UTF-8" },
+    { "set-cookie", "session=8d4c0a0e6f; path=/; expires=Sat, 03-Nov-2012 04:27:52 GMT" },
+    { "x-powered-by", "PHP/5.3.15" },
+    { "p3p", "CP=\"NOI DSP COR NID CUR ADM DEV OUR BUS\"" },
+    { "age", "0" },
+    { "via", "http/1.1 proxy.example.com (ApacheTrafficServer/3.3.0)" },
+    { "x-frame-options", "SAMEORIGIN" },
+    { "access-control-allow-origin", "*" },
+};
+
+// Build a header map the way http_send_response() does.
+template <typename Map, unsigned N> void
+build_map(Map& map, const header (&headers)[N])
+{
+    for (unsigned i = 0; i < N; ++i) {
+        map[headers[i].name] = headers[i].value;
+    }
+}
+
+template <typename Map, unsigned N> void
+bench_header_map(const char * mapname, const char * setname,
+        const header (&headers)[N])
+{
+    const unsigned iterations = 200000;
+    std::string keys[N];
+    char name[128];
+    Map map;
+
+    for (unsigned i = 0; i < N; ++i) {
+        keys[i] = headers[i].name;
+    }
+
+    build_map(map, headers);
+
+    snprintf(name, sizeof(name), "%s %s build", mapname, setname);
+    measure(name, iterations, [&headers]() {
+        Map tmp;
+        build_map(tmp, headers);
+        sink = tmp.size();
+    });
+
+    snprintf(name, sizeof(name), "%s %s find", mapname, setname);
+    measure(name, iterations, [&map, &keys]() {
+        size_t nbytes = 0;
+        for (unsigned i = 0; i < N; ++i) {
+            nbytes += map.find(keys[i])->second.size();
+        }
+        sink = nbytes;
+    });
+
+    // Walk the map in order the way key_value_block::nbytes() and the
+    // marshalling code do.
+    snprintf(name, sizeof(name), "%s %s walk", mapname, setname);
+    measure(name, iterations, [&map]() {
+        size_t nbytes = 0;
+        for (auto ptr(map.begin()); ptr != map.end(); ++ptr) {
+            nbytes += ptr->first.size() + ptr->second.size();
+        }
+        sink = nbytes;
+    });
+}
+
+static void
+bench_header_maps()
+{
+    typedef std::map<std::string, std::string> std_map;
+    typedef flat_map<std::string, std::string, 24> flat;
+
+    bench_header_map<std_map>("std::map", "request", request_headers);
+    bench_header_map<flat>("flat_map", "request", request_headers);
+    bench_header_map<std_map>("std::map", "response", response_headers);
+    bench_header_map<flat>("flat_map", "response", response_headers);
+
+    // The whole key_value_block insertion path, which searches with the
+    // string_ref and inserts at the position it found.
+    measure("key_value_block response build", 200000, []() {
+        spdy::key_value_block kvblock;
+        for (unsigned i = 0; i < countof(response_headers); ++i) {
+            kvblock[response_headers[i].name] = response_headers[i].value;
+        }
+        sink = kvblock.size();
+    });
+}
+
+// Measure classifying each response header as hop-by-hop, the way
+// http_send_response() used to with strcmp() and the way it does now with
+// the known header table.
+static void
+bench_hop_by_hop_filter()
+{
+    const unsigned iterations = 200000;
+    std::vector<std::string> names;
+
+    for (unsigned i = 0; i < countof(response_headers); ++i) {
+        names.push_back(response_headers[i].name);
+    }
+
+    names.push_back("Connection");
+    names.push_back("Transfer-Encoding");
+
+    measure("hop-by-hop filter, strcmp", iterations,
+        [&names]() {
+            size_t count = 0;
+            for (auto name(names.begin()); name != names.end(); ++name) {
+                const char * ptr = name->c_str();
+                if (strcmp(ptr, "Connection") == 0 ||
+                        strcmp(ptr, "Keep-Alive") == 0 ||
+                        strcmp(ptr, "Proxy-Connection") == 0 ||
+                        strcmp(ptr, "Transfer-Encoding") == 0) {
+                    ++count;
+                }
+            }
+            sink = count;
+        });
+
+    measure("hop-by-hop filter, known header table", iterations,
+        [&names]() {
+            size_t count = 0;
+            for (auto name(names.begin()); name != names.end(); ++name) {
+                if (spdy::is_hop_by_hop_header(
+                            spdy::lookup_header(name->data(), name->size()))) {
+                    ++count;
+                }
+            }
+            sink = count;
+        });
+}
+
+// The functor that key_value_block::insert() used to lower-case names.
+struct lowercase
+{
+    char operator() (char c) const {
+        if (c > 0x40 && c < 0x5b) {
+            return c + 0x20;
+        }
+
+        return c;
+    }
+};
+
+// Measure lower-casing the response header names in their canonical MIME
+// form, the way http_send_response() sees them from ATS.
+static void
+bench_header_normalize()
+{
+    const unsigned iterations = 200000;
+    std::vector<std::string> names;
+    std::vector<std::string> tmp;
+
+    for (unsigned i = 0; i < countof(response_headers); ++i) {
+        std::string name(response_headers[i].name);
+        bool upper = true;
+
+        for (auto c(name.begin()); c != name.end(); ++c) {
+            *c = upper ? toupper(*c) : *c;
+            upper = (*c == '-');
+        }
+
+        names.push_back(name);
+    }
+
+    tmp = names;
+
+    measure("header names, lowercase functor", iterations,
+        [&names, &tmp]() {
+            for (unsigned i = 0; i < names.size(); ++i) {
+                std::transform(names[i].begin(), names[i].end(),
+                        tmp[i].begin(), lowercase());
+            }
+            sink = tmp[0][0];
+        });
+
+    measure("header names, normalize_header_name", iterations,
+        [&names, &tmp]() {
+            unsigned flags = 0;
+            for (unsigned i = 0; i < names.size(); ++i) {
+                flags |= spdy::normalize_header_name(names[i].data(),
+                        &tmp[i][0], names[i].size());
+            }
+            sink = flags;
+        });
+
+    measure("header name+value, normalize_header", iterations,
+        [&names, &tmp]() {
+            unsigned flags = 0;
+            for (unsigned i = 0; i < names.size(); ++i) {
+                const char * value = response_headers[i].value;
+                tmp[i] = names[i];
+                flags |= spdy::normalize_header(&tmp[i][0], tmp[i].size(),
+                        value, strlen(value));
+            }
+            sink = flags;
+        });
+}
+
+// The SYN_REPLY header block encoder as it was before we serialized the
+// block up front. This makes a deflate() call for the pair count and for
+// each length and string.
+static ssize_t
+marshall_per_field(
+        spdy::zstream<spdy::compress>&  compressor,
+        const spdy::key_value_block&    kvblock,
+        uint8_t *                       ptr,
+        size_t                          len)
+{
+    size_t      nbytes = 0;
+    ssize_t     status;
+    uint16_t    tmp16;
+
+    auto marshall_string = [&](const spdy::arena_string& strval) -> ssize_t {
+        tmp16 = htons(strval.size());
+        compressor.input(&tmp16, sizeof(tmp16));
+        status = compressor.consume(ptr + nbytes, len - nbytes, 0);
+        if (status < 0) {
+            return status;
+        }
+
+        nbytes += status;
+        compressor.input(strval.c_str(), strval.size());
+        status = compressor.consume(ptr + nbytes, len - nbytes, 0);
+        if (status < 0) {
+            return status;
+        }
+
+        nbytes += status;
+        return 0;
+    };
+
+    tmp16 = htons(kvblock.size());
+    compressor.input(&tmp16, sizeof(tmp16));
+    status = compressor.consume(ptr + nbytes, len - nbytes, 0);
+    if (status < 0) {
+        return status;
+    }
+
+    nbytes += status;
+
+    for (auto kv(kvblock.begin()); kv != kvblock.end(); ++kv) {
+        if (marshall_string(kv->first) < 0 || marshall_string(kv->second) < 0) {
+            return status;
+        }
+    }
+
+    do  {
+        status = compressor.consume(ptr + nbytes, len - nbytes, Z_SYNC_FLUSH);
+        if (status < 0) {
+            return status;
+        }
+        nbytes += status;
+    } while (status != 0);
+
+    return nbytes;
+}
+
+// Measure the cost of compressing the SYN_REPLY header block for a typical
+// response, using a single long-lived compressor like a SPDY session does.
+static void
+bench_syn_reply_encode()
+{
+    const unsigned iterations = 50000;
+
+    spdy::key_value_block           kvblock;
+    spdy::zstream<spdy::compress>   zfield;
+    spdy::zstream<spdy::compress>   zblock;
+    spdy::byte_buffer               scratch;
+    std::vector<uint8_t>            hdrs;
+
+    for (unsigned i = 0; i < countof(response_headers); ++i) {
+        kvblock.insert(response_headers[i].name, response_headers[i].value);
+    }
+
+    kvblock["status"] = "200 OK";
+    kvblock["version"] = "HTTP/1.1";
+
+    hdrs.resize(kvblock.marshall_bound(spdy::PROTOCOL_VERSION_2, zblock));
+
+    measure("SYN_REPLY encode, deflate per field", iterations,
+        [&]() {
+            sink = marshall_per_field(zfield, kvblock, &hdrs[0], hdrs.size());
+        });
+
+    measure("SYN_REPLY encode, one deflate per block", iterations,
+        [&]() {
+            sink = spdy::key_value_block::marshall(spdy::PROTOCOL_VERSION_2,
+                zblock, kvblock, scratch, &hdrs[0], hdrs.size());
+        });
+}
+
+// Build and serialize a SYN_REPLY header block the way http_send_response()
+// and spdy_send_syn_reply() do, with the block allocating from the given
+// arena, or the heap if it is null.
+static size_t
+build_syn_reply(spdy::arena * arena, const spdy::header_codec * codec)
+{
+    spdy::key_value_block kvblock(arena);
+    char key[128];
+
+    for (unsigned i = 0; i < countof(response_headers); ++i) {
+        const header& hdr(response_headers[i]);
+        size_t nlen = strlen(hdr.name);
+        size_t vlen = strlen(hdr.value);
+
+        spdy::normalize_header_name(hdr.name, key, nlen);
+        spdy::check_header_value(hdr.value, vlen);
+        kvblock[spdy::string_ref(key, nlen)].assign(hdr.value, vlen);
+    }
+
+    kvblock[codec->status_header] = "200 OK";
+    kvblock[codec->version_header] = "HTTP/1.1";
+
+    size_t nbytes = codec->nbytes(kvblock);
+    std::unique_ptr<uint8_t, void (*)(void *)> frame(
+            (uint8_t *)malloc(nbytes), free);
+    return codec->serialize(kvblock, frame.get(), nbytes);
+}
+
+// Measure the SYN_REPLY header block path with the block on the heap and
+// in a stream arena.
+static void
+bench_response_arena()
+{
+    const unsigned iterations = 200000;
+    const spdy::header_codec * codec =
+        spdy::header_codec::get(spdy::PROTOCOL_VERSION_3);
+    spdy::arena arena;
+
+    measure("SYN_REPLY header block, heap", iterations, [codec]() {
+        sink = build_syn_reply(nullptr, codec);
+    });
+
+    measure("SYN_REPLY header block, arena", iterations, [&arena, codec]() {
+        spdy::arena::scope scope(arena);
+        sink = build_syn_reply(&arena, codec);
+    });
+
+    printf("%-48s %10zu bytes\n", "SYN_REPLY header block, arena high water",
+            arena.high_water());
+}
+
+static void
+decompress_into_vector(
+        spdy::zstream<spdy::decompress>&    decompressor,
+        std::vector<uint8_t>&               bytes)
+{
+    ssize_t nbytes;
+
+    do {
+        size_t old = bytes.size();
+        bytes.resize(bytes.size() + getpagesize());
+        nbytes = decompressor.consume(&bytes[old], bytes.size() - old);
+        bytes.resize(old + std::max<ssize_t>(nbytes, 0));
+    } while (nbytes > 0);
+}
+
+// Measure decompressing a SYN_STREAM header block. Each iteration uses a
+// new decompressor, since the block is only valid at the start of a
+// stream.
+static void
+bench_syn_stream_decode()
+{
+    const unsigned iterations = 50000;
+
+    spdy::key_value_block           kvblock;
+    spdy::zstream<spdy::compress>   compressor;
+    std::vector<uint8_t>            block;
+
+    for (unsigned i = 0; i < countof(request_headers); ++i) {
+        kvblock.insert(request_headers[i].name, request_headers[i].value);
+    }
+
+    block.resize(kvblock.marshall_bound(spdy::PROTOCOL_VERSION_2, compressor));
+    block.resize(spdy::key_value_block::marshall(spdy::PROTOCOL_VERSION_2,
+                compressor, kvblock, &block[0], block.size()));
+
+    measure("SYN_STREAM decode, std::vector", iterations,
+        [&block]() {
+            spdy::zstream<spdy::decompress> decompressor;
+            std::vector<uint8_t> bytes;
+
+            decompressor.input(&block[0], block.size());
+            decompress_into_vector(decompressor, bytes);
+            sink = bytes.size();
+        });
+
+    measure("SYN_STREAM decode, byte_buffer", iterations,
+        [&block]() {
+            spdy::zstream<spdy::decompress> decompressor;
+            spdy::inline_byte_buffer<4096> bytes;
+
+            decompressor.input(&block[0], block.size());
+            spdy::decompress_headers(decompressor, bytes);
+            sink = bytes.size();
+        });
+}
+
+// Measure rejecting a short PING frame, which a hostile client can send as
+// fast as we can read it. The throwing parse unwinds an exception for each
+// frame.
+static void
+bench_malformed_frames()
+{
+    const unsigned iterations = 200000;
+    const uint8_t ping[] = { 0x00, 0x00 };
+
+    measure("short PING, parse() and catch", iterations,
+        [&ping]() {
+            try {
+                sink = spdy::ping_message::parse(ping, sizeof(ping)).ping_id;
+            } catch (const spdy::protocol_error&) {
+                sink = 0;
+            }
+        });
+
+    measure("short PING, try_parse()", iterations,
+        [&ping]() {
+            spdy::ping_message msg;
+            sink = spdy::ping_message::try_parse(ping, sizeof(ping), msg);
+        });
+}
+
+// Raw zlib streams set up the same way as a SPDY/3 session's streams, so
+// that we can measure reusing them instead of initializing new ones. The
+// inflater has decoded a header block, so it has applied the dictionary
+// and allocated its window. Only the deflater can be cloned usefully; a
+// new session's first header block starts with a zlib header that a
+// cloned inflater is already past.
+struct primed_template
+{
+    primed_template() : block(256) {
+        // A minimal SPDY/3 header block, compressed with the dictionary.
+        static const char kvblock[] = "\0\0\0\1\0\0\0\7:method\0\0\0\3GET";
+        spdy::compress::options opts;
+
+        opts.dictionary = &spdy::dictionary_v3;
+        spdy::zstream<spdy::compress> compressor(nullptr, opts);
+        compressor.input(kvblock, sizeof(kvblock) - 1);
+        block.resize(compressor.consume(&block[0], block.size()));
+
+        init(deflater);
+        deflateInit2(&deflater, opts.level, Z_DEFLATED, opts.window_bits,
+                opts.mem_level, Z_DEFAULT_STRATEGY);
+        prime(deflater);
+
+        init(inflater);
+        inflateInit(&inflater);
+        inflate_block(inflater);
+    }
+
+    ~primed_template() {
+        deflateEnd(&deflater);
+        inflateEnd(&inflater);
+    }
+
+    static void init(z_stream& zstr) {
+        const spdy::zallocator * alloc = spdy::zpool::allocator();
+
+        memset(&zstr, 0, sizeof(zstr));
+        zstr.zalloc = alloc->zalloc;
+        zstr.zfree = alloc->zfree;
+    }
+
+    static void prime(z_stream& zstr) {
+        deflateSetDictionary(&zstr, spdy::dictionary_v3.bytes,
+                spdy::dictionary_v3.size);
+    }
+
+    // Decode the header block the way decompress::transact() does.
+    void inflate_block(z_stream& zstr) {
+        uint8_t out[256];
+
+        zstr.next_in = &block[0];
+        zstr.avail_in = block.size();
+        zstr.next_out = out;
+        zstr.avail_out = sizeof(out);
+        if (inflate(&zstr, Z_SYNC_FLUSH) == Z_NEED_DICT) {
+            inflateSetDictionary(&zstr, spdy::dictionary_v3.bytes,
+                    spdy::dictionary_v3.size);
+            inflate(&zstr, Z_SYNC_FLUSH);
+        }
+
+        sink = zstr.total_out;
+    }
+
+    z_stream                deflater;
+    z_stream                inflater;
+    std::vector<uint8_t>    block;
+};
+
+// Measure the zlib setup and teardown that each accepted SPDY/3 session
+// pays for its header compressor and decompressor, and the alternatives of
+// cloning a primed template or resetting a cached stream that kept its
+// dictionary. The decompressor
+// side includes decoding the first header block, since that is when the
+// dictionary is applied and the window allocated.
+static void
+bench_session_accept()
+{
+    const unsigned iterations = 20000;
+    primed_template tmpl;
+    spdy::compress::options opts;
+
+    opts.dictionary = &spdy::dictionary_v3;
+
+    measure("session deflate setup, malloc", iterations,
+        [&opts]() {
+            spdy::zstream<spdy::compress> compressor(nullptr, opts);
+        });
+
+    measure("session deflate setup, zpool", iterations,
+        [&opts]() {
+            spdy::zstream<spdy::compress> compressor(spdy::zpool::allocator(), opts);
+        });
+
+    measure("session deflate setup, copy primed template", iterations,
+        [&tmpl]() {
+            z_stream compressor;
+            deflateCopy(&compressor, &tmpl.deflater);
+            deflateEnd(&compressor);
+        });
+
+    measure("session deflate setup, reset cached stream", iterations,
+        [&tmpl]() {
+            deflateReset(&tmpl.deflater);
+            tmpl.prime(tmpl.deflater);
+        });
+
+    measure("session inflate setup, zpool", iterations,
+        [&tmpl]() {
+            z_stream decompressor;
+            tmpl.init(decompressor);
+            inflateInit(&decompressor);
+            tmpl.inflate_block(decompressor);
+            inflateEnd(&decompressor);
+        });
+
+    measure("session inflate setup, reset cached stream", iterations,
+        [&tmpl]() {
+            inflateReset(&tmpl.inflater);
+            tmpl.inflate_block(tmpl.inflater);
+        });
+}
+
+struct std_stream_map
+{
+    std::map<unsigned, int *> streams;
+
+    void insert(unsigned id, int * ptr) { streams.insert(std::make_pair(id, ptr)); }
+    void erase(unsigned id) { streams.erase(id); }
+    int * find(unsigned id) const {
+        auto pos(streams.find(id));
+        return pos == streams.end() ? nullptr : pos->second;
+    }
+};
+
+struct dense_stream_map
+{
+    spdy::stream_table<int> streams;
+
+    void insert(unsigned id, int * ptr) { streams.insert(id, ptr); }
+    void erase(unsigned id) { streams.erase(id); }
+    int * find(unsigned id) const { return streams.find(id); }
+};
+
+// Keep nstreams streams open in one session. Each operation opens a
+// stream with the next client stream ID, looks up every open stream the
+// way a DATA or WINDOW_UPDATE frame would, and closes one of the older
+// streams, picked so that streams don't always close in order.
+template <typename Map> void
+bench_stream_map(const char * mapname, unsigned nstreams)
+{
+    const unsigned iterations = 2000000 / nstreams;
+    std::vector<unsigned> open;
+    unsigned next = 1;
+    size_t victim = 0;
+    int value = 0;
+    char name[128];
+    Map map;
+
+    for (unsigned i = 0; i < nstreams; ++i) {
+        map.insert(next, &value);
+        open.push_back(next);
+        next += 2;
+    }
+
+    snprintf(name, sizeof(name), "%s, %u streams", mapname, nstreams);
+    measure(name, iterations, [&]() {
+        size_t found = 0;
+
+        map.insert(next, &value);
+        for (auto id(open.begin()); id != open.end(); ++id) {
+            found += map.find(*id) != nullptr;
+        }
+
+        victim = (victim + 7) % open.size();
+        map.erase(open[victim]);
+        open[victim] = next;
+        next += 2;
+        sink = found;
+    });
+}
+
+static void
+bench_stream_maps()
+{
+    const unsigned counts[] = { 100, 1000 };
+
+    for (unsigned i = 0; i < countof(counts); ++i) {
+        bench_stream_map<std_stream_map>("stream std::map open+find+close", counts[i]);
+        bench_stream_map<dense_stream_map>("stream_table open+find+close", counts[i]);
+    }
+}
+
+// Mutex that counts how often it is taken by a different thread than the
+// one that took it last. Each hand-off moves the lock (and the state it
+// guards) from one CPU cache to another.
+struct handoff_mutex
+{
+    handoff_mutex() : handoffs(0) {}
+
+    void lock() {
+        m.lock();
+        if (owner != std::this_thread::get_id()) {
+            owner = std::this_thread::get_id();
+            ++handoffs;
+        }
+    }
+
+    void unlock() { m.unlock(); }
+
+    std::mutex      m;
+    std::thread::id owner;
+    unsigned long   handoffs;
+};
+
+struct modeled_stream
+{
+    handoff_mutex   continuation;   // stream continuation TSMutex
+    handoff_mutex   lock;           // spdy_io_stream::lock
+};
+
+static void
+report_handoffs(const char * name, unsigned requests,
+        std::chrono::steady_clock::time_point start,
+        unsigned long handoffs)
+{
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+
+    printf("%-48s %10.1f ns/op %6.2f hand-offs/op\n", name,
+            ns / requests, (double)handoffs / requests);
+}
+
+// Model the locking of one request as the chain of events that it causes.
+// The session thread takes the SYN_STREAM (session mutex, then the stream
+// lock to open it) and the origin server connection then delivers 5 events
+// (DNS, connect, headers, data, EOS), each under the stream continuation
+// mutex and the stream lock, reenabling the session write VIO under the
+// session mutex. After each of the first 4, the session thread writes the
+// frames that the event spooled. With per-stream mutexes, ATS runs the
+// origin connection on whichever thread it landed on, so each step can move
+// to the other thread; with a shared session mutex, every event of the
+// session is serialized on the session thread.
+static void
+bench_lock_handoff()
+{
+    const unsigned requests = 20000;
+    const unsigned nstreams = 8;
+    const unsigned events = 5;
+
+    {
+        handoff_mutex session;
+        modeled_stream streams[nstreams];
+        std::atomic<unsigned> step(0);
+        auto start = std::chrono::steady_clock::now();
+
+        // Wait for the other thread to finish the previous step.
+        auto wait = [&step](unsigned n) {
+            while (step.load(std::memory_order_acquire) != n) {
+                std::this_thread::yield();
+            }
+        };
+
+        std::thread origin([&]() {
+            for (unsigned r = 0; r < requests; ++r) {
+                modeled_stream& stream = streams[r % nstreams];
+                for (unsigned e = 0; e < events; ++e) {
+                    wait(r * events * 2 + e * 2 + 1);
+                    {
+                        std::lock_guard<handoff_mutex> cont(stream.continuation);
+                        std::lock_guard<handoff_mutex> lk(stream.lock);
+                        std::lock_guard<handoff_mutex> vio(session);
+                        sink = r;
+                    }
+                    step.fetch_add(1, std::memory_order_release);
+                }
+            }
+        });
+
+        for (unsigned r = 0; r < requests; ++r) {
+            modeled_stream& stream = streams[r % nstreams];
+            for (unsigned e = 0; e < events; ++e) {
+                wait(r * events * 2 + e * 2);
+                if (e == 0) {
+                    std::lock_guard<handoff_mutex> io(session);
+                    std::lock_guard<handoff_mutex> lk(stream.lock);
+                    sink = r;
+                } else {
+                    std::lock_guard<handoff_mutex> io(session);
+                    sink = r;
+                }
+                step.fetch_add(1, std::memory_order_release);
+            }
+        }
+
+        origin.join();
+
+        unsigned long handoffs = session.handoffs;
+        for (unsigned i = 0; i < nstreams; ++i) {
+            handoffs += streams[i].continuation.handoffs + streams[i].lock.handoffs;
+        }
+
+        report_handoffs("request locking, per-stream mutexes", requests,
+                start, handoffs);
+    }
+
+    {
+        handoff_mutex session;
+        auto start = std::chrono::steady_clock::now();
+
+        for (unsigned r = 0; r < requests; ++r) {
+            for (unsigned e = 0; e < events * 2; ++e) {
+                std::lock_guard<handoff_mutex> io(session);
+                sink = r;
+            }
+        }
+
+        report_handoffs("request locking, shared session mutex", requests,
+                start, session.handoffs);
+    }
+}
+
+// Model of a TSIOBuffer: a chain of slices of reference counted blocks.
+// Writing copies into the last block, or a new one when it is full or
+// shared. Copying from another buffer clones the block references, like
+// TSIOBufferCopy() does, so the blocks become shared.
+struct modeled_iobuffer
+{
+    enum : size_t { block_size = 32 * 1024 };
+
+    struct slice
+    {
+        std::shared_ptr<uint8_t>    block;
+        size_t                      start;
+        size_t                      end;
+    };
+
+    modeled_iobuffer() : writable(false) {}
+
+    void write(const void * ptr, size_t nbytes) {
+        const uint8_t * src = (const uint8_t *)ptr;
+
+        while (nbytes) {
+            if (!writable || slices.back().end == block_size) {
+                slice s = { std::shared_ptr<uint8_t>(new uint8_t[block_size],
+                        std::default_delete<uint8_t[]>()), 0, 0 };
+                slices.push_back(s);
+                writable = true;
+            }
+
+            slice& s = slices.back();
+            size_t n = std::min(nbytes, block_size - s.end);
+            memcpy(s.block.get() + s.end, src, n);
+            s.end += n;
+            src += n;
+            nbytes -= n;
+        }
+    }
+
+    // Copy nbytes from the front of src out of the buffer.
+    void read(void * ptr, size_t nbytes) const {
+        uint8_t * dst = (uint8_t *)ptr;
+
+        for (auto s(slices.begin()); nbytes; ++s) {
+            size_t n = std::min(nbytes, s->end - s->start);
+            memcpy(dst, s->block.get() + s->start, n);
+            dst += n;
+            nbytes -= n;
+        }
+    }
+
+    // Append nbytes from the front of src by reference.
+    void copy(const modeled_iobuffer& src, size_t nbytes) {
+        for (auto s(src.slices.begin()); nbytes; ++s) {
+            slice clone = *s;
+            clone.end = std::min(s->end, s->start + nbytes);
+            nbytes -= clone.end - clone.start;
+            slices.push_back(clone);
+        }
+
+        writable = false;
+    }
+
+    void consume(size_t nbytes) {
+        while (nbytes) {
+            slice& s = slices.front();
+            size_t n = std::min(nbytes, s.end - s.start);
+            s.start += n;
+            nbytes -= n;
+            if (s.start == s.end) {
+                slices.erase(slices.begin());
+            }
+        }
+
+        writable = writable && !slices.empty();
+    }
+
+    std::vector<slice>  slices;
+    bool                writable;   // the last block is ours to write
+};
+
+// Forward a large response from the origin server buffer to the session
+// buffer in target size DATA frames. Copying the payload memcpy's every
+// byte into the frame, then into the staging buffer, then into the output
+// buffer. Referencing the payload only writes the frame header; the
+// payload blocks are cloned into the stream's reused payload buffer and
+// then into the output. The output is drained after each frame, as the
+// network would.
+//
+// This runs against modeled_iobuffer, not a real TSIOBuffer, so the
+// numbers compare the two strategies rather than predict what ATS does.
+static void
+bench_data_forwarding()
+{
+    const size_t objsize = 16 * 1024 * 1024;
+    const size_t target = spdy::data_framer::default_target;
+    const unsigned iterations = 20;
+
+    modeled_iobuffer origin;
+    std::vector<uint8_t> bytes(modeled_iobuffer::block_size, 'x');
+    for (size_t n = 0; n < objsize; n += bytes.size()) {
+        origin.write(&bytes[0], bytes.size());
+    }
+
+    measure("16MB response DATA, copy payload (model)", iterations,
+            [&origin, target]() {
+        modeled_iobuffer input(origin);
+        modeled_iobuffer output;
+        spdy::byte_buffer staging;
+        spdy::data_framer framer(target, objsize);
+        size_t avail = objsize;
+        size_t total = 0;
+        bool fin;
+
+        do {
+            size_t nbytes = framer.next(avail, false, false, fin);
+            uint8_t * frame = (uint8_t *)malloc(nbytes);
+
+            input.read(frame, nbytes);
+            input.consume(nbytes);
+            avail -= nbytes;
+
+            uint8_t * ptr = staging.prepare(spdy::message_header::size + nbytes);
+            memset(ptr, 0, spdy::message_header::size);
+            memcpy(ptr + spdy::message_header::size, frame, nbytes);
+            staging.commit(spdy::message_header::size + nbytes);
+            free(frame);
+
+            output.write(staging.data(), staging.size());
+            output.consume(staging.size());
+            total += staging.size();
+            staging.clear();
+        } while (!fin);
+
+        sink = total;
+    });
+
+    measure("16MB response DATA, reference payload (model)", iterations,
+            [&origin, target]() {
+        modeled_iobuffer input(origin);
+        modeled_iobuffer output;
+        modeled_iobuffer payload;
+        spdy::data_framer framer(target, objsize);
+        uint8_t hdr[spdy::message_header::size] = { 0 };
+        size_t avail = objsize;
+        size_t total = 0;
+        bool fin;
+
+        do {
+            size_t nbytes = framer.next(avail, false, false, fin);
+
+            payload.copy(input, nbytes);
+            input.consume(nbytes);
+            avail -= nbytes;
+
+            output.write(hdr, sizeof(hdr));
+            output.copy(payload, nbytes);
+            output.consume(sizeof(hdr) + nbytes);
+            payload.consume(nbytes);
+            total += sizeof(hdr) + nbytes;
+        } while (!fin);
+
+        sink = total;
+    });
+}
+
+int main(void)
+{
+    bench_header_maps();
+    bench_hop_by_hop_filter();
+    bench_header_normalize();
+    bench_syn_reply_encode();
+    bench_response_arena();
+    bench_syn_stream_decode();
+    bench_malformed_frames();
+    bench_session_accept();
+    bench_stream_maps();
+    bench_lock_handoff();
+    bench_data_forwarding();
+    return 0;
+}
+
+/* vim: set sw=4 ts=4 tw=79 et : */
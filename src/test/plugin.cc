@@ -0,0 +1,437 @@
+/*
+ * Copyright (c) 2012 James Peach
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// plugin.cc - Stream lifecycle tests, run against the fake plugin API.
+
+#include <ts/ts.h>
+#include <spdy/spdy.h>
+#include <base/logging.h>
+#include "../ts/io.h"
+#include "../ts/protocol.h"
+#include "tsfake.h"
+
+#include <assert.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+static char lookup_result;
+
+static spdy_io_control *
+create_session()
+{
+    spdy_io_control * io = retain(new spdy_io_control(TSHttpConnect(nullptr)));
+
+    io->codec = spdy::header_codec::get(spdy::PROTOCOL_VERSION_3);
+    return io;
+}
+
+// Open a stream and deliver the DNS result, which connects it to the
+// origin server, then let it send the request.
+static spdy_io_stream *
+connect_stream(spdy_io_control * io, unsigned stream_id)
+{
+    spdy_io_stream * stream = io->create_stream(stream_id);
+
+    stream->io = io;
+    assert(stream->open(spdy_io_stream::open_none));
+    fake_cont_call(stream->continuation, TS_EVENT_HOST_LOOKUP, &lookup_result);
+    assert(stream->vconn != nullptr);
+
+    fake_cont_call(stream->continuation, TS_EVENT_VCONN_WRITE_READY,
+            TSVConnWriteVIOGet(stream->vconn));
+    return stream;
+}
+
+// Test that a stream that connected to the origin server goes back to the
+// stream pool once the origin server is done and the session lets go.
+void connected_stream_recycle()
+{
+    spdy_io_control * io = create_session();
+    spdy_io_stream * stream = connect_stream(io, 1);
+    TSVConn vconn = stream->vconn;
+
+    fake_cont_call(stream->continuation, TS_EVENT_VCONN_EOS,
+            TSVConnReadVIOGet(vconn));
+    assert(stream->vconn == nullptr);
+    assert(stream->is_closed());
+    assert(fake_vconn_closes(vconn) == 1);
+
+    // Dropping the last reference recycles the stream, which requires it to
+    // be closed, so the next stream is the same one.
+    io->destroy_stream(1);
+    spdy_io_stream * next = retain(spdy_io_stream::create(3));
+    assert(next == stream);
+
+    release(next);
+    release(io);
+}
+
+// Deliver a read event with the given origin server data.
+static void
+receive_origin_data(spdy_io_stream * stream, TSEvent ev, const std::string& data)
+{
+    TSIOBufferWrite(stream->input->buffer, data.data(), data.size());
+    fake_cont_call(stream->continuation, ev, TSVConnReadVIOGet(stream->vconn));
+}
+
+// Take the queued frames and check their types, DATA sizes and flags.
+static void
+check_frames(spdy_io_control * io,
+        const spdy_frame::frame_type * types, const size_t * sizes,
+        const unsigned * flags, unsigned count)
+{
+    spdy_frame * frame = io->outgoing.pop_all();
+
+    for (unsigned i = 0; i < count; ++i) {
+        assert(frame != nullptr);
+        assert(frame->type == types[i]);
+        if (frame->type == spdy_frame::frame_data) {
+            assert(frame->size == sizes[i]);
+            assert(frame->flags == flags[i]);
+        }
+
+        spdy_frame * next = frame->next;
+        spdy_frame::destroy(frame);
+        frame = next;
+    }
+
+    assert(frame == nullptr);
+}
+
+// Test that the response body ends with FIN on its last DATA frame, and
+// that the origin connection is closed exactly once, whether the body ends
+// at its Content-Length or at EOS.
+void response_body_fin()
+{
+    const spdy_frame::frame_type types[] = {
+        spdy_frame::frame_syn_reply, spdy_frame::frame_data,
+        spdy_frame::frame_data
+    };
+
+    spdy_io_control * io = create_session();
+
+    {
+        // The frame with the last byte of the content length carries FIN,
+        // and we don't wait for the origin server to close.
+        spdy_io_stream * stream = connect_stream(io, 1);
+        TSVConn vconn = stream->vconn;
+        const size_t sizes[] = { 0, 5 };
+        const unsigned flags[] = { 0, spdy::FLAG_FIN };
+
+        fake_response_content_length("5");
+        receive_origin_data(stream, TS_EVENT_VCONN_READ_READY,
+                "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello");
+        assert(stream->is_closed());
+        assert(fake_vconn_closes(vconn) == 1);
+        check_frames(io, types, sizes, flags, 2);
+        io->destroy_stream(1);
+    }
+
+    {
+        // Without a content length, the body ends at EOS. The flush timer
+        // forwarded everything already, so FIN needs an empty frame.
+        spdy_io_stream * stream = connect_stream(io, 3);
+        TSVConn vconn = stream->vconn;
+        const size_t sizes[] = { 0, 5, 0 };
+        const unsigned flags[] = { 0, 0, spdy::FLAG_FIN };
+
+        fake_response_content_length("");
+        receive_origin_data(stream, TS_EVENT_VCONN_READ_READY,
+                "HTTP/1.1 200 OK\r\n\r\nhello");
+        assert(fake_run_timers() == 1);
+        assert(stream->is_open());
+        receive_origin_data(stream, TS_EVENT_VCONN_EOS, "");
+        assert(stream->is_closed());
+        assert(fake_vconn_closes(vconn) == 1);
+        check_frames(io, types, sizes, flags, 3);
+        io->destroy_stream(3);
+    }
+
+    {
+        // Data that arrives with EOS carries FIN itself.
+        spdy_io_stream * stream = connect_stream(io, 5);
+        TSVConn vconn = stream->vconn;
+        const size_t sizes[] = { 0, 5 };
+        const unsigned flags[] = { 0, spdy::FLAG_FIN };
+
+        receive_origin_data(stream, TS_EVENT_VCONN_READ_READY,
+                "HTTP/1.1 200 OK\r\n\r\n");
+        receive_origin_data(stream, TS_EVENT_VCONN_EOS, "hello");
+        assert(fake_vconn_closes(vconn) == 1);
+        check_frames(io, types, sizes, flags, 2);
+        io->destroy_stream(5);
+    }
+
+    release(io);
+}
+
+// Take the queued frames and return the number of DATA frames that had a
+// payload buffer.
+static unsigned
+drop_payload_frames(spdy_io_control * io)
+{
+    unsigned count = 0;
+
+    for (spdy_frame * frame = io->outgoing.pop_all(); frame; ) {
+        spdy_frame * next = frame->next;
+        if (frame->payload) {
+            ++count;
+        }
+
+        spdy_frame::destroy(frame);
+        frame = next;
+    }
+
+    return count;
+}
+
+// Count the payload buffers that the stream has for reuse. This takes the
+// returned ones off the queue, as the stream does when it needs one.
+static unsigned
+idle_payloads(spdy_io_stream * stream)
+{
+    spdy_payload_buffer ** tail = &stream->idle_payloads;
+    unsigned count = 0;
+
+    while (*tail) {
+        tail = &(*tail)->next;
+        ++count;
+    }
+
+    for (*tail = stream->returned_payloads.pop_all(); *tail; ++count) {
+        tail = &(*tail)->next;
+    }
+
+    return count;
+}
+
+// Test that a stream reuses the payload buffers of the DATA frames that
+// were written, and that the frames keep the stream alive until then.
+void payload_buffer_reuse()
+{
+    const unsigned flush_delay = spdy_io_stream::data_flush_delay;
+    spdy_io_control * io = create_session();
+    spdy_io_stream * stream = connect_stream(io, 1);
+    unsigned owned;
+
+    // Send each read straight away.
+    spdy_io_stream::data_flush_delay = 0;
+
+    fake_response_content_length("");
+    receive_origin_data(stream, TS_EVENT_VCONN_READ_READY,
+            "HTTP/1.1 200 OK\r\n\r\nhello");
+    assert(drop_payload_frames(io) == 1);
+    owned = idle_payloads(stream);
+    assert(owned >= 1);
+
+    for (unsigned i = 0; i < 4; ++i) {
+        receive_origin_data(stream, TS_EVENT_VCONN_READ_READY, "world");
+        assert(drop_payload_frames(io) == 1);
+        assert(idle_payloads(stream) == owned);
+    }
+
+    // The session still has the last frame when the stream goes away, so
+    // the stream is only recycled once the frame is gone.
+    receive_origin_data(stream, TS_EVENT_VCONN_EOS, "!");
+    spdy_frame * last = io->outgoing.pop_all();
+    assert(last && last->payload && last->next == nullptr);
+    io->destroy_stream(1);
+    spdy_io_stream * other = retain(spdy_io_stream::create(3));
+    assert(other != stream);
+    release(other);
+
+    spdy_frame::destroy(last);
+    spdy_io_stream * next = retain(spdy_io_stream::create(5));
+    assert(next == stream);
+    assert(idle_payloads(next) == owned);
+
+    spdy_io_stream::data_flush_delay = flush_delay;
+    release(next);
+    release(io);
+}
+
+// Test that a short body tail waits across read events for more content
+// to fill its frame, and goes out when the flush timer goes off or the
+// body ends.
+void data_tail_hold()
+{
+    const size_t frame_size = spdy_io_stream::data_frame_size;
+    const spdy_frame::frame_type types[] = {
+        spdy_frame::frame_syn_reply, spdy_frame::frame_data
+    };
+
+    spdy_io_control * io = create_session();
+    spdy_io_stream * stream = connect_stream(io, 1);
+
+    spdy_io_stream::data_frame_size = 10;
+    fake_response_content_length("");
+    receive_origin_data(stream, TS_EVENT_VCONN_READ_READY,
+            "HTTP/1.1 200 OK\r\n\r\nhello");
+    check_frames(io, types, nullptr, nullptr, 1);
+
+    {
+        // The next read fills a frame and leaves one byte over.
+        const size_t sizes[] = { 10 };
+        const unsigned flags[] = { 0 };
+        receive_origin_data(stream, TS_EVENT_VCONN_READ_READY, "world!");
+        check_frames(io, types + 1, sizes, flags, 1);
+    }
+
+    {
+        // One timer was scheduled for the held tail.
+        const size_t sizes[] = { 1 };
+        const unsigned flags[] = { 0 };
+        assert(fake_run_timers() == 1);
+        check_frames(io, types + 1, sizes, flags, 1);
+        assert(fake_run_timers() == 0);
+    }
+
+    {
+        // EOS sends the held tail with FIN. The timer that was scheduled
+        // for it finds the stream closed.
+        const size_t sizes[] = { 5 };
+        const unsigned flags[] = { spdy::FLAG_FIN };
+        receive_origin_data(stream, TS_EVENT_VCONN_READ_READY, "abc");
+        check_frames(io, types, nullptr, nullptr, 0);
+        receive_origin_data(stream, TS_EVENT_VCONN_EOS, "de");
+        check_frames(io, types + 1, sizes, flags, 1);
+        assert(stream->is_closed());
+        assert(fake_run_timers() == 1);
+    }
+
+    spdy_io_stream::data_frame_size = frame_size;
+    io->destroy_stream(1);
+    release(io);
+}
+
+// Write the queued frames and return the type of each frame that went into
+// the session output buffer, with DATA as -1, and consume them.
+static std::vector<int>
+written_frames(spdy_io_control * io)
+{
+    std::vector<int> types;
+    int64_t nbytes;
+
+    spdy_write_frames(io);
+
+    TSIOBufferBlock blk = TSIOBufferReaderStart(io->output.reader);
+    const uint8_t * ptr = (const uint8_t *)TSIOBufferBlockReadStart(blk,
+            io->output.reader, &nbytes);
+
+    for (int64_t pos = 0; pos < nbytes; ) {
+        spdy::message_header hdr = spdy::message_header::parse(
+                ptr + pos, nbytes - pos);
+        types.push_back(hdr.is_control ? (int)hdr.control.type : -1);
+        pos += spdy::message_header::size + hdr.datalen;
+    }
+
+    io->output.consume(nbytes);
+    return types;
+}
+
+// Test that a stream's RST_STREAM goes out after the DATA it queued first,
+// and that DATA is dropped once the stream is destroyed, whether it was
+// still waiting for its turn or the stream queues it later.
+void reset_stream_order()
+{
+    const size_t output_limit = spdy_io_control::output_limit;
+    spdy_io_control * io = create_session();
+
+    {
+        // A local reset right after the response, as the 400 path does.
+        spdy_io_stream * stream = connect_stream(io, 1);
+        const int expected[] = {
+            spdy::CONTROL_SYN_REPLY, -1, spdy::CONTROL_RST_STREAM
+        };
+
+        fake_response_content_length("");
+        receive_origin_data(stream, TS_EVENT_VCONN_READ_READY,
+                "HTTP/1.1 200 OK\r\n\r\nhello");
+        assert(fake_run_timers() == 1);
+        spdy_send_reset_stream(io, 1, spdy::CANCEL);
+        io->destroy_stream(1);
+
+        std::vector<int> types(written_frames(io));
+        assert(types.size() == countof(expected));
+        assert(std::equal(types.begin(), types.end(), expected));
+
+        // The origin server is still sending.
+        receive_origin_data(stream, TS_EVENT_VCONN_EOS, "world");
+        assert(written_frames(io).empty());
+        assert(io->queued_bytes.load() == 0);
+    }
+
+    {
+        // A reset by the client while the DATA waits for its turn.
+        spdy_io_stream * stream = connect_stream(io, 3);
+
+        spdy_io_control::output_limit = 0;
+        receive_origin_data(stream, TS_EVENT_VCONN_READ_READY,
+                "HTTP/1.1 200 OK\r\n\r\nhello");
+        assert(fake_run_timers() == 1);
+        assert(written_frames(io).size() == 1);
+        assert(io->scheduled.size() == 1);
+
+        io->destroy_stream(3);
+        assert(io->scheduled.empty());
+        assert(io->queued_bytes.load() == 0);
+
+        spdy_io_control::output_limit = output_limit;
+        receive_origin_data(stream, TS_EVENT_VCONN_EOS, "");
+        assert(written_frames(io).empty());
+    }
+
+    release(io);
+}
+
+// Test that the request only takes its URL from the request line headers
+// of its own protocol version, and passes the others on as plain headers.
+void request_line_version()
+{
+    spdy::arena arena;
+    http_request request(&arena);
+
+    request.version = spdy::PROTOCOL_VERSION_3;
+    request("url", "/v2");
+    request("host", "v2.example.com");
+    assert(request.url.path.empty());
+    assert(request.url.hostport.empty());
+    request(":path", "/v3");
+    request(":host", "v3.example.com");
+    assert(request.url.path == "/v3");
+    assert(request.url.hostport == "v3.example.com");
+
+    request.reset();
+    request.version = spdy::PROTOCOL_VERSION_2;
+    request(":path", "/v3");
+    assert(request.url.path.empty());
+    request("url", "/v2");
+    assert(request.url.path == "/v2");
+}
+
+int main(void)
+{
+    connected_stream_recycle();
+    response_body_fin();
+    reset_stream_order();
+    payload_buffer_reuse();
+    data_tail_hold();
+    request_line_version();
+    return 0;
+}
+
+/* vim: set sw=4 ts=4 tw=79 et : */
@@ -0,0 +1,422 @@
+/*
+ * Copyright (c) 2012 James Peach
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// tsfake.cc - Fake Traffic Server plugin API for the plugin tests.
+
+#include "tsfake.h"
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// The real handles are opaque, so we cast our own types to them.
+template <typename H, typename T> static H handle(T * ptr) {
+    return reinterpret_cast<H>(ptr);
+}
+
+template <typename T, typename H> static T * object(H h) {
+    return reinterpret_cast<T *>(h);
+}
+
+struct fake_cont
+{
+    TSEventFunc func;
+    TSMutex     mutex;
+    void *      data;
+};
+
+struct fake_mutex
+{
+    int         unused;
+};
+
+struct fake_vio
+{
+    TSMutex     mutex;
+};
+
+struct fake_vconn
+{
+    fake_vio    read;
+    fake_vio    write;
+    unsigned    closes;
+};
+
+struct fake_iobuffer
+{
+    std::string bytes;
+};
+
+struct fake_reader
+{
+    fake_iobuffer * buffer;
+    size_t          offset;
+
+    size_t avail() const {
+        return buffer->bytes.size() - offset;
+    }
+};
+
+// Headers are never inspected, so every header location is the same.
+static char             header_loc;
+static char             url_loc;
+static char             field_loc;
+static fake_mutex       vio_mutex;
+static char             pending_action;
+static std::string      content_length;
+static std::vector<TSCont> timers;
+
+int
+fake_cont_call(TSCont contp, TSEvent ev, void * edata)
+{
+    fake_cont * cont = object<fake_cont>(contp);
+    return cont->func(contp, ev, edata);
+}
+
+unsigned
+fake_run_timers()
+{
+    std::vector<TSCont> due;
+
+    // The events can schedule new timers, which wait for the next call.
+    due.swap(timers);
+    for (auto contp(due.begin()); contp != due.end(); ++contp) {
+        fake_cont_call(*contp, TS_EVENT_TIMEOUT, nullptr);
+    }
+
+    return due.size();
+}
+
+unsigned
+fake_vconn_closes(TSVConn vconn)
+{
+    return object<fake_vconn>(vconn)->closes;
+}
+
+void
+fake_response_content_length(const std::string& value)
+{
+    content_length = value;
+}
+
+extern "C" {
+
+const char * TS_MIME_FIELD_CONTENT_LENGTH = "Content-Length";
+int TS_MIME_LEN_CONTENT_LENGTH = 14;
+
+int
+_TSAssert(const char * txt, const char * file, int line)
+{
+    fprintf(stderr, "%s:%d: failed assertion '%s'\n", file, line, txt);
+    abort();
+}
+
+int
+_TSReleaseAssert(const char * txt, const char * file, int line)
+{
+    fprintf(stderr, "%s:%d: failed assertion '%s'\n", file, line, txt);
+    abort();
+}
+
+int TSIsDebugTagSet(const char *) { return 0; }
+void TSDebug(const char *, const char *, ...) {}
+void TSError(const char *, ...) {}
+
+TSCont
+TSContCreate(TSEventFunc func, TSMutex mutex)
+{
+    fake_cont * cont = new fake_cont();
+    cont->func = func;
+    cont->mutex = mutex;
+    cont->data = nullptr;
+    return handle<TSCont>(cont);
+}
+
+void TSContDestroy(TSCont contp) { delete object<fake_cont>(contp); }
+void TSContDataSet(TSCont contp, void * data) { object<fake_cont>(contp)->data = data; }
+void * TSContDataGet(TSCont contp) { return object<fake_cont>(contp)->data; }
+TSMutex TSContMutexGet(TSCont contp) { return object<fake_cont>(contp)->mutex; }
+
+TSMutex TSMutexCreate(void) { return handle<TSMutex>(new fake_mutex()); }
+void TSMutexLock(TSMutex) {}
+void TSMutexUnlock(TSMutex) {}
+
+// Lookups never finish by themselves; the test delivers the result.
+TSAction
+TSHostLookup(TSCont, const char *, size_t)
+{
+    return handle<TSAction>(&pending_action);
+}
+
+int TSActionDone(TSAction) { return 0; }
+void TSActionCancel(TSAction) {}
+
+TSAction
+TSContSchedule(TSCont contp, TSHRTime, TSThreadPool)
+{
+    timers.push_back(contp);
+    return handle<TSAction>(&pending_action);
+}
+
+struct sockaddr const *
+TSHostLookupResultAddrGet(TSHostLookupResult)
+{
+    static struct sockaddr_in sin;
+
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return (const struct sockaddr *)&sin;
+}
+
+TSVConn
+TSHttpConnect(struct sockaddr const *)
+{
+    fake_vconn * vconn = new fake_vconn();
+    vconn->read.mutex = handle<TSMutex>(&vio_mutex);
+    vconn->write.mutex = handle<TSMutex>(&vio_mutex);
+    vconn->closes = 0;
+    return handle<TSVConn>(vconn);
+}
+
+TSVIO
+TSVConnRead(TSVConn vconn, TSCont, TSIOBuffer, int64_t)
+{
+    return handle<TSVIO>(&object<fake_vconn>(vconn)->read);
+}
+
+TSVIO
+TSVConnWrite(TSVConn vconn, TSCont, TSIOBufferReader, int64_t)
+{
+    return handle<TSVIO>(&object<fake_vconn>(vconn)->write);
+}
+
+TSVIO
+TSVConnReadVIOGet(TSVConn vconn)
+{
+    return handle<TSVIO>(&object<fake_vconn>(vconn)->read);
+}
+
+TSVIO
+TSVConnWriteVIOGet(TSVConn vconn)
+{
+    return handle<TSVIO>(&object<fake_vconn>(vconn)->write);
+}
+
+void TSVConnClose(TSVConn vconn) { ++object<fake_vconn>(vconn)->closes; }
+TSMutex TSVIOMutexGet(TSVIO vio) { return object<fake_vio>(vio)->mutex; }
+void TSVIOReenable(TSVIO) {}
+
+TSIOBuffer TSIOBufferCreate(void) { return handle<TSIOBuffer>(new fake_iobuffer()); }
+void TSIOBufferDestroy(TSIOBuffer buf) { delete object<fake_iobuffer>(buf); }
+void TSIOBufferProduce(TSIOBuffer, int64_t) {}
+void TSIOBufferWaterMarkSet(TSIOBuffer, int64_t) {}
+
+int64_t
+TSIOBufferWrite(TSIOBuffer buf, const void * ptr, int64_t nbytes)
+{
+    object<fake_iobuffer>(buf)->bytes.append((const char *)ptr, nbytes);
+    return nbytes;
+}
+
+int64_t
+TSIOBufferCopy(TSIOBuffer buf, TSIOBufferReader rdr, int64_t nbytes, int64_t offset)
+{
+    fake_reader * reader = object<fake_reader>(rdr);
+    size_t avail = reader->avail() - std::min(reader->avail(), (size_t)offset);
+
+    nbytes = std::min((size_t)nbytes, avail);
+    object<fake_iobuffer>(buf)->bytes.append(
+            reader->buffer->bytes, reader->offset + offset, nbytes);
+    return nbytes;
+}
+
+TSIOBufferReader
+TSIOBufferReaderAlloc(TSIOBuffer buf)
+{
+    fake_reader * reader = new fake_reader();
+    reader->buffer = object<fake_iobuffer>(buf);
+    reader->offset = reader->buffer->bytes.size();
+    return handle<TSIOBufferReader>(reader);
+}
+
+void TSIOBufferReaderFree(TSIOBufferReader rdr) { delete object<fake_reader>(rdr); }
+
+void
+TSIOBufferReaderConsume(TSIOBufferReader rdr, int64_t nbytes)
+{
+    fake_reader * reader = object<fake_reader>(rdr);
+    reader->offset += std::min(reader->avail(), (size_t)nbytes);
+}
+
+int64_t
+TSIOBufferReaderAvail(TSIOBufferReader rdr)
+{
+    return object<fake_reader>(rdr)->avail();
+}
+
+// Each buffer is a single block.
+TSIOBufferBlock
+TSIOBufferReaderStart(TSIOBufferReader rdr)
+{
+    fake_reader * reader = object<fake_reader>(rdr);
+    return reader->avail() ? handle<TSIOBufferBlock>(reader->buffer) : nullptr;
+}
+
+TSIOBufferBlock
+TSIOBufferStart(TSIOBuffer buf)
+{
+    return handle<TSIOBufferBlock>(object<fake_iobuffer>(buf));
+}
+
+TSIOBufferBlock TSIOBufferBlockNext(TSIOBufferBlock) { return nullptr; }
+
+const char *
+TSIOBufferBlockReadStart(TSIOBufferBlock, TSIOBufferReader rdr, int64_t * avail)
+{
+    fake_reader * reader = object<fake_reader>(rdr);
+
+    *avail = reader->avail();
+    return reader->buffer->bytes.data() + reader->offset;
+}
+
+int64_t
+TSIOBufferBlockReadAvail(TSIOBufferBlock, TSIOBufferReader rdr)
+{
+    return object<fake_reader>(rdr)->avail();
+}
+
+TSMBuffer TSMBufferCreate(void) { return handle<TSMBuffer>(new fake_mutex()); }
+
+TSReturnCode
+TSMBufferDestroy(TSMBuffer buf)
+{
+    delete object<fake_mutex>(buf);
+    return TS_SUCCESS;
+}
+
+TSReturnCode TSHandleMLocRelease(TSMBuffer, TSMLoc, TSMLoc) { return TS_SUCCESS; }
+
+TSMLoc TSHttpHdrCreate(TSMBuffer) { return handle<TSMLoc>(&header_loc); }
+void TSHttpHdrDestroy(TSMBuffer, TSMLoc) {}
+TSReturnCode TSHttpHdrTypeSet(TSMBuffer, TSMLoc, TSHttpType) { return TS_SUCCESS; }
+TSReturnCode TSHttpHdrVersionSet(TSMBuffer, TSMLoc, int) { return TS_SUCCESS; }
+int TSHttpHdrVersionGet(TSMBuffer, TSMLoc) { return TS_HTTP_VERSION(1, 1); }
+TSReturnCode TSHttpHdrStatusSet(TSMBuffer, TSMLoc, TSHttpStatus) { return TS_SUCCESS; }
+TSHttpStatus TSHttpHdrStatusGet(TSMBuffer, TSMLoc) { return TS_HTTP_STATUS_OK; }
+const char * TSHttpHdrReasonLookup(TSHttpStatus) { return "OK"; }
+TSReturnCode TSHttpHdrMethodSet(TSMBuffer, TSMLoc, const char *, int) { return TS_SUCCESS; }
+TSReturnCode TSHttpHdrUrlSet(TSMBuffer, TSMLoc, TSMLoc) { return TS_SUCCESS; }
+
+TSReturnCode
+TSHttpHdrUrlGet(TSMBuffer, TSMLoc, TSMLoc * loc)
+{
+    *loc = handle<TSMLoc>(&url_loc);
+    return TS_SUCCESS;
+}
+
+void
+TSHttpHdrPrint(TSMBuffer, TSMLoc, TSIOBuffer buf)
+{
+    object<fake_iobuffer>(buf)->bytes.append("GET / HTTP/1.1\r\n\r\n");
+}
+
+TSHttpParser TSHttpParserCreate(void) { return handle<TSHttpParser>(new fake_mutex()); }
+void TSHttpParserClear(TSHttpParser) {}
+void TSHttpParserDestroy(TSHttpParser parser) { delete object<fake_mutex>(parser); }
+
+TSParseResult
+TSHttpHdrParseResp(TSHttpParser, TSMBuffer, TSMLoc, const char ** start, const char * end)
+{
+    static const char eoh[] = "\r\n\r\n";
+    const char * ptr = std::search(*start, end, eoh, eoh + 4);
+
+    if (ptr == end) {
+        *start = end;
+        return TS_PARSE_CONT;
+    }
+
+    *start = ptr + 4;
+    return TS_PARSE_DONE;
+}
+
+TSReturnCode
+TSUrlCreate(TSMBuffer, TSMLoc * loc)
+{
+    *loc = handle<TSMLoc>(&url_loc);
+    return TS_SUCCESS;
+}
+
+TSReturnCode TSUrlSchemeSet(TSMBuffer, TSMLoc, const char *, int) { return TS_SUCCESS; }
+TSReturnCode TSUrlHostSet(TSMBuffer, TSMLoc, const char *, int) { return TS_SUCCESS; }
+TSReturnCode TSUrlPathSet(TSMBuffer, TSMLoc, const char *, int) { return TS_SUCCESS; }
+
+// The response has no headers but, optionally, Content-Length.
+TSMLoc TSMimeHdrFieldGet(TSMBuffer, TSMLoc, int) { return TS_NULL_MLOC; }
+TSMLoc TSMimeHdrFieldNext(TSMBuffer, TSMLoc, TSMLoc) { return TS_NULL_MLOC; }
+
+TSMLoc
+TSMimeHdrFieldFind(TSMBuffer, TSMLoc, const char * name, int len)
+{
+    if (content_length.empty() ||
+            strncasecmp(name, TS_MIME_FIELD_CONTENT_LENGTH, len) != 0) {
+        return TS_NULL_MLOC;
+    }
+
+    return handle<TSMLoc>(&field_loc);
+}
+
+const char *
+TSMimeHdrFieldNameGet(TSMBuffer, TSMLoc, TSMLoc, int * len)
+{
+    *len = TS_MIME_LEN_CONTENT_LENGTH;
+    return TS_MIME_FIELD_CONTENT_LENGTH;
+}
+
+const char *
+TSMimeHdrFieldValueStringGet(TSMBuffer, TSMLoc, TSMLoc, int, int * len)
+{
+    *len = content_length.size();
+    return content_length.data();
+}
+
+TSReturnCode
+TSMimeHdrFieldCreateNamed(TSMBuffer, TSMLoc, const char *, int, TSMLoc * loc)
+{
+    *loc = handle<TSMLoc>(&field_loc);
+    return TS_SUCCESS;
+}
+
+TSReturnCode TSMimeHdrFieldValueStringInsert(TSMBuffer, TSMLoc, TSMLoc, int, const char *, int) { return TS_SUCCESS; }
+TSReturnCode TSMimeHdrFieldAppend(TSMBuffer, TSMLoc, TSMLoc) { return TS_SUCCESS; }
+
+int
+TSStatCreate(const char *, TSRecordDataType, TSStatPersistence, TSStatSync)
+{
+    static int next;
+    return next++;
+}
+
+void TSStatIntIncrement(int, int64_t) {}
+void TSStatIntSet(int, int64_t) {}
+
+} // extern "C"
+
+/* vim: set sw=4 ts=4 tw=79 et : */
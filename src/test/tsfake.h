@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2012 James Peach
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TSFAKE_H_3B7E52C1_90D4_4A6F_8C2B_E61F0A94D7C3
+#define TSFAKE_H_3B7E52C1_90D4_4A6F_8C2B_E61F0A94D7C3
+
+#include <ts/ts.h>
+#include <string>
+
+// Single-threaded fake of the Traffic Server plugin API, just enough to
+// drive the plugin's stream state machine without a server. IO buffers
+// are plain byte strings, continuations run when the test delivers an
+// event, and nothing ever completes on its own.
+
+// Deliver an event to a continuation, as the event system would.
+int fake_cont_call(TSCont, TSEvent, void *);
+
+// Deliver TS_EVENT_TIMEOUT to every continuation that TSContSchedule() was
+// called for, as if their timers went off. Return the number of events.
+unsigned fake_run_timers();
+
+// Number of times TSVConnClose() was called on the given VConnection.
+unsigned fake_vconn_closes(TSVConn);
+
+// Response header parsing: TSHttpHdrParseResp() consumes everything up to
+// the first blank line, and the response has the given Content-Length
+// header, or none if it is empty.
+void fake_response_content_length(const std::string&);
+
+#endif /* TSFAKE_H_3B7E52C1_90D4_4A6F_8C2B_E61F0A94D7C3 */
+/* vim: set sw=4 ts=4 tw=79 et : */
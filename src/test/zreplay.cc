@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2012 James Peach
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// zreplay.cc - Replay captured response headers through the SYN_REPLY
+// header block encoder and report the compression ratio, CPU cost and
+// compressor memory for a range of zlib settings.
+//
+// Each input file holds one or more header blocks. A block is a sequence
+// of "name: value" lines, optionally preceded by an HTTP status line, and
+// blocks are separated by blank lines. This is the format that
+// "curl -D" writes. Lines starting with '#' are ignored.
+
+#include <spdy/spdy.h>
+#include <base/logging.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+typedef std::vector<spdy::key_value_block> block_list;
+
+// zlib allocator that tracks the number of bytes currently allocated and
+// the high water mark.
+struct counting_allocator : public spdy::zallocator
+{
+    counting_allocator() : current(0), peak(0) {
+        zalloc = counting_alloc;
+        zfree = counting_free;
+        opaque = this;
+    }
+
+    static voidpf counting_alloc(voidpf opaque, uInt items, uInt size) {
+        counting_allocator * self = (counting_allocator *)opaque;
+        size_t nbytes = (size_t)items * size;
+        size_t * ptr = (size_t *)malloc(sizeof(long double) + nbytes);
+
+        if (ptr == nullptr) {
+            return Z_NULL;
+        }
+
+        *ptr = nbytes;
+        self->current += nbytes;
+        self->peak = std::max(self->peak, self->current);
+        return (uint8_t *)ptr + sizeof(long double);
+    }
+
+    static void counting_free(voidpf opaque, voidpf addr) {
+        counting_allocator * self = (counting_allocator *)opaque;
+        size_t * ptr = (size_t *)((uint8_t *)addr - sizeof(long double));
+
+        self->current -= *ptr;
+        free(ptr);
+    }
+
+    size_t current;
+    size_t peak;
+};
+
+static std::string
+trim(const std::string& str)
+{
+    size_t first = str.find_first_not_of(" \t\r");
+    size_t last = str.find_last_not_of(" \t\r");
+
+    return (first == std::string::npos) ? std::string()
+        : str.substr(first, last - first + 1);
+}
+
+static void
+load_blocks(const char * path, block_list& blocks)
+{
+    std::ifstream           input(path);
+    std::string             line;
+    spdy::key_value_block   kvblock;
+
+    if (!input) {
+        fprintf(stderr, "zreplay: unable to open %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    while (std::getline(input, line)) {
+        line = trim(line);
+
+        if (line.empty()) {
+            if (kvblock.size() != 0) {
+                blocks.push_back(kvblock);
+                kvblock = spdy::key_value_block();
+            }
+            continue;
+        }
+
+        if (line[0] == '#') {
+            continue;
+        }
+
+        // Map the status line the same way http_send_response() does.
+        if (kvblock.size() == 0 && line.compare(0, 5, "HTTP/") == 0) {
+            size_t sp = std::min(line.find(' '), line.size());
+            kvblock["version"].assign(line.data(), sp);
+            if (sp < line.size()) {
+                kvblock["status"].assign(line.data() + sp + 1,
+                        line.size() - sp - 1);
+            } else {
+                kvblock["status"].clear();
+            }
+            continue;
+        }
+
+        size_t colon = line.find(':');
+        if (colon == std::string::npos || colon == 0) {
+            fprintf(stderr, "zreplay: %s: ignoring '%s'\n", path, line.c_str());
+            continue;
+        }
+
+        kvblock.insert(trim(line.substr(0, colon)), trim(line.substr(colon + 1)));
+    }
+
+    if (kvblock.size() != 0) {
+        blocks.push_back(kvblock);
+    }
+}
+
+struct replay_result
+{
+    size_t  inbytes;    // uncompressed header block bytes
+    size_t  outbytes;   // compressed header block bytes
+    size_t  zbytes;     // peak compressor state
+    double  ns;         // mean encode time per block
+};
+
+// Encode all the blocks with a single compressor, the way a SPDY session
+// does, and repeat for the given number of passes.
+static replay_result
+replay(const block_list& blocks, const spdy::compress::options& opts,
+        unsigned passes)
+{
+    replay_result           result = { 0, 0, 0, 0.0 };
+    spdy::byte_buffer       scratch;
+    std::vector<uint8_t>    hdrs;
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (unsigned pass = 0; pass < passes; ++pass) {
+        counting_allocator              alloc;
+        spdy::zstream<spdy::compress>   compressor(&alloc, opts);
+        size_t                          outbytes = 0;
+        size_t                          inbytes = 0;
+
+        for (auto kv(blocks.begin()); kv != blocks.end(); ++kv) {
+            hdrs.resize(kv->marshall_bound(spdy::PROTOCOL_VERSION_2, compressor));
+            outbytes += spdy::key_value_block::marshall(
+                    spdy::PROTOCOL_VERSION_2, compressor, *kv, scratch,
+                    &hdrs[0], hdrs.size());
+            inbytes += scratch.size();
+        }
+
+        result.inbytes = inbytes;
+        result.outbytes = outbytes;
+        result.zbytes = alloc.peak;
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    result.ns = std::chrono::duration<double, std::nano>(end - start).count()
+        / ((double)passes * blocks.size());
+
+    return result;
+}
+
+static void
+usage()
+{
+    fprintf(stderr,
+        "usage: zreplay.spdy [-n passes] [-l level] [-w window-bits] "
+        "[-m mem-level] FILE...\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char ** argv)
+{
+    std::vector<int>    levels = { 1, 6, 9 };
+    std::vector<int>    windows = { 9, 11, 13, 15 };
+    std::vector<int>    memlevels = { 1, 4, 8, 9 };
+    unsigned            passes = 100;
+    block_list          blocks;
+    int                 ch;
+
+    while ((ch = getopt(argc, argv, "n:l:w:m:")) != -1) {
+        switch (ch) {
+        case 'n': passes = std::max(1, atoi(optarg)); break;
+        case 'l': levels = { atoi(optarg) }; break;
+        case 'w': windows = { atoi(optarg) }; break;
+        case 'm': memlevels = { atoi(optarg) }; break;
+        default: usage();
+        }
+    }
+
+    if (optind == argc) {
+        usage();
+    }
+
+    for (int i = optind; i < argc; ++i) {
+        load_blocks(argv[i], blocks);
+    }
+
+    if (blocks.empty()) {
+        fprintf(stderr, "zreplay: no header blocks\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%u header blocks, %u passes\n\n", (unsigned)blocks.size(), passes);
+    printf("%5s %6s %9s %12s %12s %8s %12s\n",
+            "level", "window", "mem-level",
+            "state bytes", "block bytes", "ratio", "ns/block");
+
+    for (auto l(levels.begin()); l != levels.end(); ++l) {
+        for (auto w(windows.begin()); w != windows.end(); ++w) {
+            for (auto m(memlevels.begin()); m != memlevels.end(); ++m) {
+                spdy::compress::options opts;
+                replay_result result;
+
+                opts.level = *l;
+                opts.window_bits = *w;
+                opts.mem_level = *m;
+
+                result = replay(blocks, opts, passes);
+                printf("%5d %6d %9d %12zu %12.1f %7.1f%% %12.1f\n",
+                        *l, *w, *m, result.zbytes,
+                        (double)result.outbytes / blocks.size(),
+                        100.0 * result.outbytes / result.inbytes,
+                        result.ns);
+            }
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set sw=4 ts=4 tw=79 et : */
@@ -16,11 +16,25 @@
 
 #include <spdy/zstream.h>
 #include <spdy/spdy.h>
+#include <spdy/codec.h>
+#include <spdy/reader.h>
+#include <spdy/zpool.h>
+#include <spdy/normalize.h>
+#include <spdy/stream_table.h>
+#include <spdy/scheduler.h>
+#include <base/flat_map.h>
+#include <base/mpsc_queue.h>
+#include <base/logging.h>
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <vector>
+#include <map>
 #include <array>
 #include <random>
+#include <thread>
 #include <algorithm>
 
 #define CHUNKSIZE 128
@@ -94,9 +108,9 @@ void compress_kvblock()
     kvblock["key3"] = "value3";
     kvblock["key4"] = "value4";
 
-    hdrs.resize(kvblock.nbytes(spdy::PROTOCOL_VERSION_2));
+    hdrs.resize(kvblock.marshall_bound(spdy::PROTOCOL_VERSION_2, compress));
     nbytes = spdy::key_value_block::marshall(spdy::PROTOCOL_VERSION_2,
-            compress, kvblock, &hdrs[0], hdrs.capacity());
+            compress, kvblock, &hdrs[0], hdrs.size());
     hdrs.resize(nbytes);
 
     nbytes = 0;
@@ -110,6 +124,76 @@ void compress_kvblock()
     assert(ret == 0);
 }
 
+// Test that header blocks that don't compress still marshall, and that a
+// sequence of blocks on the same stream round trips.
+void marshall_incompressible()
+{
+    std::minstd_rand0               rand0;
+    spdy::byte_buffer               scratch;
+    spdy::zstream<spdy::compress>   compress;
+    spdy::zstream<spdy::decompress> expand;
+
+    for (unsigned round = 0; round < 8; ++round) {
+        spdy::key_value_block   kvblock;
+        spdy::key_value_block   check;
+        std::vector<uint8_t>    hdrs;
+        size_t                  nbytes;
+
+        for (unsigned i = 0; i < 8; ++i) {
+            std::string value(512, '\0');
+            std::for_each(value.begin(), value.end(),
+                    [&rand0](char& c) { c = rand0(); });
+            kvblock["x-random-" + std::to_string(i)].assign(value.data(), value.size());
+        }
+
+        hdrs.resize(kvblock.marshall_bound(spdy::PROTOCOL_VERSION_2, compress));
+        nbytes = spdy::key_value_block::marshall(spdy::PROTOCOL_VERSION_2,
+                compress, kvblock, scratch, &hdrs[0], hdrs.size());
+
+        check = spdy::key_value_block::parse(spdy::PROTOCOL_VERSION_2,
+                expand, &hdrs[0], nbytes);
+        assert(check.size() == kvblock.size());
+        assert(std::equal(check.begin(), check.end(), kvblock.begin()));
+    }
+}
+
+// Test that a second set of zstreams reuses the zlib blocks that the first
+// set released back to the pool.
+void zpool_reuse()
+{
+    spdy::zpool::statistics before, after;
+    char text[CHUNKSIZE];
+    char outbuf[CHUNKSIZE * 2];
+    char inbuf[CHUNKSIZE];
+
+    memset(text, 'a', sizeof(text));
+
+    for (unsigned round = 0; round < 2; ++round) {
+        before = spdy::zpool::stats();
+
+        {
+            spdy::zstream<spdy::compress> zin(spdy::zpool::allocator());
+            spdy::zstream<spdy::decompress> zout(spdy::zpool::allocator());
+            ssize_t ret;
+
+            zin.input(text, sizeof(text));
+            ret = zin.consume(outbuf, sizeof(outbuf));
+            assert(ret > 0);
+
+            zout.input(outbuf, ret);
+            ret = zout.consume(inbuf, sizeof(inbuf));
+            assert(ret == sizeof(inbuf));
+            assert(memcmp(text, inbuf, sizeof(inbuf)) == 0);
+        }
+
+        after = spdy::zpool::stats();
+    }
+
+    // The second round should have been satisfied from the pool.
+    assert(after.misses == before.misses);
+    assert(after.hits > before.hits);
+}
+
 void spdy_decompress()
 {
     const uint8_t pkt[] =
@@ -160,50 +244,50 @@ void spdy_decompress()
     assert(ret == 0);
 }
 
-void spdy_headers()
+// Compressed SPDYv2 SYN_STREAM header block captured from Chrome.
+static const uint8_t syn_stream_pkt[] =
 {
+    /* SYN_STREAM header
+    0x80, 0x02, 0x00, 0x01, 0x01, 0x00, 0x00, 0xde,
+    0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
+    0x80, 0x00,
+    */
+                0x38, 0xea, 0xdf, 0xa2, 0x51, 0xb2,
+    0x62, 0xe0, 0x60, 0xe0, 0x47, 0xcb, 0x5a, 0x0c,
+    0x82, 0x20, 0x8d, 0x3a, 0x50, 0x9d, 0x3a, 0xc5,
+    0x29, 0xc9, 0x19, 0x0c, 0x7c, 0xa8, 0xc1, 0xcf,
+    0xc0, 0x68, 0xc0, 0xc0, 0x02, 0xca, 0x5c, 0x0c,
+    0x5c, 0x25, 0x19, 0x89, 0x85, 0x45, 0x15, 0x05,
+    0x45, 0x29, 0xf9, 0x0c, 0x6c, 0xb9, 0xc0, 0x0c,
+    0x9d, 0x9f, 0xc2, 0xc0, 0xe2, 0xe1, 0xea, 0xe8,
+    0xc2, 0xc0, 0x56, 0x0c, 0x4c, 0x04, 0xb9, 0xa9,
+    0x40, 0x75, 0x25, 0x25, 0x05, 0x0c, 0xcc, 0x20,
+    0xcb, 0x18, 0xf5, 0x19, 0xb8, 0x10, 0x39, 0x84,
+    0xa1, 0xd4, 0x37, 0xbf, 0x2a, 0x33, 0x27, 0x27,
+    0x51, 0xdf, 0x54, 0xcf, 0x40, 0x41, 0xc3, 0x37,
+    0x31, 0x39, 0x33, 0xaf, 0x24, 0xbf, 0x38, 0xc3,
+    0x5a, 0xc1, 0x13, 0x68, 0x57, 0x8e, 0x02, 0x50,
+    0x40, 0xc1, 0x3f, 0x58, 0x21, 0x42, 0xc1, 0xd0,
+    0x20, 0xde, 0x3c, 0xde, 0x48, 0x53, 0xc1, 0x11,
+    0x18, 0x1c, 0xa9, 0xe1, 0xa9, 0x49, 0xde, 0x99,
+    0x25, 0xfa, 0xa6, 0xc6, 0xa6, 0x7a, 0x46, 0x0a,
+    0x00, 0x69, 0x78, 0x7b, 0x84, 0xf8, 0xfa, 0xe8,
+    0x28, 0xe4, 0x64, 0x66, 0xa7, 0x2a, 0xb8, 0xa7,
+    0x26, 0x67, 0xe7, 0x6b, 0x2a, 0x38, 0x67, 0x00,
+    0x33, 0x7e, 0xaa, 0xbe, 0x21, 0xd0, 0x50, 0x3d,
+    0x0b, 0x73, 0x13, 0x3d, 0x43, 0x03, 0x33, 0x85,
+    0xe0, 0xc4, 0xb4, 0xc4, 0xa2, 0x4c, 0x88, 0x26,
+    0x06, 0x76, 0xa8, 0xf7, 0x19, 0x38, 0x60, 0xa1,
+    0x02, 0x00, 0x00, 0x00, 0xff, 0xff
+};
 
-    const uint8_t pkt[] =
-    {
-        /* SYN_STREAM header
-        0x80, 0x02, 0x00, 0x01, 0x01, 0x00, 0x00, 0xde,
-        0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
-        0x80, 0x00,
-        */
-                    0x38, 0xea, 0xdf, 0xa2, 0x51, 0xb2,
-        0x62, 0xe0, 0x60, 0xe0, 0x47, 0xcb, 0x5a, 0x0c,
-        0x82, 0x20, 0x8d, 0x3a, 0x50, 0x9d, 0x3a, 0xc5,
-        0x29, 0xc9, 0x19, 0x0c, 0x7c, 0xa8, 0xc1, 0xcf,
-        0xc0, 0x68, 0xc0, 0xc0, 0x02, 0xca, 0x5c, 0x0c,
-        0x5c, 0x25, 0x19, 0x89, 0x85, 0x45, 0x15, 0x05,
-        0x45, 0x29, 0xf9, 0x0c, 0x6c, 0xb9, 0xc0, 0x0c,
-        0x9d, 0x9f, 0xc2, 0xc0, 0xe2, 0xe1, 0xea, 0xe8,
-        0xc2, 0xc0, 0x56, 0x0c, 0x4c, 0x04, 0xb9, 0xa9,
-        0x40, 0x75, 0x25, 0x25, 0x05, 0x0c, 0xcc, 0x20,
-        0xcb, 0x18, 0xf5, 0x19, 0xb8, 0x10, 0x39, 0x84,
-        0xa1, 0xd4, 0x37, 0xbf, 0x2a, 0x33, 0x27, 0x27,
-        0x51, 0xdf, 0x54, 0xcf, 0x40, 0x41, 0xc3, 0x37,
-        0x31, 0x39, 0x33, 0xaf, 0x24, 0xbf, 0x38, 0xc3,
-        0x5a, 0xc1, 0x13, 0x68, 0x57, 0x8e, 0x02, 0x50,
-        0x40, 0xc1, 0x3f, 0x58, 0x21, 0x42, 0xc1, 0xd0,
-        0x20, 0xde, 0x3c, 0xde, 0x48, 0x53, 0xc1, 0x11,
-        0x18, 0x1c, 0xa9, 0xe1, 0xa9, 0x49, 0xde, 0x99,
-        0x25, 0xfa, 0xa6, 0xc6, 0xa6, 0x7a, 0x46, 0x0a,
-        0x00, 0x69, 0x78, 0x7b, 0x84, 0xf8, 0xfa, 0xe8,
-        0x28, 0xe4, 0x64, 0x66, 0xa7, 0x2a, 0xb8, 0xa7,
-        0x26, 0x67, 0xe7, 0x6b, 0x2a, 0x38, 0x67, 0x00,
-        0x33, 0x7e, 0xaa, 0xbe, 0x21, 0xd0, 0x50, 0x3d,
-        0x0b, 0x73, 0x13, 0x3d, 0x43, 0x03, 0x33, 0x85,
-        0xe0, 0xc4, 0xb4, 0xc4, 0xa2, 0x4c, 0x88, 0x26,
-        0x06, 0x76, 0xa8, 0xf7, 0x19, 0x38, 0x60, 0xa1,
-        0x02, 0x00, 0x00, 0x00, 0xff, 0xff
-    };
-
+void spdy_headers()
+{
     char outbuf[16384];
     ssize_t ret;
     spdy::zstream<spdy::decompress> zout;
 
-    zout.input(pkt, sizeof(pkt));
+    zout.input(syn_stream_pkt, sizeof(syn_stream_pkt));
     do {
         ret = zout.consume(outbuf, sizeof(outbuf));
     } while (ret > 0);
@@ -211,14 +295,1018 @@ void spdy_headers()
     assert(ret == 0);
 }
 
+// Test that the header block visitor sees the same headers that we decode
+// into a key_value_block.
+void visit_headers()
+{
+    spdy::zstream<spdy::decompress> zvisit;
+    spdy::zstream<spdy::decompress> zblock;
+    spdy::key_value_block           kvblock;
+    spdy::url_components            url;
+    unsigned                        nheaders = 0;
+
+    kvblock = spdy::key_value_block::parse(spdy::PROTOCOL_VERSION_2, zblock,
+            syn_stream_pkt, sizeof(syn_stream_pkt));
+
+    spdy::key_value_block::parse(spdy::PROTOCOL_VERSION_2, zvisit,
+        syn_stream_pkt, sizeof(syn_stream_pkt),
+        [&](const spdy::string_ref& key, const spdy::string_ref& val) {
+            if (!url.assign(spdy::PROTOCOL_VERSION_2, key, val)) {
+                assert(kvblock.exists(key.str()));
+                assert(kvblock[key.str()] == val.str());
+                ++nheaders;
+            }
+        }
+    );
+
+    assert(nheaders == kvblock.size());
+    assert(url.hostport == kvblock.url().hostport);
+    assert(url.path == kvblock.url().path);
+    assert(url.method == kvblock.url().method);
+    assert(url.is_complete());
+}
+
+// Test that the frame reader reassembles frames no matter how the bytes are
+// chunked, and decompresses the header block to the same result as the
+// one-shot parser.
+void read_frames()
+{
+    const uint8_t syn_stream_hdr[] =
+    {
+        0x80, 0x02, 0x00, 0x01, 0x01, 0x00, 0x00, 0xde,
+        0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
+        0x80, 0x00
+    };
+
+    const uint8_t ping[] =
+    {
+        0x80, 0x02, 0x00, 0x06, 0x00, 0x00, 0x00, 0x04,
+        0x00, 0x00, 0x00, 0x02
+    };
+
+    std::vector<uint8_t> wire;
+    wire.insert(wire.end(), syn_stream_hdr, syn_stream_hdr + sizeof(syn_stream_hdr));
+    wire.insert(wire.end(), syn_stream_pkt, syn_stream_pkt + sizeof(syn_stream_pkt));
+    wire.insert(wire.end(), ping, ping + sizeof(ping));
+
+    spdy::zstream<spdy::decompress> zblock;
+    spdy::key_value_block expected(
+        spdy::key_value_block::parse(spdy::PROTOCOL_VERSION_2, zblock,
+            syn_stream_pkt, sizeof(syn_stream_pkt)));
+
+    assert(sizeof(syn_stream_pkt) + 10 == 0xde);
+
+    for (size_t chunk = 1; chunk <= wire.size(); ++chunk) {
+        spdy::zstream<spdy::decompress> zout;
+        spdy::frame_reader reader(zout);
+        std::vector<spdy::control_frame_type> frames;
+
+        for (size_t offset = 0; offset < wire.size(); offset += chunk) {
+            const uint8_t * ptr = &wire[offset];
+            size_t nbytes = std::min(chunk, wire.size() - offset);
+
+            while (nbytes) {
+                size_t count = reader.consume(ptr, nbytes);
+                ptr += count;
+                nbytes -= count;
+
+                if (!reader.complete()) {
+                    continue;
+                }
+
+                frames.push_back(reader.header().control.type);
+                if (reader.header().control.type == spdy::CONTROL_SYN_STREAM) {
+                    spdy::key_value_block kvblock;
+                    spdy::syn_stream_message syn(
+                        spdy::syn_stream_message::parse(
+                            reader.payload(), reader.payload_size()));
+
+                    assert(syn.stream_id == 1);
+                    assert(reader.payload_size() == spdy::syn_stream_message::size);
+
+                    spdy::key_value_block::parse(spdy::PROTOCOL_VERSION_2,
+                        reader.header_block(), reader.header_block_size(),
+                        [&kvblock](const spdy::string_ref& key,
+                            const spdy::string_ref& val) {
+                            if (!kvblock.url().assign(spdy::PROTOCOL_VERSION_2,
+                                        key, val)) {
+                                kvblock[key].assign(val.ptr, val.len);
+                            }
+                        });
+
+                    assert(kvblock.size() == expected.size());
+                    assert(kvblock.url().path == expected.url().path);
+                } else {
+                    spdy::ping_message msg(
+                        spdy::ping_message::parse(
+                            reader.payload(), reader.payload_size()));
+                    assert(msg.ping_id == 2);
+                }
+            }
+        }
+
+        assert(frames.size() == 2);
+        assert(frames[0] == spdy::CONTROL_SYN_STREAM);
+        assert(frames[1] == spdy::CONTROL_PING);
+    }
+}
+
+// Test that malformed frames are reported through the parse status rather
+// than by throwing.
+void parse_malformed()
+{
+    const uint8_t bytes[] =
+    {
+        0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x07,
+        0x00, 0x00, 0x00, 0x00
+    };
+
+    spdy::ping_message ping;
+    spdy::goaway_message goaway;
+    spdy::syn_stream_message syn;
+    spdy::rst_stream_message rst;
+    spdy::message_header header;
+
+    assert(spdy::message_header::try_parse(bytes, 7, header) == spdy::PARSE_SHORT_FRAME);
+    assert(spdy::syn_stream_message::try_parse(bytes, 9, syn) == spdy::PARSE_SHORT_FRAME);
+    assert(spdy::rst_stream_message::try_parse(bytes, 7, rst) == spdy::PARSE_SHORT_FRAME);
+    assert(spdy::ping_message::try_parse(bytes, 3, ping) == spdy::PARSE_SHORT_FRAME);
+    assert(spdy::goaway_message::try_parse(bytes, 3, goaway) == spdy::PARSE_SHORT_FRAME);
+
+    // A SPDY/2 GOAWAY has no status code.
+    assert(spdy::goaway_message::try_parse(bytes, 4, goaway) == spdy::PARSE_OK);
+    assert(goaway.last_stream_id == 1 && goaway.status_code == 0);
+    assert(spdy::goaway_message::try_parse(bytes, 8, goaway) == spdy::PARSE_OK);
+    assert(goaway.status_code == 7);
+
+    // Round trip a RST_STREAM.
+    uint8_t tmp[spdy::rst_stream_message::size];
+    rst.stream_id = 5;
+    rst.status_code = spdy::PROTOCOL_ERROR;
+    spdy::rst_stream_message::marshall(rst, tmp, sizeof(tmp));
+    rst = spdy::rst_stream_message();
+    assert(spdy::rst_stream_message::try_parse(tmp, sizeof(tmp), rst) == spdy::PARSE_OK);
+    assert(rst.stream_id == 5 && rst.status_code == spdy::PROTOCOL_ERROR);
+
+    // Header blocks that claim more pairs or bytes than they have.
+    auto visit = [](const spdy::string_ref&, const spdy::string_ref&) {
+        assert(0 && "visited a truncated header block");
+    };
+
+    const uint8_t npairs[] = { 0xff, 0xff, 0x00, 0x01, 'a', 0x00, 0x00 };
+    const uint8_t nbytes[] = { 0x00, 0x01, 0x00, 0x01, 'a', 0x00, 0x02, 'b' };
+
+    assert(spdy::key_value_block::try_parse(spdy::PROTOCOL_VERSION_2,
+                npairs, 1, visit) == spdy::PARSE_SHORT_HEADER_BLOCK);
+    assert(spdy::key_value_block::try_parse(spdy::PROTOCOL_VERSION_2,
+                npairs, sizeof(npairs), visit) == spdy::PARSE_SHORT_HEADER_BLOCK);
+    assert(spdy::key_value_block::try_parse(spdy::PROTOCOL_VERSION_2,
+                nbytes, sizeof(nbytes), visit) == spdy::PARSE_SHORT_HEADER_BLOCK);
+    assert(spdy::key_value_block::try_parse((spdy::protocol_version)4,
+                nbytes, sizeof(nbytes), visit) == spdy::PARSE_UNSUPPORTED_VERSION);
+
+    // A SYN_STREAM whose header block is garbage leaves the frame reader
+    // stuck in an error state.
+    std::vector<uint8_t> wire =
+    {
+        0x80, 0x02, 0x00, 0x01, 0x01, 0x00, 0x00, 0x1a,
+        0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
+        0x80, 0x00
+    };
+
+    wire.resize(wire.size() + 16, 0xa5);
+
+    spdy::zstream<spdy::decompress> zin;
+    spdy::frame_reader reader(zin);
+    size_t count = reader.consume(&wire[0], wire.size());
+
+    assert(count < wire.size());
+    assert(reader.failed() && !reader.complete());
+    assert(reader.status() == spdy::PARSE_CORRUPT_HEADER_BLOCK);
+    assert(reader.consume(&wire[count], wire.size() - count) == 0);
+}
+
+// Test that both codec versions round trip a header block, and that the
+// decompressor picks the right dictionary for each.
+void codec_versions()
+{
+    const spdy::protocol_version versions[] =
+    {
+        spdy::PROTOCOL_VERSION_2, spdy::PROTOCOL_VERSION_3
+    };
+
+    spdy::key_value_block kvblock;
+    kvblock["content-type"] = "text/html";
+    kvblock["server"] = "ATS";
+    kvblock["status"] = "200 OK";
+
+    assert(spdy::header_codec::get(1) == nullptr);
+    assert(kvblock.nbytes(spdy::PROTOCOL_VERSION_3) ==
+            kvblock.nbytes(spdy::PROTOCOL_VERSION_2) + 2 * (1 + 2 * kvblock.size()));
+
+    for (unsigned i = 0; i < countof(versions); ++i) {
+        const spdy::header_codec * codec = spdy::header_codec::get(versions[i]);
+        spdy::compress::options opts;
+        spdy::byte_buffer scratch;
+        spdy::byte_buffer bytes;
+        std::vector<uint8_t> hdrs;
+        unsigned count = 0;
+
+        assert(codec && codec->version == versions[i]);
+
+        opts.dictionary = &codec->dictionary;
+        spdy::zstream<spdy::compress> compress(nullptr, opts);
+        spdy::zstream<spdy::decompress> expand;
+
+        hdrs.resize(compress.bound(codec->nbytes(kvblock)));
+        hdrs.resize(codec->marshall(compress, kvblock, scratch,
+                    &hdrs[0], hdrs.size()));
+
+        expand.input(&hdrs[0], hdrs.size());
+        assert(spdy::decompress_headers(expand, bytes) == spdy::z_ok);
+        assert(bytes.size() == codec->nbytes(kvblock));
+
+        auto visit = [&](const spdy::string_ref& key, const spdy::string_ref& val) {
+            assert(kvblock.exists(key.str()));
+            assert(kvblock[key.str()] == val.str());
+            ++count;
+        };
+
+        assert(spdy::key_value_block::try_parse(versions[i],
+                    bytes.data(), bytes.size(), visit) == spdy::PARSE_OK);
+        assert(count == kvblock.size());
+
+        // Serializing and compressing separately is the same as
+        // marshalling, given the same compressor state.
+        std::vector<uint8_t> block(codec->nbytes(kvblock));
+        std::vector<uint8_t> split(hdrs.size() + 64);
+        spdy::zstream<spdy::compress> compress2(nullptr, opts);
+
+        assert(codec->serialize(kvblock, &block[0], block.size()) == block.size());
+        assert(memcmp(&block[0], bytes.data(), block.size()) == 0);
+        split.resize(spdy::header_codec::deflate(compress2, &block[0],
+                    block.size(), &split[0], split.size()));
+        assert(split == hdrs);
+    }
+
+    assert(strcmp(spdy::header_codec::get(2)->status_header, "status") == 0);
+    assert(strcmp(spdy::header_codec::get(3)->version_header, ":version") == 0);
+}
+
+// Build a SPDY/2 SYN_STREAM frame for the given header block.
+static std::vector<uint8_t>
+make_syn_stream(const spdy::key_value_block& kvblock)
+{
+    spdy::zstream<spdy::compress> compress;
+    std::vector<uint8_t> hdrs;
+    std::vector<uint8_t> frame(spdy::message_header::size +
+            spdy::syn_stream_message::size);
+    spdy::message_header header;
+
+    hdrs.resize(kvblock.marshall_bound(spdy::PROTOCOL_VERSION_2, compress));
+    hdrs.resize(spdy::key_value_block::marshall(spdy::PROTOCOL_VERSION_2,
+                compress, kvblock, &hdrs[0], hdrs.size()));
+
+    header.is_control = true;
+    header.control.version = spdy::PROTOCOL_VERSION_2;
+    header.control.type = spdy::CONTROL_SYN_STREAM;
+    header.flags = 0;
+    header.datalen = spdy::syn_stream_message::size + hdrs.size();
+    spdy::message_header::marshall(header, &frame[0], frame.size());
+    frame[spdy::message_header::size + 3] = 1; // stream ID
+
+    frame.insert(frame.end(), hdrs.begin(), hdrs.end());
+    return frame;
+}
+
+// Test that the frame reader enforces the frame limits, and stops
+// inflating a header block as soon as it is too large.
+void enforce_frame_limits()
+{
+    spdy::key_value_block kvblock;
+    std::vector<uint8_t> frame;
+
+    kvblock["big"].assign(1024 * 1024, 'a');
+    frame = make_syn_stream(kvblock);
+    assert(frame.size() < 4096);
+
+    spdy::frame_limits limits;
+    limits.max_header_bytes = 8192;
+
+    {
+        spdy::zstream<spdy::decompress> zin;
+        spdy::frame_reader reader(zin, limits);
+
+        reader.consume(&frame[0], frame.size());
+        assert(reader.failed());
+        assert(reader.status() == spdy::PARSE_HEADER_BLOCK_TOO_LARGE);
+        assert(reader.header_block_size() <= limits.max_header_bytes + 1);
+    }
+
+    limits = spdy::frame_limits();
+    limits.max_frame_size = frame.size() - spdy::message_header::size - 1;
+
+    {
+        spdy::zstream<spdy::decompress> zin;
+        spdy::frame_reader reader(zin, limits);
+
+        assert(reader.consume(&frame[0], frame.size()) == spdy::message_header::size);
+        assert(reader.status() == spdy::PARSE_FRAME_TOO_LARGE);
+    }
+
+    // Without limits, the block is there in full.
+    {
+        spdy::zstream<spdy::decompress> zin;
+        spdy::frame_reader reader(zin);
+
+        assert(reader.consume(&frame[0], frame.size()) == frame.size());
+        assert(reader.complete());
+        assert(reader.header_block_size() == kvblock.nbytes(spdy::PROTOCOL_VERSION_2));
+    }
+
+    kvblock = spdy::key_value_block();
+    for (unsigned i = 0; i < 8; ++i) {
+        kvblock[std::string(1, 'a' + i)] = "value";
+    }
+
+    frame = make_syn_stream(kvblock);
+
+    spdy::zstream<spdy::decompress> zin;
+    spdy::frame_reader reader(zin);
+    unsigned count = 0;
+    auto visit = [&count](const spdy::string_ref&, const spdy::string_ref&) {
+        ++count;
+    };
+
+    assert(reader.consume(&frame[0], frame.size()) == frame.size());
+    assert(spdy::codec<spdy::PROTOCOL_VERSION_2>::parse(reader.header_block(),
+                reader.header_block_size(), visit, 7) == spdy::PARSE_TOO_MANY_HEADERS);
+    assert(count == 0);
+    assert(spdy::codec<spdy::PROTOCOL_VERSION_2>::parse(reader.header_block(),
+                reader.header_block_size(), visit, 8) == spdy::PARSE_OK);
+    assert(count == 8);
+}
+
+// Test that the flat map keeps its keys sorted and unique as it grows past
+// the inline storage.
+void flat_map_order()
+{
+    flat_map<std::string, std::string, 4> map;
+    const char * keys[] = { "m", "c", "x", "a", "q", "c", "z", "b", "m" };
+
+    for (unsigned i = 0; i < countof(keys); ++i) {
+        map[keys[i]] = keys[i];
+    }
+
+    assert(map.size() == 7);
+    assert(std::is_sorted(map.begin(), map.end()));
+    assert(map.find("q")->second == "q");
+    assert(map.find("n") == map.end());
+
+    flat_map<std::string, std::string, 4> copy(map);
+    assert(map.erase("q") == 1);
+    assert(map.size() == 6 && copy.size() == 7);
+    assert(map.find("q") == map.end());
+    assert(copy.find("q") != copy.end());
+    assert(std::is_sorted(map.begin(), map.end()));
+
+    // Erasing moves the last element into the hole, which must not upset
+    // the order or the values.
+    assert(map.erase("a") == 1);
+    assert(std::is_sorted(map.begin(), map.end()));
+    for (auto pos(map.begin()); pos != map.end(); ++pos) {
+        assert(pos->first == pos->second);
+        assert(map.find(pos->first) == pos);
+    }
+
+    flat_map<std::string, std::string, 4> moved(std::move(copy));
+    assert(moved.size() == 7 && copy.empty());
+    assert(moved.lower_bound("d")->first == "m");
+}
+
+// Test that a byte_buffer keeps its contents when it spills out of its
+// inline storage, and keeps its capacity when it is cleared.
+void byte_buffer_growth()
+{
+    spdy::inline_byte_buffer<16> buf;
+    const uint8_t * storage = buf.data();
+    uint8_t bytes[64];
+
+    for (unsigned i = 0; i < sizeof(bytes); ++i) {
+        bytes[i] = i;
+    }
+
+    buf.append(bytes, 10);
+    assert(buf.data() == storage && buf.size() == 10);
+
+    buf.append(bytes + 10, sizeof(bytes) - 10);
+    assert(buf.data() != storage);
+    assert(buf.size() == sizeof(bytes));
+    assert(memcmp(buf.data(), bytes, sizeof(bytes)) == 0);
+
+    size_t capacity = buf.capacity();
+    buf.clear();
+    assert(buf.empty() && buf.capacity() == capacity);
+
+    memcpy(buf.prepare(4), bytes, 4);
+    assert(buf.available() >= 4);
+    buf.commit(4);
+    assert(buf.size() == 4 && memcmp(buf.data(), bytes, 4) == 0);
+}
+
+void known_header_lookup()
+{
+    auto lookup = [](const char * name) {
+        return spdy::lookup_header(name, strlen(name));
+    };
+
+    for (unsigned i = 0; i < countof(spdy::known_headers); ++i) {
+        const spdy::known_header& known = spdy::known_headers[i];
+        assert(spdy::lookup_header(known.name, known.len) == known.id);
+    }
+
+    assert(lookup("url") == spdy::HEADER_PATH);
+    assert(lookup(":path") == spdy::HEADER_PATH);
+    assert(lookup("Transfer-Encoding") == spdy::HEADER_TRANSFER_ENCODING);
+    assert(spdy::is_hop_by_hop_header(lookup("Keep-Alive")));
+    assert(!spdy::is_hop_by_hop_header(lookup("content-length")));
+
+    assert(lookup("") == spdy::HEADER_UNKNOWN);
+    assert(lookup("hosts") == spdy::HEADER_UNKNOWN);
+    assert(lookup(":url") == spdy::HEADER_UNKNOWN);
+    assert(lookup("x-forwarded-for") == spdy::HEADER_UNKNOWN);
+}
+
+// Test that only the request line headers of the session's protocol version
+// are routed into the URL.
+void versioned_header_lookup()
+{
+    const char * names[] = { "host", "method", "url", "scheme", "version" };
+    const char * v3names[] = { ":host", ":method", ":path", ":scheme", ":version" };
+
+    for (unsigned i = 0; i < countof(names); ++i) {
+        spdy::url_components v2url;
+        spdy::url_components v3url;
+        spdy::string_ref v2name(names[i]);
+        spdy::string_ref v3name(v3names[i]);
+        spdy::string_ref value("x");
+
+        assert(spdy::lookup_header(spdy::PROTOCOL_VERSION_2,
+                    v2name.ptr, v2name.len) == spdy::lookup_header(
+                    spdy::PROTOCOL_VERSION_3, v3name.ptr, v3name.len));
+        assert(spdy::lookup_header(spdy::PROTOCOL_VERSION_2,
+                    v3name.ptr, v3name.len) == spdy::HEADER_UNKNOWN);
+        assert(spdy::lookup_header(spdy::PROTOCOL_VERSION_3,
+                    v2name.ptr, v2name.len) == spdy::HEADER_UNKNOWN);
+
+        assert(v2url.assign(spdy::PROTOCOL_VERSION_2, v2name, value));
+        assert(!v2url.assign(spdy::PROTOCOL_VERSION_2, v3name, value));
+        assert(v3url.assign(spdy::PROTOCOL_VERSION_3, v3name, value));
+        assert(!v3url.assign(spdy::PROTOCOL_VERSION_3, v2name, value));
+    }
+
+    // Other known headers don't depend on the version.
+    assert(spdy::lookup_header(spdy::PROTOCOL_VERSION_3, "Keep-Alive", 10) ==
+            spdy::HEADER_KEEP_ALIVE);
+    assert(spdy::lookup_header(spdy::PROTOCOL_VERSION_2, "Keep-Alive", 10) ==
+            spdy::HEADER_KEEP_ALIVE);
+}
+
+// Test header normalization at every offset of a name that is long enough
+// to take the vector path.
+void normalize_headers()
+{
+    const std::string name("X-Forwarded-For-Some-Long-Header-Name-For-Vectors");
+    const std::string lower("x-forwarded-for-some-long-header-name-for-vectors");
+    const std::string value(80, 'v');
+
+    std::string tmp(name);
+    assert(spdy::normalize_header(&tmp[0], tmp.size(), value.data(), value.size())
+            == spdy::HEADER_NAME_UPPERCASE);
+    assert(tmp == lower);
+
+    assert(spdy::check_header(lower.data(), lower.size(),
+                value.data(), value.size()) == 0);
+    assert(spdy::check_header(":host", 5, "", 0) == 0);
+    assert(spdy::check_header(":", 1, "", 0) == spdy::HEADER_NAME_INVALID);
+    assert(spdy::check_header("", 0, "", 0) == spdy::HEADER_NAME_INVALID);
+
+    // Headers that end right before an inaccessible page must not be read
+    // past their end, whatever the length of the tail.
+    long pagesize = sysconf(_SC_PAGESIZE);
+    char * page = (char *)mmap(nullptr, pagesize * 2, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(page != MAP_FAILED);
+    assert(mprotect(page + pagesize, pagesize, PROT_NONE) == 0);
+    for (size_t len = 1; len <= name.size(); ++len) {
+        char * hdr = page + pagesize - len;
+        bool upper = name.compare(name.size() - len, len,
+                lower, lower.size() - len, len) != 0;
+
+        memcpy(hdr, name.data() + name.size() - len, len);
+        assert(spdy::normalize_header_name(hdr, hdr, len) ==
+                (upper ? spdy::HEADER_NAME_UPPERCASE : 0u));
+        assert(memcmp(hdr, lower.data() + lower.size() - len, len) == 0);
+        assert(spdy::check_header_value(hdr, len) == 0);
+    }
+    munmap(page, pagesize * 2);
+
+    for (size_t i = 0; i < lower.size(); ++i) {
+        const char bad[] = { ' ', ':', '\x7f', '\x80', '\0', '{' };
+
+        for (unsigned j = 0; j < countof(bad); ++j) {
+            if (i == 0 && bad[j] == ':') {
+                continue; // SPDY/3 name
+            }
+
+            tmp = lower;
+            tmp[i] = bad[j];
+            assert(spdy::check_header(tmp.data(), tmp.size(), "", 0) ==
+                    spdy::HEADER_NAME_INVALID);
+        }
+
+        tmp = value;
+        tmp[i] = '\n';
+        assert(spdy::check_header_value(tmp.data(), tmp.size()) ==
+                spdy::HEADER_VALUE_CRLF);
+        tmp[i] = '\0';
+        assert(spdy::check_header_value(tmp.data(), tmp.size()) ==
+                spdy::HEADER_VALUE_NUL);
+    }
+}
+
+// Test that the arena grows past its chunk size, that a scope gives back
+// what was allocated inside it, and that a header block can live in it.
+void arena_allocation()
+{
+    spdy::arena arena(256);
+    size_t      mark;
+
+    uint8_t * small = (uint8_t *)arena.allocate(16);
+    memset(small, 'x', 16);
+    assert(arena.used() >= 16);
+
+    // Bigger than a chunk, so it gets a chunk of its own.
+    uint8_t * big = (uint8_t *)arena.allocate(1000);
+    memset(big, 'y', 1000);
+    assert(arena.used() >= 1016);
+    assert(small[15] == 'x');
+
+    mark = arena.used();
+    {
+        spdy::arena::scope scope(arena);
+        for (unsigned i = 0; i < 10; ++i) {
+            arena.allocate(200);
+        }
+        assert(arena.used() >= mark + 2000);
+    }
+
+    assert(arena.used() == mark);
+    assert(arena.high_water() >= mark + 2000);
+    assert((uintptr_t)arena.allocate(8, 64) % 64 == 0);
+
+    {
+        spdy::zstream<spdy::compress>   compress;
+        spdy::zstream<spdy::decompress> expand;
+        spdy::key_value_block           kvblock(&arena);
+        spdy::key_value_block           check;
+        std::vector<uint8_t>            hdrs;
+        size_t                          nbytes;
+
+        kvblock.insert("Content-Type", "text/html");
+        kvblock["server"] = "ATS";
+        kvblock[spdy::string_ref("status", 6)].assign("200 OK");
+        kvblock["x-long"].assign(4096, 'z');
+        assert(kvblock.exists("content-type"));
+        assert(kvblock["x-long"].get_allocator() ==
+                spdy::arena_allocator<char>(&arena));
+
+        hdrs.resize(kvblock.marshall_bound(spdy::PROTOCOL_VERSION_3, compress));
+        nbytes = spdy::key_value_block::marshall(spdy::PROTOCOL_VERSION_3,
+                compress, kvblock, &hdrs[0], hdrs.size());
+        check = spdy::key_value_block::parse(spdy::PROTOCOL_VERSION_3,
+                expand, &hdrs[0], nbytes);
+
+        assert(check.size() == kvblock.size());
+        assert(std::equal(check.begin(), check.end(), kvblock.begin()));
+    }
+
+    assert(arena.high_water() >= 4096);
+    arena.reset();
+    assert(arena.used() == 0);
+}
+
+// Test that the stream table agrees with std::map as streams open and
+// close out of order, including IDs that collide in the table.
+void stream_table_ops()
+{
+    spdy::stream_table<unsigned> table(4);
+    std::map<unsigned, unsigned *> model;
+    std::vector<unsigned> values(4096);
+    std::mt19937 rand0(7);
+    unsigned next = 1;
+
+    assert(table.find(0) == nullptr);
+    assert(!table.insert(0, &values[0]));
+
+    for (unsigned round = 0; round < 20000; ++round) {
+        if (model.empty() || rand0() % 3 != 0) {
+            // Open a stream, sometimes skipping far enough ahead to wrap
+            // around the table.
+            next += 2 * (rand0() % 4 == 0 ? table.capacity() : 1);
+            unsigned * value = &values[next % values.size()];
+            assert(table.insert(next, value));
+            assert(!table.insert(next, value));
+            model[next] = value;
+        } else {
+            auto victim(model.begin());
+            std::advance(victim, rand0() % model.size());
+            assert(table.erase(victim->first) == victim->second);
+            assert(table.erase(victim->first) == nullptr);
+            model.erase(victim);
+        }
+
+        assert(table.size() == model.size());
+    }
+
+    for (auto ptr(model.begin()); ptr != model.end(); ++ptr) {
+        assert(table.find(ptr->first) == ptr->second);
+        assert(table.find(ptr->first + 2) == nullptr || model.count(ptr->first + 2));
+    }
+
+    size_t count = 0;
+    for (auto ptr(table.begin()); ptr != table.end(); ++ptr) {
+        assert(model[ptr->first] == ptr->second);
+        ++count;
+    }
+
+    assert(count == model.size());
+}
+
+struct queued_item
+{
+    queued_item *   next;
+    unsigned        producer;
+    unsigned        seqno;
+};
+
+// Test that the MPSC queue hands every element to the consumer exactly once
+// and keeps each producer's elements in order.
+void mpsc_queue_order()
+{
+    const unsigned nproducers = 4;
+    const unsigned nitems = 20000;
+
+    mpsc_queue<queued_item> queue;
+    std::vector<queued_item> items(nproducers * nitems);
+    std::vector<std::thread> producers;
+    std::vector<unsigned> next(nproducers, 0);
+    unsigned received = 0;
+
+    assert(queue.empty());
+    assert(queue.pop_all() == nullptr);
+
+    // Single threaded, the first push reports the empty queue and the
+    // elements come out in push order.
+    assert(queue.push(&items[0]));
+    assert(!queue.push(&items[1]));
+    assert(!queue.empty());
+    assert(queue.pop_all() == &items[0]);
+    assert(items[0].next == &items[1] && items[1].next == nullptr);
+    assert(queue.empty());
+
+    for (unsigned p = 0; p < nproducers; ++p) {
+        producers.push_back(std::thread([&queue, &items, p, nitems]() {
+            for (unsigned i = 0; i < nitems; ++i) {
+                queued_item * item = &items[p * nitems + i];
+                item->producer = p;
+                item->seqno = i;
+                queue.push(item);
+            }
+        }));
+    }
+
+    while (received < nproducers * nitems) {
+        for (queued_item * item = queue.pop_all(); item; item = item->next) {
+            assert(item->seqno == next[item->producer]);
+            ++next[item->producer];
+            ++received;
+        }
+    }
+
+    for (auto t(producers.begin()); t != producers.end(); ++t) {
+        t->join();
+    }
+
+    assert(queue.empty());
+}
+
+struct scheduled_frame
+{
+    scheduled_frame *   next;
+    unsigned            stream_id;
+    size_t              size;
+};
+
+// Test that the output scheduler serves priorities strictly, takes turns
+// between streams at the same priority and keeps each stream in order.
+void scheduler_order()
+{
+    spdy::output_scheduler<scheduled_frame> sched;
+    std::vector<scheduled_frame> frames(9);
+    std::vector<unsigned> order;
+
+    assert(sched.empty() && sched.pop() == nullptr);
+
+    // Streams 1 and 3 at priority 3, stream 5 at priority 0 and stream 7
+    // at an out of range priority, which is clamped to the lowest.
+    const unsigned ids[] = { 1, 1, 1, 3, 3, 7, 5, 5, 1 };
+    const unsigned prio[] = { 3, 3, 3, 3, 3, 99, 0, 0, 3 };
+    for (unsigned i = 0; i < frames.size(); ++i) {
+        frames[i].stream_id = ids[i];
+        frames[i].size = i;
+        sched.push(ids[i], prio[i], &frames[i]);
+    }
+
+    assert(sched.size() == frames.size());
+
+    while (scheduled_frame * frame = sched.pop()) {
+        order.push_back(frame->size);
+    }
+
+    const unsigned expected[] = { 6, 7, 0, 3, 1, 4, 2, 8, 5 };
+    assert(order.size() == countof(expected));
+    assert(std::equal(order.begin(), order.end(), expected));
+    assert(sched.empty());
+
+    // A stream that drained gets a new queue, with its new priority.
+    sched.push(1, 7, &frames[0]);
+    sched.push(3, 1, &frames[1]);
+    assert(sched.pop() == &frames[1]);
+    assert(sched.pop() == &frames[0]);
+    assert(sched.pop() == nullptr);
+}
+
+// Test that erasing a stream returns its frames in order and leaves the
+// other streams taking turns, wherever the stream was in its ring.
+void scheduler_erase()
+{
+    spdy::output_scheduler<scheduled_frame> sched;
+    std::vector<scheduled_frame> frames(8);
+    std::vector<unsigned> order;
+
+    // Streams 1, 3 and 5 at priority 2 and stream 7 at priority 0.
+    const unsigned ids[] = { 1, 3, 5, 1, 3, 5, 7, 3 };
+    for (unsigned i = 0; i < frames.size(); ++i) {
+        frames[i].stream_id = ids[i];
+        frames[i].size = i;
+        sched.push(ids[i], ids[i] == 7 ? 0 : 2, &frames[i]);
+    }
+
+    assert(sched.erase(9) == nullptr);
+
+    // Stream 3 is in the middle of its ring.
+    scheduled_frame * head = sched.erase(3);
+    for (scheduled_frame * frame = head; frame; frame = frame->next) {
+        order.push_back(frame->size);
+    }
+
+    const unsigned erased[] = { 1, 4, 7 };
+    assert(order.size() == countof(erased));
+    assert(std::equal(order.begin(), order.end(), erased));
+    assert(sched.size() == 5);
+    assert(sched.erase(3) == nullptr);
+
+    // Stream 5 is the tail of its ring, and stream 7 is alone in its.
+    assert(sched.erase(7) == &frames[6]);
+    assert(sched.erase(5) == &frames[2] && frames[2].next == &frames[5]);
+    assert(sched.size() == 2);
+    assert(sched.pop() == &frames[0]);
+    assert(sched.pop() == &frames[3]);
+    assert(sched.pop() == nullptr && sched.empty());
+}
+
+// Model a session sending 8 bulk downloads at low priority when the page
+// asks for a high priority resource. Each tick, the network takes a fixed
+// number of bytes from the output buffer and the writer refills it from
+// the queued frames, keeping at most output_limit bytes buffered. Measure
+// the time to the first byte of the high priority stream, in ticks, with
+// the frames written in arrival order and with the priority scheduler.
+static unsigned
+time_to_first_byte(bool prioritize)
+{
+    const size_t frame_size = 4096;
+    const size_t output_limit = 16 * 1024;
+    const size_t link_rate = 8 * 1024;      // bytes per tick
+    const unsigned nbulk = 8;
+    const unsigned bulk_frames = 64;
+    const unsigned arrival = 10;            // tick the request arrives
+    const unsigned urgent_id = 101;
+
+    spdy::output_scheduler<scheduled_frame> sched;
+    std::vector<scheduled_frame *> fifo;
+    std::vector<scheduled_frame> frames(nbulk * bulk_frames + 1);
+    std::vector<size_t> buffered;           // output buffer, frame sizes
+    std::vector<unsigned> owners;           // stream of each buffered frame
+    size_t nbuffered = 0;
+    size_t head = 0;                        // bytes of buffered[0] sent
+
+    auto queue = [&](scheduled_frame * frame, unsigned priority) {
+        if (prioritize) {
+            sched.push(frame->stream_id, priority, frame);
+        } else {
+            fifo.push_back(frame);
+        }
+    };
+
+    for (unsigned i = 0; i < bulk_frames; ++i) {
+        for (unsigned s = 0; s < nbulk; ++s) {
+            scheduled_frame& frame = frames[i * nbulk + s];
+            frame.stream_id = 2 * s + 1;
+            frame.size = frame_size;
+            queue(&frame, 6);
+        }
+    }
+
+    for (unsigned tick = 0; tick < 10000; ++tick) {
+        if (tick == arrival) {
+            scheduled_frame& frame = frames.back();
+            frame.stream_id = urgent_id;
+            frame.size = frame_size;
+            queue(&frame, 0);
+        }
+
+        // Refill the output buffer.
+        while (nbuffered < output_limit) {
+            scheduled_frame * frame;
+            if (prioritize) {
+                frame = sched.pop();
+            } else if (!fifo.empty()) {
+                frame = fifo.front();
+                fifo.erase(fifo.begin());
+            } else {
+                frame = nullptr;
+            }
+
+            if (frame == nullptr) {
+                break;
+            }
+
+            buffered.push_back(frame->size);
+            owners.push_back(frame->stream_id);
+            nbuffered += frame->size;
+        }
+
+        // Send a tick's worth of bytes.
+        for (size_t budget = link_rate; budget && !buffered.empty(); ) {
+            if (owners.front() == urgent_id) {
+                return tick - arrival;
+            }
+
+            size_t n = std::min(budget, buffered.front() - head);
+            budget -= n;
+            head += n;
+            nbuffered -= n;
+            if (head == buffered.front()) {
+                buffered.erase(buffered.begin());
+                owners.erase(owners.begin());
+                head = 0;
+            }
+        }
+    }
+
+    assert(false);
+    return 0;
+}
+
+// Test that a high priority stream gets its first byte after no more than
+// the data that was already buffered, rather than after the whole bulk
+// transfer.
+void scheduler_time_to_first_byte()
+{
+    unsigned fifo = time_to_first_byte(false);
+    unsigned prio = time_to_first_byte(true);
+
+    // 16KB buffered at 8KB a tick drains in 2 ticks.
+    assert(prio <= 2);
+    assert(fifo > 10 * prio);
+}
+
+// Test that the dispatch queue starts streams by priority, and in arrival
+// order within a priority.
+void dispatch_queue_order()
+{
+    spdy::dispatch_queue queue;
+    std::vector<unsigned> order;
+
+    assert(queue.empty() && queue.pop() == 0);
+
+    // A page: the document, then scripts, images and styles as the parser
+    // finds them.
+    const unsigned ids[] = { 1, 3, 5, 7, 9, 11, 13, 15 };
+    const unsigned prio[] = { 0, 2, 6, 6, 1, 2, 6, 1 };
+    for (unsigned i = 0; i < countof(ids); ++i) {
+        queue.push(ids[i], prio[i]);
+    }
+
+    assert(queue.size() == countof(ids));
+
+    // Start three, then let the rest in one at a time, with a late high
+    // priority arrival in between.
+    for (unsigned i = 0; i < 3; ++i) {
+        order.push_back(queue.pop());
+    }
+
+    queue.push(17, 0);
+    while (!queue.empty()) {
+        order.push_back(queue.pop());
+    }
+
+    const unsigned expected[] = { 1, 9, 15, 17, 3, 11, 5, 7, 13 };
+    assert(order.size() == countof(expected));
+    assert(std::equal(order.begin(), order.end(), expected));
+}
+
+// Test that the data framer coalesces and splits content into target size
+// frames, and puts FIN on the frame that ends the body.
+void data_frame_sizes()
+{
+    bool fin;
+
+    // Unknown length: the buffered content goes out in full frames. A
+    // short tail waits for more content until it is flushed, and only the
+    // end of the response sets FIN.
+    spdy::data_framer stream(100);
+    assert(stream.next(250, false, false, fin) == 100 && !fin);
+    assert(stream.next(150, false, false, fin) == 100 && !fin);
+    assert(stream.next(50, false, false, fin) == 0 && !fin);
+    assert(stream.next(80, false, false, fin) == 0 && !fin);
+    assert(stream.next(80, false, true, fin) == 80 && !fin);
+    assert(stream.next(0, false, true, fin) == 0 && !fin);
+    assert(stream.next(30, true, false, fin) == 30 && fin);
+
+    // At EOS with nothing buffered, FIN needs an empty frame.
+    spdy::data_framer drained(100);
+    assert(drained.next(0, true, false, fin) == 0 && fin);
+
+    // Known length: the frame with the last byte sets FIN, without waiting
+    // for EOS or a flush, and anything past the content length is not
+    // framed.
+    spdy::data_framer sized(100, 230);
+    assert(sized.next(120, false, false, fin) == 100 && !fin);
+    assert(sized.next(20, false, false, fin) == 0 && !fin);
+    assert(sized.next(20, false, true, fin) == 20 && !fin);
+    assert(sized.next(300, false, false, fin) == 100 && !fin);
+    assert(sized.next(200, false, false, fin) == 10 && fin);
+
+    // An empty body ends straight away.
+    spdy::data_framer empty(100, 0);
+    assert(empty.next(0, false, false, fin) == 0 && fin);
+
+    // A block larger than any DATA frame is split.
+    spdy::data_framer large;
+    size_t nbytes = spdy::MAX_FRAME_LENGTH + 1;
+    unsigned frames = 0;
+    do {
+        size_t len = large.next(nbytes, true, false, fin);
+        assert(len <= spdy::data_framer::default_target);
+        assert(len + spdy::message_header::size <= 16384);
+        nbytes -= len;
+        ++frames;
+    } while (!fin);
+
+    assert(nbytes == 0);
+    assert(frames == spdy::MAX_FRAME_LENGTH / spdy::data_framer::default_target + 1);
+}
+
 int main(void)
 {
     initstate();
     roundtrip();
     shortbuf();
     compress_kvblock();
+    marshall_incompressible();
+    zpool_reuse();
     spdy_headers();
     spdy_decompress();
+    visit_headers();
+    flat_map_order();
+    byte_buffer_growth();
+    arena_allocation();
+    stream_table_ops();
+    mpsc_queue_order();
+    scheduler_order();
+    scheduler_erase();
+    scheduler_time_to_first_byte();
+    dispatch_queue_order();
+    data_frame_sizes();
+    known_header_lookup();
+    versioned_header_lookup();
+    normalize_headers();
+    read_frames();
+    parse_malformed();
+    codec_versions();
+    enforce_frame_limits();
     return 0;
 }
 
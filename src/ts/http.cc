@@ -18,6 +18,7 @@
 
 #include <ts/ts.h>
 #include <spdy/spdy.h>
+#include <spdy/normalize.h>
 #include <base/logging.h>
 #include "io.h"
 #include "http.h"
@@ -27,11 +28,11 @@ static void
 populate_http_headers(
         TSMBuffer   buffer,
         TSMLoc      header,
-        spdy::protocol_version version,
+        const spdy::header_codec * codec,
         spdy::key_value_block& kvblock)
 {
     char status[128];
-    char httpvers[sizeof("HTTP/xx.xx")];
+    char httpvers[sizeof("HTTP/65535.65535")];
 
     int vers = TSHttpHdrVersionGet(buffer, header);
     TSHttpStatus code = TSHttpHdrStatusGet(buffer, header);
@@ -41,13 +42,37 @@ populate_http_headers(
     snprintf(httpvers, sizeof(httpvers),
             "HTTP/%2u.%2u", TS_HTTP_MAJOR(vers), TS_HTTP_MINOR(vers));
 
-    if (version == spdy::PROTOCOL_VERSION_2) {
-        kvblock["status"] = status;
-        kvblock["version"] = httpvers;
-    } else {
-        kvblock[":status"] = status;
-        kvblock[":version"] = httpvers;
+    kvblock[codec->status_header] = status;
+    kvblock[codec->version_header] = httpvers;
+}
+
+// Add a response header to the SYN_REPLY header block, lower-casing the
+// name as SPDY requires. Skip headers that we can't represent in SPDY. A
+// NUL in the value would split it into multiple values.
+static void
+append_response_header(
+        const spdy_io_stream *  stream,
+        spdy::key_value_block&  kvblock,
+        const char *            name,
+        int                     nlen,
+        const char *            value,
+        int                     vlen)
+{
+    spdy::inline_byte_buffer<128>   key;
+    unsigned                        flags;
+
+    key.resize(nlen);
+    flags = spdy::normalize_header_name(name, (char *)key.data(), nlen) |
+        spdy::check_header_value(value, vlen);
+    if (flags & (spdy::HEADER_NAME_INVALID |
+                spdy::HEADER_VALUE_NUL | spdy::HEADER_VALUE_CRLF)) {
+        debug_http("[%p/%u] skipping invalid %.*s header",
+                stream->io, stream->stream_id, nlen, name);
+        return;
     }
+
+    kvblock[spdy::string_ref((const char *)key.data(), key.size())].assign(
+            value, vlen);
 }
 
 void
@@ -57,7 +82,11 @@ http_send_response(
         TSMLoc              header)
 {
     TSMLoc      field;
-    spdy::key_value_block kvblock;
+
+    // The header block is only needed until it is compressed into the
+    // SYN_REPLY, so give the arena space back when we are done.
+    spdy::arena::scope      scope(stream->arena);
+    spdy::key_value_block   kvblock(&stream->arena);
 
     debug_http_header(stream, buffer, header);
 
@@ -69,26 +98,20 @@ http_send_response(
 
         name.first = TSMimeHdrFieldNameGet(buffer, header, field, &name.second);
 
-        // XXX zwoop says that pointer comparisons ought to be
-        // sufficient here. If we can test and confirm, we can
-        // remove all the strcmp()s.
-
         //The Connection, Keep-Alive, Proxy-Connection, and
         //Transfer-Encoding headers are not valid and MUST not be
         //sent.
-        if (strcmp(name.first, TS_MIME_FIELD_CONNECTION) == 0 ||
-                strcmp(name.first, TS_MIME_FIELD_KEEP_ALIVE) == 0 ||
-                strcmp(name.first, TS_MIME_FIELD_PROXY_CONNECTION) == 0 ||
-                strcmp(name.first, TS_MIME_FIELD_TRANSFER_ENCODING) == 0) {
-            debug_http("[%p/%u] skipping %s header",
-                    stream->io, stream->stream_id, name.first);
+        if (spdy::is_hop_by_hop_header(
+                    spdy::lookup_header(name.first, name.second))) {
+            debug_http("[%p/%u] skipping %.*s header",
+                    stream->io, stream->stream_id, name.second, name.first);
             goto skip;
         }
 
         value.first = TSMimeHdrFieldValueStringGet(buffer, header,
                 field, 0, &value.second);
-        kvblock.insert(std::string(name.first, name.second),
-                std::string(value.first, value.second));
+        append_response_header(stream, kvblock,
+                name.first, name.second, value.first, value.second);
 
 skip:
        next = TSMimeHdrFieldNext(buffer, header, field);
@@ -96,7 +119,7 @@ skip:
        field = next;
     }
 
-    populate_http_headers(buffer, header, stream->version, kvblock);
+    populate_http_headers(buffer, header, stream->io->codec, kvblock);
     spdy_send_syn_reply(stream, kvblock);
 }
 
@@ -114,38 +137,88 @@ http_send_error(
 
     debug_http("[%p/%u] sending a HTTP %d result for %s %s://%s%s",
             stream->io, stream->stream_id, status,
-            stream->kvblock.url().method.c_str(),
-            stream->kvblock.url().scheme.c_str(),
-            stream->kvblock.url().hostport.c_str(),
-            stream->kvblock.url().path.c_str());
+            stream->request.url.method.c_str(),
+            stream->request.url.scheme.c_str(),
+            stream->request.url.hostport.c_str(),
+            stream->request.url.path.c_str());
 
     http_send_response(stream, buffer.get(), header.get());
     spdy_send_data_frame(stream, spdy::FLAG_FIN, nullptr, 0);
 }
 
-void
+bool
 http_send_content(
         spdy_io_stream *    stream,
-        TSIOBufferReader    reader)
+        TSIOBufferReader    reader,
+        bool                eos,
+        bool                flush)
 {
-    TSIOBufferBlock blk;
-    int64_t         consumed = 0;
+    int64_t avail = TSIOBufferReaderAvail(reader);
 
-    blk = TSIOBufferReaderStart(stream->input.reader);
-    while (blk) {
-        const char *    ptr;
-        int64_t         nbytes;
+    // Coalesce the buffer blocks into frames of the target size, however
+    // the origin data happened to be chunked. A short tail stays in the
+    // reader, across read events, until it fills up or is flushed.
+    for (;;) {
+        bool    fin;
+        size_t  nbytes = stream->framer.next(avail, eos, flush, fin);
 
-        ptr = TSIOBufferBlockReadStart(blk, reader, &nbytes);
-        if (ptr && nbytes) {
-            spdy_send_data_frame(stream, 0 /* flags */, ptr, nbytes);
-            consumed += nbytes;
+        if (nbytes == 0 && !fin) {
+            return false;
         }
 
-        blk = TSIOBufferBlockNext(blk);
+        spdy_send_buffered_data_frame(stream,
+                fin ? (unsigned)spdy::FLAG_FIN : 0u, reader, nbytes);
+        avail -= nbytes;
+
+        if (fin) {
+            return true;
+        }
     }
+}
 
-    TSIOBufferReaderConsume(reader, consumed);
+int64_t
+http_content_length(
+        const spdy_io_stream *  stream,
+        TSMBuffer               buffer,
+        TSMLoc                  header)
+{
+    TSHttpStatus    status = TSHttpHdrStatusGet(buffer, header);
+    TSMLoc          field;
+    const char *    value;
+    int             vlen;
+    int64_t         length = 0;
+
+    // These responses never have a body, whatever the headers say.
+    if (stream->request.url.method == "HEAD" ||
+            (status >= 100 && status < 200) ||
+            status == 204 || status == 304) {
+        return 0;
+    }
+
+    field = TSMimeHdrFieldFind(buffer, header,
+            TS_MIME_FIELD_CONTENT_LENGTH, TS_MIME_LEN_CONTENT_LENGTH);
+    if (field == TS_NULL_MLOC) {
+        return -1;
+    }
+
+    // Don't trust a Content-Length that we can't parse. Reading to the end
+    // of the response is always safe.
+    value = TSMimeHdrFieldValueStringGet(buffer, header, field, 0, &vlen);
+    if (value == nullptr || vlen == 0 || vlen > 18) {
+        length = -1;
+    }
+
+    for (int i = 0; length >= 0 && i < vlen; ++i) {
+        if (value[i] < '0' || value[i] > '9') {
+            length = -1;
+            break;
+        }
+
+        length = length * 10 + (value[i] - '0');
+    }
+
+    TSHandleMLocRelease(buffer, header, field);
+    return length;
 }
 
 void
@@ -185,6 +258,14 @@ http_parser::~http_parser()
     }
 }
 
+void
+http_parser::reset()
+{
+    TSHttpParserClear(parser);
+    header.reset();
+    complete = false;
+}
+
 ssize_t
 http_parser::parse(TSIOBufferReader reader)
 {
@@ -211,6 +292,7 @@ http_parser::parse(TSIOBufferReader reader)
         case TS_PARSE_DONE:
         case TS_PARSE_OK:
             this->complete = true;
+            // fall through
         case TS_PARSE_CONT:
             // We consumed the buffer we got minus the remainder.
             consumed += (nbytes - std::distance(ptr, end));
@@ -229,69 +311,107 @@ static void
 make_ts_http_url(
         TSMBuffer   buffer,
         TSMLoc      header,
-        const spdy::key_value_block& kvblock)
+        const spdy::url_components& url)
 {
     TSReturnCode    tstatus;
-    TSMLoc          url;
+    TSMLoc          loc;
 
-    tstatus = TSHttpHdrUrlGet(buffer, header, &url);
+    tstatus = TSHttpHdrUrlGet(buffer, header, &loc);
     if (tstatus == TS_ERROR) {
-        tstatus = TSUrlCreate(buffer, &url);
+        tstatus = TSUrlCreate(buffer, &loc);
     }
 
-    TSUrlSchemeSet(buffer, url,
-            kvblock.url().scheme.data(), kvblock.url().scheme.size());
-    TSUrlHostSet(buffer, url,
-            kvblock.url().hostport.data(), kvblock.url().hostport.size());
-    TSUrlPathSet(buffer, url,
-            kvblock.url().path.data(), kvblock.url().path.size());
-    TSHttpHdrMethodSet(buffer, header,
-            kvblock.url().method.data(), kvblock.url().method.size());
+    TSUrlSchemeSet(buffer, loc, url.scheme.data(), url.scheme.size());
+    TSUrlHostSet(buffer, loc, url.hostport.data(), url.hostport.size());
+    TSUrlPathSet(buffer, loc, url.path.data(), url.path.size());
+    TSHttpHdrMethodSet(buffer, header, url.method.data(), url.method.size());
 
-    TSHttpHdrUrlSet(buffer, header, url);
+    TSHttpHdrUrlSet(buffer, header, loc);
 
     TSAssert(tstatus == TS_SUCCESS);
 }
 
-static TSMLoc
-make_ts_http_header(
-        TSMBuffer buffer,
-        const spdy::key_value_block& kvblock)
+static void
+init_http_request(TSMBuffer buffer, TSMLoc header)
 {
-    scoped_http_header header(buffer);
-
     TSHttpHdrTypeSet(buffer, header, TS_HTTP_TYPE_REQUEST);
 
-    // XXX extract the real HTTP version header from kvblock.url()
+    // XXX extract the real HTTP version header from the request URL.
     TSHttpHdrVersionSet(buffer, header, TS_HTTP_VERSION(1, 1));
-    make_ts_http_url(buffer, header, kvblock);
-
-    // Duplicate the header fields into the MIME header for the HTTP request we
-    // are building.
-    for (auto ptr(kvblock.begin()); ptr != kvblock.end(); ++ptr) {
-        if (ptr->first[0] != ':') {
-            TSMLoc field;
-
-            // XXX Need special handling for duplicate headers; we should
-            // append them as a multi-value
-
-            TSMimeHdrFieldCreateNamed(buffer, header,
-                    ptr->first.c_str(), -1, &field);
-            TSMimeHdrFieldValueStringInsert(buffer, header, field,
-                    -1, ptr->second.c_str(), -1);
-            TSMimeHdrFieldAppend(buffer, header, field);
-        }
+}
+
+http_request::http_request(spdy::arena * arena)
+    : mbuffer(), header(mbuffer.get()), url(arena),
+    version(spdy::PROTOCOL_VERSION_3), malformed(false)
+{
+    init_http_request(mbuffer.get(), header);
+}
+
+void
+http_request::reset()
+{
+    header.reset();
+    init_http_request(mbuffer.get(), header);
+    url.clear();
+    malformed = false;
+}
+
+void
+http_request::operator()(
+        const spdy::string_ref& name,
+        const spdy::string_ref& value)
+{
+    TSMLoc          field;
+    spdy::header_id id = spdy::lookup_header(version, name.ptr, name.len);
+
+    // Upper-case names are tolerated since HTTP header names are not case
+    // sensitive, but a CR or LF would let the client inject headers into
+    // the HTTP request.
+    if (spdy::check_header(name.ptr, name.len, value.ptr, value.len) &
+            (spdy::HEADER_NAME_INVALID | spdy::HEADER_VALUE_CRLF)) {
+        debug_http("invalid %.*s header", (int)name.len, name.ptr);
+        malformed = true;
+        return;
     }
 
-    return header.release();
+    if (url.assign(id, value)) {
+        return;
+    }
+
+    if (name.empty() || name.ptr[0] == ':') {
+        return;
+    }
+
+    // Hop-by-hop headers are not valid in SPDY, so don't pass them on to
+    // the origin server.
+    if (spdy::is_hop_by_hop_header(id)) {
+        debug_http("skipping %.*s header", (int)name.len, name.ptr);
+        return;
+    }
+
+    // Duplicate the header field straight out of the decompressed header
+    // block into the MIME header for the HTTP request we are building.
+
+    // XXX Need special handling for duplicate headers; we should
+    // append them as a multi-value
+
+    TSMimeHdrFieldCreateNamed(mbuffer.get(), header,
+            name.ptr, name.len, &field);
+    TSMimeHdrFieldValueStringInsert(mbuffer.get(), header, field,
+            -1, value.ptr, value.len);
+    TSMimeHdrFieldAppend(mbuffer.get(), header, field);
+    TSHandleMLocRelease(mbuffer.get(), header, field);
 }
 
-scoped_http_header::scoped_http_header(
-        TSMBuffer b,
-        const spdy::key_value_block& kvblock)
-    : buffer(b)
+bool
+http_request::finish()
 {
-    this->header = make_ts_http_header(buffer, kvblock);
+    if (malformed || !url.is_complete()) {
+        return false;
+    }
+
+    make_ts_http_url(mbuffer.get(), header, url);
+    return true;
 }
 
 scoped_http_header::scoped_http_header(TSMBuffer b)
@@ -300,4 +420,15 @@ scoped_http_header::scoped_http_header(TSMBuffer b)
     header = TSHttpHdrCreate(buffer);
 }
 
+void
+scoped_http_header::reset()
+{
+    if (header != TS_NULL_MLOC) {
+        TSHttpHdrDestroy(buffer, header);
+        TSHandleMLocRelease(buffer, TS_NULL_MLOC, header);
+    }
+
+    header = TSHttpHdrCreate(buffer);
+}
+
 /* vim: set sw=4 ts=4 tw=79 et : */
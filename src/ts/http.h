@@ -26,15 +26,22 @@ void http_send_error(spdy_io_stream *, TSHttpStatus);
 // Send a HTTP response (HTTP header + MIME headers).
 void http_send_response(spdy_io_stream *, TSMBuffer, TSMLoc);
 
-// Send a chunk of the HTTP body content.
-void http_send_content(spdy_io_stream *, TSIOBufferReader);
+// Send the buffered HTTP body content in DATA frames of the stream's target
+// size. The first bool says that the origin server has no more to send, and
+// the second that a short tail should go out rather than wait for more
+// content. Return true if that finished the body, in which case the last
+// DATA frame carried FIN.
+bool http_send_content(spdy_io_stream *, TSIOBufferReader, bool, bool);
+
+// Return the length of the body that follows the given response header, or
+// -1 if it runs until the origin server closes the connection.
+int64_t http_content_length(const spdy_io_stream *, TSMBuffer, TSMLoc);
 
 void debug_http_header(const spdy_io_stream *, TSMBuffer, TSMLoc);
 
 struct scoped_http_header
 {
     explicit scoped_http_header(TSMBuffer b);
-    scoped_http_header(TSMBuffer, const spdy::key_value_block&);
 
     scoped_http_header(TSMBuffer b, TSMLoc h)
             : header(h), buffer(b) {
@@ -65,6 +72,9 @@ struct scoped_http_header
         return tmp;
     }
 
+    // Destroy the header and start a new, empty one in the same buffer.
+    void reset();
+
 private:
     TSMLoc      header;
     TSMBuffer   buffer;
@@ -77,11 +87,37 @@ struct http_parser
 
     ssize_t parse(TSIOBufferReader);
 
+    // Get ready to parse another response.
+    void reset();
+
     TSHttpParser        parser;
     scoped_mbuffer      mbuffer;
     scoped_http_header  header;
     bool                complete;
 };
 
+// HTTP request header that is built directly from a SPDY header block by
+// passing it as the key_value_block::parse() visitor.
+struct http_request
+{
+    explicit http_request(spdy::arena *);
+
+    void operator()(const spdy::string_ref&, const spdy::string_ref&);
+
+    // Fill in the request URL and method from the SPDY request line
+    // headers. Return false if the request line is incomplete or if any
+    // header was malformed.
+    bool finish();
+
+    // Forget the request so that we can decode another one.
+    void reset();
+
+    scoped_mbuffer          mbuffer;
+    scoped_http_header      header;
+    spdy::url_components    url;
+    spdy::protocol_version  version;    // spelling of the request line
+    bool                    malformed;
+};
+
 #endif /* HTTP_H_E7A06C65_4FCF_46C0_8C97_455BEB9A3DE8 */
 /* vim: set sw=4 ts=4 tw=79 et : */
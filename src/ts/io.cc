@@ -16,11 +16,89 @@
 
 #include <ts/ts.h>
 #include <spdy/spdy.h>
+#include <spdy/zpool.h>
 #include "io.h"
-#include <memory>
+#include "protocol.h"
+#include "stats.h"
+
+// Generous enough for any real browser request, but they stop a small
+// compressed header block from inflating to megabytes.
+static spdy::frame_limits
+default_frame_limits()
+{
+    spdy::frame_limits limits;
+
+    limits.max_frame_size = 64 * 1024;
+    limits.max_header_bytes = 64 * 1024;
+    limits.max_headers = 100;
+    return limits;
+}
+
+spdy_frame *
+spdy_frame::create(frame_type type, size_t size)
+{
+    spdy_frame * frame = (spdy_frame *)malloc(sizeof(spdy_frame) + size);
+    if (frame == nullptr) {
+        throw std::bad_alloc();
+    }
+
+    frame->next = nullptr;
+    frame->type = type;
+    frame->version = spdy::PROTOCOL_VERSION_3;
+    frame->stream_id = 0;
+    frame->flags = 0;
+    frame->priority = 0;
+    frame->size = size;
+    frame->payload = nullptr;
+    return frame;
+}
+
+spdy_frame *
+spdy_frame::create(spdy_io_stream * stream, TSIOBufferReader src, size_t size)
+{
+    spdy_frame * frame = create(frame_data, 0);
+
+    // TSIOBufferCopy() clones the block references, so the payload keeps
+    // the origin server data alive without copying it. Once we consume
+    // it, the frame holds the only references on the stream side.
+    try {
+        frame->payload = stream->take_payload();
+    } catch (...) {
+        destroy(frame);
+        throw;
+    }
+
+    frame->size = TSIOBufferCopy(frame->payload->buffer, src, size, 0);
+    TSIOBufferReaderConsume(src, frame->size);
+    return frame;
+}
+
+void
+spdy_frame::destroy(spdy_frame * frame)
+{
+    if (frame->payload) {
+        spdy_io_stream::return_payload(frame->payload);
+    }
+
+    free(frame);
+}
+
+spdy::compress::options spdy_io_control::compression;
+spdy::frame_limits spdy_io_control::limits(default_frame_limits());
+bool spdy_io_control::shared_mutex = false;
+size_t spdy_io_control::output_limit = 64 * 1024;
+unsigned spdy_io_control::max_in_flight = 32;
+size_t spdy_io_control::buffer_high = 256 * 1024;
+size_t spdy_io_control::buffer_low = 128 * 1024;
 
 spdy_io_control::spdy_io_control(TSVConn v)
-    : vconn(v), input(), output(), streams(), last_stream_id(0)
+    : vconn(v), mutex(TSMutexCreate()), input(), output(), streams(), last_stream_id(0), closing(false),
+    codec(nullptr),
+    deflater(), decompressor(spdy::zpool::allocator()),
+    frames(decompressor, limits), outgoing(), staging(), staged_frames(0),
+    scheduled(),
+    pending(), npending(0), in_flight(0),
+    queued_bytes(0), throttled(false), paused(), buffered(0), in_event(false)
 {
 }
 
@@ -28,16 +106,35 @@ spdy_io_control::~spdy_io_control()
 {
     TSVConnClose(vconn);
 
+    spdy_stat_increment(SPDY_STAT_SESSION_BUFFERED_BYTES, -buffered);
+
     for (auto ptr(streams.begin()); ptr != streams.end(); ++ptr) {
         release(ptr->second);
     }
+
+    for (spdy_frame * frame = outgoing.pop_all(); frame; ) {
+        spdy_frame * next = frame->next;
+        spdy_frame::destroy(frame);
+        frame = next;
+    }
+
+    while (spdy_frame * frame = scheduled.pop()) {
+        spdy_frame::destroy(frame);
+    }
 }
 
 void
 spdy_io_control::reenable()
 {
-
     TSVIO vio = TSVConnWriteVIOGet(this->vconn);
+
+    // With a shared session mutex, the caller is running under the write
+    // VIO mutex already.
+    if (shared_mutex) {
+        TSVIOReenable(vio);
+        return;
+    }
+
     TSMutex mutex = TSVIOMutexGet(vio);
 
     TSMutexLock(mutex);
@@ -45,6 +142,53 @@ spdy_io_control::reenable()
     TSMutexUnlock(mutex);
 }
 
+void
+spdy_io_control::discard(spdy_frame * frame)
+{
+    while (frame) {
+        spdy_frame * next = frame->next;
+
+        if (frame->type == spdy_frame::frame_data) {
+            queued_bytes.fetch_sub(frame->size, std::memory_order_relaxed);
+        }
+
+        spdy_frame::destroy(frame);
+        frame = next;
+    }
+}
+
+void
+spdy_io_control::enqueue(spdy_frame * frame)
+{
+    if (frame->type == spdy_frame::frame_data) {
+        queued_bytes.fetch_add(frame->size, std::memory_order_relaxed);
+    }
+
+    bool wake = outgoing.push(frame);
+
+    // Either the session sees this frame when it flushes after the event
+    // it is handling, or we see that it is not handling one and wake it.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (wake && !in_event.load(std::memory_order_relaxed)) {
+        reenable();
+    }
+}
+
+spdy::zstream<spdy::compress>&
+spdy_io_control::compressor()
+{
+    if (!deflater) {
+        spdy::compress::options opts(compression);
+
+        TSReleaseAssert(codec != nullptr);
+        opts.dictionary = &codec->dictionary;
+        deflater.reset(new spdy::zstream<spdy::compress>(
+                    spdy::zpool::allocator(), opts));
+    }
+
+    return *deflater;
+}
+
 bool
 spdy_io_control::valid_client_stream_id(unsigned stream_id) const
 {
@@ -56,30 +200,92 @@ spdy_io_control::valid_client_stream_id(unsigned stream_id) const
 spdy_io_stream *
 spdy_io_control::create_stream(unsigned stream_id)
 {
-    std::auto_ptr<spdy_io_stream> ptr(new spdy_io_stream(stream_id));
-    std::pair<stream_map_type::iterator, bool> result;
+    spdy_io_stream * stream = spdy_io_stream::create(stream_id);
 
-    result = streams.insert(std::make_pair(stream_id, ptr.get()));
-    if (result.second) {
-        // Insert succeeded, hold a refcount on the stream.
-        retain(ptr.get());
+    // Hold a refcount on the stream while it is in the table.
+    retain(stream);
+
+    if (streams.insert(stream_id, stream)) {
         last_stream_id = stream_id;
-        return ptr.release();
+        return stream;
     }
 
-    // stream-id collision ... fail and autorelease.
+    // stream-id collision ... fail and give the stream back.
+    release(stream);
     return NULL;
 }
 
 void
 spdy_io_control::destroy_stream(unsigned stream_id)
 {
-    stream_map_type::iterator ptr(streams.find(stream_id));
-    if (ptr != streams.end()) {
-        std::lock_guard<spdy_io_stream::lock_type> lk(ptr->second->lock);
-        release(ptr->second);
-        streams.erase(ptr);
+    // Flush the frames that the stream queued before now, so that any
+    // RST_STREAM ending it goes out after its DATA. Then drop the DATA
+    // that is still waiting; frames that it queues later are dropped when
+    // the session sees that the stream is gone.
+    spdy_schedule_frames(this);
+    discard(scheduled.erase(stream_id));
+
+    spdy_io_stream * stream = streams.erase(stream_id);
+    if (stream) {
+        // Wait for any event that the stream is processing, but don't
+        // hold the lock while releasing, since that can free the stream.
+        { scoped_stream_lock lk(stream); }
+        release(stream);
     }
 }
 
+void
+spdy_io_control::queue_stream(spdy_io_stream * stream)
+{
+    pending.push(stream->stream_id, stream->priority);
+    npending.fetch_add(1);
+}
+
+void
+spdy_io_control::stream_finished(spdy_io_stream * stream)
+{
+    if (!stream->dispatched) {
+        return;
+    }
+
+    stream->dispatched = false;
+    in_flight.fetch_sub(1);
+
+    // The session checks in_flight after queueing a stream, and we check
+    // npending after freeing the slot, so one of us starts the next
+    // stream.
+    if (npending.load() > 0) {
+        reenable();
+    }
+}
+
+bool
+spdy_io_control::pause_stream(spdy_io_stream * stream)
+{
+    if (!throttled.load()) {
+        return false;
+    }
+
+    if (stream->paused) {
+        return true;
+    }
+
+    // The resume event needs the same references as any other event we
+    // wait for.
+    stream->paused = true;
+    retain(stream);
+    retain(this);
+    paused.push(stream);
+
+    // The session clears throttled before it takes the paused streams, and
+    // we check it after queueing, so either it takes this stream or we
+    // wake it to.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!throttled.load()) {
+        reenable();
+    }
+
+    return true;
+}
+
 /* vim: set sw=4 ts=4 tw=79 et : */
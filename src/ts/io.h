@@ -52,6 +52,12 @@ typedef scoped_ts_object<TSMBuffer, TSMBufferCreate, TSMBufferDestroy> scoped_mb
 template<> std::string stringof<TSEvent>(const TSEvent&);
 
 #include <base/atomic.h>
+#include <base/mpsc_queue.h>
+#include <spdy/reader.h>
+#include <spdy/codec.h>
+#include <spdy/stream_table.h>
+#include <spdy/scheduler.h>
+#include <memory>
 #include "http.h"
 
 struct spdy_io_buffer {
@@ -76,6 +82,24 @@ struct spdy_io_buffer {
         TSIOBufferWaterMarkSet(buffer, nbytes);
     }
 
+    // Discard any buffered data so that the buffer can be reused.
+    void reset() {
+        consume(TSIOBufferReaderAvail(reader));
+        watermark(0);
+    }
+};
+
+// The payload of a buffered DATA frame: a TSIOBuffer that references the
+// origin server's buffer blocks, and its reader. A frame holds one, and a
+// reference on its stream, until the session has written it. Then the
+// buffer goes back to the stream, so a stream only ever creates as many as
+// it has frames in flight.
+struct spdy_payload_buffer : public spdy_io_buffer
+{
+    spdy_payload_buffer() : next(nullptr), stream(nullptr) {}
+
+    spdy_payload_buffer *   next;
+    spdy_io_stream *        stream;     // set while a frame holds it
 };
 
 struct spdy_io_stream : public countable
@@ -97,37 +121,153 @@ struct spdy_io_stream : public countable
     explicit spdy_io_stream(unsigned);
     virtual ~spdy_io_stream();
 
-    // Move kv into the stream and start processing it. Return true if the
-    // stream transitions to open state.
-    bool open(spdy::key_value_block&, open_options);
+    // Return a stream from the calling thread's stream pool, or a new one
+    // if the pool is empty. Use this rather than new, so that streams
+    // keep their continuation, IO buffers and HTTP parser across requests.
+    static spdy_io_stream * create(unsigned stream_id);
+
+    // Start processing the request that was decoded into the stream. Return
+    // true if the stream transitions to open state.
+    bool open(open_options);
     void close();
 
     bool is_closed() const  { return !this->is_open(); }
     bool is_open() const  { return this->action || this->vconn; }
 
+    // The origin server IO buffers and the HTTP response parser are only
+    // needed once we connect to the origin server, so we don't create them
+    // until then. Many streams are refused or cancelled before that. A
+    // pooled stream keeps them once they exist.
+    void create_io_buffers();
+    void create_http_parser();
+
+    // Take a payload buffer for a DATA frame, reusing one that came back
+    // if we can. The buffer holds a reference on the stream. Only the
+    // stream may call this.
+    spdy_payload_buffer * take_payload();
+
+    // Give a payload buffer back to its stream, discarding what is left in
+    // it. This can be called from any thread.
+    static void return_payload(spdy_payload_buffer *);
+
     typedef std::mutex lock_type;
 
+    // Hot state that every frame and event touches. Together with the
+    // vtable pointer and the reference count, this fills one cache line.
     unsigned                stream_id;
     unsigned                http_state;
+    spdy::protocol_version  version;
+    unsigned                priority;       // from SYN_STREAM, 0 is highest
+    spdy_io_control *       io;
+    TSAction                action;
+    TSVConn                 vconn;
+    TSCont                  continuation;   // created by open()
 
     // NOTE: The caller *must* hold the stream lock when calling open() or
-    // close(), or processing any stream events.
+    // close(), or processing any stream events. Take it with
+    // scoped_stream_lock, which skips it when the session mutex already
+    // serializes the stream.
     lock_type               lock;
 
-    spdy::protocol_version  version;
-    TSAction                action;
-    TSVConn                 vconn;
-    TSCont                  continuation;
-    spdy::key_value_block   kvblock;
+    // Transient request and response header state is allocated from the
+    // stream arena and released all at once when the stream closes. The
+    // arena must be declared before anything that allocates from it.
+    spdy::arena             arena;
+    http_request            request;
 
-    spdy_io_control *       io;
-    spdy_io_buffer          input;
-    spdy_io_buffer          output;
-    http_parser             hparser;
+    std::unique_ptr<spdy_io_buffer> input;      // created at connect
+    std::unique_ptr<spdy_io_buffer> output;     // created at connect
+    std::unique_ptr<http_parser>    hparser;    // created at http_receive_headers
+
+    // Cuts the response body into DATA frames, set up once we have the
+    // response header.
+    spdy::data_framer       framer;
+
+    // Payload buffers that the session gave back, and those the stream has
+    // taken off the queue but not used yet.
+    mpsc_queue<spdy_payload_buffer> returned_payloads;
+    spdy_payload_buffer *           idle_payloads;
+
+    // Set while the stream holds one of the session's origin request slots.
+    bool                    dispatched;
+
+    // Set while the stream has stopped reading from the origin server
+    // because the session has too much output buffered. The session
+    // resumes it, and "next" links it into the session's paused queue.
+    bool                    paused;
+    spdy_io_stream *        next;
+
+    // Set while a timer is due to flush a short DATA tail that the stream
+    // is holding back.
+    bool                    flush_scheduled;
+
+    // Stream arena chunk size, from the plugin options.
+    static size_t arena_size;
+
+    // Maximum number of streams each thread keeps for reuse, from the
+    // plugin options.
+    static size_t pool_size;
+
+    // DATA frame payload size to aim for, from the plugin options.
+    static size_t data_frame_size;
+
+    // Milliseconds to hold a DATA tail shorter than data_frame_size for
+    // more content, from the plugin options. Zero sends it straight away.
+    static unsigned data_flush_delay;
 
     static spdy_io_stream * get(TSCont contp) {
         return (spdy_io_stream *)TSContDataGet(contp);
     }
+
+protected:
+    // Return the stream to the pool when the last reference goes away.
+    void dispose();
+
+private:
+    // Make the stream ready to be handed out again. Return false if it
+    // should be destroyed instead.
+    bool recycle();
+
+    unsigned                generation; // times this stream was reused
+};
+
+// A frame that is queued for the session to write. Streams run on
+// whatever thread their origin server connection is on, so rather than
+// writing into the session output buffer and using the session header
+// compressor themselves, they queue frames and the session continuation
+// compresses and writes them. The payload follows the structure in the
+// same allocation.
+struct spdy_frame
+{
+    enum frame_type {
+        frame_encoded,      // complete frame, written as it is
+        frame_syn_reply,    // uncompressed SYN_REPLY header block
+        frame_data          // DATA payload
+    };
+
+    spdy_frame *            next;   // owned by the queue
+    frame_type              type;
+    spdy::protocol_version  version;
+    unsigned                stream_id;
+    unsigned                flags;
+    unsigned                priority;   // of the stream, for DATA frames
+    size_t                  size;       // payload bytes
+
+    // A DATA payload can stay in the origin server's buffer blocks, which
+    // the payload buffer references rather than copies. Otherwise this is
+    // null and the payload follows the frame in memory.
+    spdy_payload_buffer *   payload;
+
+    uint8_t * data() {
+        return reinterpret_cast<uint8_t *>(this + 1);
+    }
+
+    static spdy_frame * create(frame_type, size_t);
+
+    // Create a DATA frame for the stream that references the next nbytes
+    // from the reader and consume them. No payload bytes are copied.
+    static spdy_frame * create(spdy_io_stream *, TSIOBufferReader, size_t);
+    static void destroy(spdy_frame *);
 };
 
 struct spdy_io_control : public countable
@@ -138,25 +278,176 @@ struct spdy_io_control : public countable
     // TSVIOReenable() the associated TSVConnection.
     void reenable();
 
+    // Destroy a list of frames linked through "next", which were never
+    // written, and stop counting their DATA bytes as queued.
+    void discard(spdy_frame *);
+
+    // Queue a frame for the session to write. This can be called from any
+    // thread. If the queue was empty and the session is not handling an
+    // event, the session write VIO is reenabled so that the session
+    // continuation runs and writes the frame.
+    void enqueue(spdy_frame *);
+
+    // Bracket a session event. Frames queued in between are written when
+    // the session flushes after end_event().
+    void begin_event() {
+        in_event.store(true, std::memory_order_relaxed);
+    }
+
+    void end_event() {
+        in_event.store(false, std::memory_order_relaxed);
+        // Pairs with the fence in enqueue().
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    // Return the header compressor, creating it on first use. The deflate
+    // state is the largest part of a session, and many sessions (e.g.
+    // speculative preconnects) never send a SYN_REPLY. The codec must be
+    // bound by then, since it picks the compression dictionary.
+    spdy::zstream<spdy::compress>& compressor();
+
     bool                valid_client_stream_id(unsigned stream_id) const;
     spdy_io_stream *    create_stream(unsigned stream_id);
     void                destroy_stream(unsigned stream_id);
 
-    typedef std::map<unsigned, spdy_io_stream *> stream_map_type;
+    // Queue a stream whose request is complete to be started once there
+    // is a free origin request slot. Only the session may call this.
+    void                queue_stream(spdy_io_stream *);
+
+    // Give back the stream's origin request slot, if it has one. This can
+    // be called from any thread. If streams are waiting for the slot, the
+    // session is woken up to start the next one.
+    void                stream_finished(spdy_io_stream *);
+
+    // If the session is throttled, queue the stream to be resumed when the
+    // session output drains and return true. The stream should then stop
+    // consuming what it reads from the origin server, which stops ATS
+    // reading once the stream's buffer fills. The stream receives
+    // TS_EVENT_IMMEDIATE when it is resumed.
+    bool                pause_stream(spdy_io_stream *);
+
+    // Return the open stream with the given ID, or null.
+    spdy_io_stream *    find_stream(unsigned stream_id) const {
+        return streams.find(stream_id);
+    }
+
+    typedef spdy::stream_table<spdy_io_stream> stream_map_type;
 
     TSVConn             vconn;
+    TSMutex             mutex;      // session continuation and write VIO
     spdy_io_buffer      input;
     spdy_io_buffer      output;
     stream_map_type     streams;
     unsigned            last_stream_id;
+    bool                closing;    // sent GOAWAY, ignoring further input
 
-    spdy::zstream<spdy::compress>   compressor;
+    // Header block codec for the session's protocol version, bound by the
+    // first SYN_STREAM.
+    const spdy::header_codec *      codec;
+
+    std::unique_ptr<spdy::zstream<spdy::compress>> deflater;
     spdy::zstream<spdy::decompress> decompressor;
+    spdy::frame_reader              frames;
+
+    // Frames waiting to be written by the session continuation, and the
+    // buffer it marshalls them into so that it can write a whole batch
+    // with one TSIOBufferWrite().
+    mpsc_queue<spdy_frame>          outgoing;
+    spdy::byte_buffer               staging;
+    unsigned                        staged_frames;
+
+    // DATA frames waiting for their turn. Control frames are written as
+    // soon as they are dequeued, but DATA frames are drawn by stream
+    // priority, and only while the output buffer holds less than
+    // output_limit bytes. Keeping the buffer short means that a
+    // high-priority stream doesn't queue behind bulk data that was already
+    // committed to the network. A stream's DATA frames still go out ahead
+    // of its RST_STREAM, and are dropped when the stream is destroyed.
+    spdy::output_scheduler<spdy_frame> scheduled;
+
+    // Streams waiting for an origin request slot. The session starts them
+    // in priority order at the end of each event, keeping at most
+    // max_in_flight origin requests going at once. npending mirrors the
+    // size of the queue for stream_finished(), which runs on other threads.
+    spdy::dispatch_queue            pending;
+    std::atomic<size_t>             npending;
+    std::atomic<unsigned>           in_flight;
+
+    // Origin read backpressure. The session counts the DATA bytes that are
+    // queued or in the output buffer after each flush. Above buffer_high,
+    // it throttles the streams, which pause their origin reads. Once it
+    // drains below buffer_low, it resumes the paused streams in priority
+    // order.
+    std::atomic<int64_t>            queued_bytes;   // DATA not yet staged
+    std::atomic<bool>               throttled;
+    mpsc_queue<spdy_io_stream>      paused;
+    int64_t                         buffered;       // as of the last flush
+
+    // Set while the session continuation is handling an event. It flushes
+    // the queue at the end of the event, so producers don't need to wake
+    // it until then.
+    std::atomic<bool>               in_event;
+
+    // Header compressor settings, from the plugin options.
+    static spdy::compress::options compression;
+
+    // Frame and header block limits, from the plugin options.
+    static spdy::frame_limits limits;
+
+    // Most bytes of scheduled DATA frames to keep in the output buffer.
+    static size_t output_limit;
+
+    // Most origin requests each session can have going at once, from the
+    // plugin options. Zero means no limit.
+    static unsigned max_in_flight;
+
+    // Buffered output watermarks for origin read backpressure, from the
+    // plugin options.
+    static size_t buffer_high;
+    static size_t buffer_low;
+
+    // Run every stream continuation under the session mutex, from the
+    // plugin options. All the events of a session are then serialized on
+    // one lock, so they never contend with each other or hand the lock
+    // between threads, and the stream locks are not needed.
+    static bool shared_mutex;
 
     static spdy_io_control * get(TSCont contp) {
         return (spdy_io_control *)TSContDataGet(contp);
     }
 };
 
+// Take the stream lock for the duration of the scope, unless the stream
+// continuations share the session mutex. In that case every stream event
+// already runs under the session mutex, which the caller holds.
+struct scoped_stream_lock
+{
+    explicit scoped_stream_lock(spdy_io_stream * s)
+        : stream(spdy_io_control::shared_mutex ? nullptr : s) {
+        if (stream) {
+            stream->lock.lock();
+        }
+    }
+
+    ~scoped_stream_lock() {
+        unlock();
+    }
+
+    // Unlock early, e.g. before releasing what might be the last
+    // reference on the stream.
+    void unlock() {
+        if (stream) {
+            stream->lock.unlock();
+            stream = nullptr;
+        }
+    }
+
+private:
+    scoped_stream_lock(const scoped_stream_lock&); // disable
+    scoped_stream_lock& operator=(const scoped_stream_lock&); // disable
+
+    spdy_io_stream * stream;
+};
+
 #endif /* IO_H_C3455D48_1D3C_49C0_BB81_844F4C7946A5 */
 /* vim: set sw=4 ts=4 tw=79 et : */
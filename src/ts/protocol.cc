@@ -21,10 +21,26 @@
 #include <base/logging.h>
 #include "io.h"
 #include "protocol.h"
+#include "stats.h"
 
 #include <algorithm>
-#include <vector>
-#include <sys/param.h> // MAX
+#include <string.h>
+
+// Queue a frame that is already marshalled. The stream ID is that of the
+// stream the frame ends, or zero for a session frame.
+static void
+enqueue_encoded_frame(
+        spdy_io_control *   io,
+        unsigned            stream_id,
+        const uint8_t *     ptr,
+        size_t              nbytes)
+{
+    spdy_frame * frame = spdy_frame::create(spdy_frame::frame_encoded, nbytes);
+
+    frame->stream_id = stream_id;
+    memcpy(frame->data(), ptr, nbytes);
+    io->enqueue(frame);
+}
 
 void
 spdy_send_reset_stream(
@@ -40,7 +56,9 @@ spdy_send_reset_stream(
     size_t      nbytes = 0;
 
     hdr.is_control = true;
-    hdr.control.version = spdy::PROTOCOL_VERSION;
+    // Answer in the session's protocol version. Until the first stream
+    // binds it, all we can do is use the latest one.
+    hdr.control.version = io->codec ? io->codec->version : spdy::PROTOCOL_VERSION_3;
     hdr.control.type = spdy::CONTROL_RST_STREAM;
     hdr.flags = 0;
     hdr.datalen = spdy::rst_stream_message::size;
@@ -48,11 +66,11 @@ spdy_send_reset_stream(
     rst.status_code = status;
 
     nbytes += spdy::message_header::marshall(hdr, ptr, sizeof(buffer));
-    nbytes += spdy::rst_stream_message::marshall(rst, ptr, sizeof(buffer) - nbytes);
+    nbytes += spdy::rst_stream_message::marshall(rst, ptr + nbytes, sizeof(buffer) - nbytes);
 
     debug_protocol("[%p/%u] sending %s stream %u with error %s",
             io, stream_id, cstringof(hdr.control.type), stream_id, cstringof(status));
-    TSIOBufferWrite(io->output.buffer, buffer, nbytes);
+    enqueue_encoded_frame(io, stream_id, buffer, nbytes);
 }
 
 void
@@ -60,95 +78,102 @@ spdy_send_syn_reply(
         spdy_io_stream * stream,
         const spdy::key_value_block& kvblock)
 {
-    union {
-        spdy::message_header hdr;
-        spdy::syn_reply_message syn;
-    } msg;
+    const spdy::header_codec * codec = stream->io->codec;
+    size_t nbytes = codec->nbytes(kvblock);
+    spdy_frame * frame;
 
-    uint8_t     buffer[
-        MAX((unsigned)spdy::message_header::size, (unsigned)spdy::syn_stream_message::size)];
-    size_t      nbytes = 0;
+    // The header block is compressed by the session, since the compressor
+    // state is shared by all its streams. All we can do here is serialize
+    // it.
+    frame = spdy_frame::create(spdy_frame::frame_syn_reply, nbytes);
+    frame->version = codec->version;
+    frame->stream_id = stream->stream_id;
+    codec->serialize(kvblock, frame->data(), nbytes);
 
-    std::vector<uint8_t> hdrs;
+    debug_protocol("[%p/%u] queueing %s with %zu header bytes",
+           stream->io, stream->stream_id, cstringof(spdy::CONTROL_SYN_REPLY),
+           nbytes);
+    stream->io->enqueue(frame);
+}
 
-    // Compress the kvblock into a temp buffer before we start. We need to know
-    // the size of this so we can fill in the datalen field. Since there's no
-    // way to go back and rewrite the data length into the TSIOBuffer, we need
-    // to use a temporary copy.
-    hdrs.resize(kvblock.nbytes(stream->version));
-    nbytes = spdy::key_value_block::marshall(stream->version,
-            stream->io->compressor, kvblock, &hdrs[0], hdrs.capacity());
-    hdrs.resize(nbytes);
+void
+spdy_send_data_frame(
+        spdy_io_stream *    stream,
+        unsigned            flags,
+        const void *        ptr,
+        size_t              nbytes)
+{
+    spdy_frame * frame;
 
-    msg.hdr.is_control = true;
-    msg.hdr.control.version = stream->version;
-    msg.hdr.control.type = spdy::CONTROL_SYN_REPLY;
-    msg.hdr.flags = 0;
-    msg.hdr.datalen = spdy::syn_reply_message::size(stream->version) + hdrs.size();
-    nbytes = TSIOBufferWrite(stream->io->output.buffer, buffer,
-            spdy::message_header::marshall(msg.hdr, buffer, sizeof(buffer)));
+    TSReleaseAssert(nbytes < spdy::MAX_FRAME_LENGTH);
 
-    msg.syn.stream_id = stream->stream_id;
-    nbytes += TSIOBufferWrite(stream->io->output.buffer, buffer,
-            spdy::syn_reply_message::marshall(stream->version,
-                        msg.syn, buffer, sizeof(buffer)));
+    frame = spdy_frame::create(spdy_frame::frame_data, nbytes);
+    frame->stream_id = stream->stream_id;
+    frame->flags = flags;
+    frame->priority = stream->priority;
+    if (nbytes) {
+        memcpy(frame->data(), ptr, nbytes);
+    }
 
-    nbytes += TSIOBufferWrite(stream->io->output.buffer, &hdrs[0], hdrs.size());
-    debug_protocol("[%p/%u] sending %s hdr.datalen=%u",
-           stream->io, stream->stream_id, cstringof(spdy::CONTROL_SYN_REPLY),
-           (unsigned)msg.hdr.datalen);
+    debug_protocol("[%p/%u] queueing DATA flags=%x %zu bytes",
+            stream->io, stream->stream_id, flags, nbytes);
+    stream->io->enqueue(frame);
 }
 
 void
-spdy_send_data_frame(
+spdy_send_buffered_data_frame(
         spdy_io_stream *    stream,
         unsigned            flags,
-        const void *        ptr,
+        TSIOBufferReader    reader,
         size_t              nbytes)
 {
-    spdy::message_header    hdr;
-    uint8_t                 buffer[spdy::message_header::size];
-    std::vector<uint8_t>    tmp;
-    ssize_t                 ret;
+    spdy_frame * frame;
 
     TSReleaseAssert(nbytes < spdy::MAX_FRAME_LENGTH);
 
-    // XXX If we are compressing the data, we need to make a temporary copy.
-    // When there is an ATS API that will let us rewrite the header, then we
-    // can marshall straight into the TSIOBiffer.
-    if (flags & spdy::FLAG_COMPRESSED) {
-        tmp.resize(nbytes + 64);
-        stream->io->compressor.input(ptr, nbytes);
-        nbytes = 0;
+    frame = spdy_frame::create(stream, reader, nbytes);
+    frame->stream_id = stream->stream_id;
+    frame->flags = flags;
+    frame->priority = stream->priority;
+    TSReleaseAssert(frame->size == nbytes);
 
-        do {
-            ret = stream->io->compressor.consume(&tmp[nbytes], tmp.size() - nbytes);
-            if (ret > 0) {
-                nbytes += ret;
-            }
-        } while (ret > 0);
+    debug_protocol("[%p/%u] queueing DATA flags=%x %zu bytes",
+            stream->io, stream->stream_id, flags, nbytes);
+    stream->io->enqueue(frame);
+}
 
-        tmp.resize(nbytes);
-    }
+void
+spdy_send_goaway(
+        spdy_io_control *       io,
+        spdy::protocol_version  version,
+        spdy::error             status)
+{
+    union {
+        spdy::message_header    hdr;
+        spdy::goaway_message    goaway;
+    } msg;
 
-    hdr.is_control = false;
-    hdr.flags = flags;
-    hdr.datalen = nbytes;
-    hdr.data.stream_id = stream->stream_id;
+    size_t                  nbytes = 0;
+    uint8_t buffer[spdy::message_header::size +
+        spdy::version_traits<spdy::PROTOCOL_VERSION_3>::goaway_size];
+
+    msg.hdr.is_control = true;
+    msg.hdr.control.version = version;
+    msg.hdr.control.type = spdy::CONTROL_GOAWAY;
+    msg.hdr.flags = 0;
+    msg.hdr.datalen = spdy::goaway_message::size(version);
+    nbytes += spdy::message_header::marshall(
+            msg.hdr, buffer + nbytes, sizeof(buffer) - nbytes);
 
-    spdy::message_header::marshall(hdr, buffer, sizeof(buffer));
-    TSIOBufferWrite(stream->io->output.buffer, buffer, spdy::message_header::size);
+    msg.goaway.last_stream_id = io->last_stream_id;
+    msg.goaway.status_code = status;
+    nbytes += spdy::goaway_message::marshall(version,
+            msg.goaway, buffer + nbytes, sizeof(buffer) - nbytes);
 
-    if (nbytes) {
-        if (flags & spdy::FLAG_COMPRESSED) {
-            TSIOBufferWrite(stream->io->output.buffer, &tmp[0], nbytes);
-        } else {
-            TSIOBufferWrite(stream->io->output.buffer, ptr, nbytes);
-        }
-    }
+    enqueue_encoded_frame(io, 0, buffer, nbytes);
 
-    debug_protocol("[%p/%u] sending DATA flags=%x hdr.datalen=%u",
-            stream->io, stream->stream_id, flags, (unsigned)hdr.datalen);
+    debug_protocol("[%p] sending GOAWAY last-stream=%u status=%s",
+            io, io->last_stream_id, cstringof(status));
 }
 
 void
@@ -177,9 +202,253 @@ spdy_send_ping(
     nbytes += spdy::ping_message::marshall(
             msg.ping, buffer + nbytes, sizeof(buffer) - nbytes);
 
-    TSIOBufferWrite(io->output.buffer, buffer, nbytes);
+    enqueue_encoded_frame(io, 0, buffer, nbytes);
 
     debug_protocol("[%p] sending PING id=%u", io, msg.ping.ping_id);
 }
 
+// Frames are marshalled into the staging buffer rather than straight into
+// the TSIOBuffer. That lets us compress a header block or DATA payload in
+// place and fill in the frame length afterwards, and it turns a batch of
+// frames into a single TSIOBufferWrite(). The exception is a DATA payload
+// that is still in the origin server's buffer blocks, which goes into the
+// output buffer by reference, between the staged frames.
+static void
+stage_syn_reply(
+        spdy_io_control *   io,
+        spdy_frame *        frame)
+{
+    union {
+        spdy::message_header hdr;
+        spdy::syn_reply_message syn;
+    } msg;
+
+    spdy::zstream<spdy::compress>& compressor = io->compressor();
+    size_t      fixed = spdy::message_header::size + io->codec->syn_reply_size;
+    size_t      bound = compressor.bound(frame->size);
+    uint8_t *   ptr = io->staging.prepare(fixed + bound);
+    size_t      nbytes;
+
+    nbytes = spdy::header_codec::deflate(compressor, frame->data(),
+            frame->size, ptr + fixed, bound);
+
+    msg.hdr.is_control = true;
+    msg.hdr.control.version = frame->version;
+    msg.hdr.control.type = spdy::CONTROL_SYN_REPLY;
+    msg.hdr.flags = 0;
+    msg.hdr.datalen = io->codec->syn_reply_size + nbytes;
+    spdy::message_header::marshall(msg.hdr, ptr, spdy::message_header::size);
+
+    msg.syn.stream_id = frame->stream_id;
+    spdy::syn_reply_message::marshall(frame->version, msg.syn,
+            ptr + spdy::message_header::size, io->codec->syn_reply_size);
+
+    io->staging.commit(fixed + nbytes);
+    debug_protocol("[%p/%u] sending %s hdr.datalen=%u",
+           io, frame->stream_id, cstringof(spdy::CONTROL_SYN_REPLY),
+           (unsigned)msg.hdr.datalen);
+}
+
+// Write out the staged frames.
+static void
+write_staged_frames(
+        spdy_io_control *   io)
+{
+    if (!io->staging.empty()) {
+        TSIOBufferWrite(io->output.buffer, io->staging.data(), io->staging.size());
+        io->staging.clear();
+    }
+}
+
+// Stage a DATA frame. If its payload is still in the origin server's
+// buffer blocks, the staged bytes are written out ahead of it. Return the
+// number of bytes that went into the output buffer, rather than staying in
+// the staging buffer.
+static size_t
+stage_data_frame(
+        spdy_io_control *   io,
+        spdy_frame *        frame)
+{
+    spdy::message_header    hdr;
+    size_t                  nbytes = frame->size;
+    uint8_t *               ptr;
+    ssize_t                 ret;
+
+    if (frame->flags & spdy::FLAG_COMPRESSED) {
+        spdy::zstream<spdy::compress>& compressor = io->compressor();
+        size_t bound = compressor.bound(frame->size);
+
+        ptr = io->staging.prepare(spdy::message_header::size + bound);
+        compressor.input(frame->data(), frame->size);
+        nbytes = 0;
+
+        do {
+            ret = compressor.consume(
+                    ptr + spdy::message_header::size + nbytes, bound - nbytes);
+            if (ret > 0) {
+                nbytes += ret;
+            }
+        } while (ret > 0 && nbytes < bound);
+    } else if (frame->payload) {
+        ptr = io->staging.prepare(spdy::message_header::size);
+    } else {
+        ptr = io->staging.prepare(spdy::message_header::size + nbytes);
+        if (nbytes) {
+            memcpy(ptr + spdy::message_header::size, frame->data(), nbytes);
+        }
+    }
+
+    io->queued_bytes.fetch_sub(frame->size, std::memory_order_relaxed);
+
+    hdr.is_control = false;
+    hdr.flags = frame->flags;
+    hdr.datalen = nbytes;
+    hdr.data.stream_id = frame->stream_id;
+    spdy::message_header::marshall(hdr, ptr, spdy::message_header::size);
+
+    debug_protocol("[%p/%u] sending DATA flags=%x hdr.datalen=%u",
+            io, frame->stream_id, frame->flags, (unsigned)hdr.datalen);
+
+    if (frame->payload && nbytes) {
+        // The frame header has to go into the output buffer first.
+        io->staging.commit(spdy::message_header::size);
+        nbytes += io->staging.size();
+        write_staged_frames(io);
+        TSIOBufferCopy(io->output.buffer, frame->payload->reader, frame->size, 0);
+        return nbytes;
+    }
+
+    io->staging.commit(spdy::message_header::size + nbytes);
+    return 0;
+}
+
+// Stage the DATA frames that a stream has waiting in the scheduler, ahead
+// of the frame that ends the stream. This ignores output_limit, but it is
+// bounded by what the stream had queued. Return the number of frames.
+static unsigned
+flush_stream_data(
+        spdy_io_control *   io,
+        unsigned            stream_id)
+{
+    spdy_frame * frame = io->scheduled.erase(stream_id);
+    unsigned count = 0;
+
+    try {
+        while (frame) {
+            spdy_frame * next = frame->next;
+
+            stage_data_frame(io, frame);
+            spdy_frame::destroy(frame);
+            frame = next;
+            ++count;
+        }
+    } catch (...) {
+        io->discard(frame);
+        throw;
+    }
+
+    return count;
+}
+
+void
+spdy_schedule_frames(
+        spdy_io_control *   io)
+{
+    spdy_frame * frame = io->outgoing.pop_all();
+
+    // Stage the control frames now and hand the DATA frames to the
+    // scheduler. A stream's SYN_REPLY is queued before its DATA, so it
+    // still goes out first. A RST_STREAM is queued after the stream's
+    // DATA, so the DATA is flushed ahead of it.
+    try {
+        while (frame) {
+            spdy_frame * next = frame->next;
+
+            switch (frame->type) {
+            case spdy_frame::frame_encoded:
+                if (frame->stream_id) {
+                    io->staged_frames += flush_stream_data(io, frame->stream_id);
+                }
+                io->staging.append(frame->data(), frame->size);
+                break;
+            case spdy_frame::frame_syn_reply:
+                stage_syn_reply(io, frame);
+                break;
+            case spdy_frame::frame_data:
+                frame->next = nullptr;
+                if (io->find_stream(frame->stream_id) == nullptr) {
+                    // The stream was reset or destroyed after it queued
+                    // this frame.
+                    debug_protocol("[%p/%u] dropping DATA for closed stream",
+                            io, frame->stream_id);
+                    io->discard(frame);
+                } else {
+                    io->scheduled.push(frame->stream_id, frame->priority, frame);
+                }
+                frame = next;
+                continue;
+            }
+
+            ++io->staged_frames;
+            spdy_frame::destroy(frame);
+            frame = next;
+        }
+    } catch (...) {
+        // Don't leak the frames we didn't get to.
+        io->discard(frame);
+        io->staging.clear();
+        io->staged_frames = 0;
+        throw;
+    }
+}
+
+unsigned
+spdy_write_frames(
+        spdy_io_control *   io)
+{
+    // Don't let a batch of big DATA frames grow the staging buffer, which
+    // lives as long as the session, without bound.
+    const size_t staging_limit = 64 * 1024;
+
+    unsigned count;
+    size_t buffered;
+
+    spdy_schedule_frames(io);
+    if (io->staging.empty() && io->scheduled.empty()) {
+        return 0;
+    }
+
+    count = io->staged_frames;
+    io->staged_frames = 0;
+
+    // Then draw DATA frames in priority order until the output buffer is
+    // full enough.
+    buffered = TSIOBufferReaderAvail(io->output.reader);
+    while (buffered + io->staging.size() < spdy_io_control::output_limit) {
+        std::unique_ptr<spdy_frame, void (*)(spdy_frame *)> data(
+                io->scheduled.pop(), spdy_frame::destroy);
+        if (!data) {
+            break;
+        }
+
+        buffered += stage_data_frame(io, data.get());
+        ++count;
+
+        if (io->staging.size() >= staging_limit) {
+            buffered += io->staging.size();
+            write_staged_frames(io);
+        }
+    }
+
+    write_staged_frames(io);
+
+    if (count) {
+        spdy_stat_increment(SPDY_STAT_FLUSHES);
+        spdy_stat_increment(SPDY_STAT_FLUSHED_FRAMES, count);
+        spdy_stat_max(SPDY_STAT_FLUSH_MAX_FRAMES, count);
+    }
+
+    return count;
+}
+
 /* vim: set sw=4 tw=79 ts=4 et ai : */
@@ -35,11 +35,42 @@ spdy_send_data_frame(
         const void *        ptr,
         size_t              nbytes);
 
+// Queue a DATA frame with the next nbytes from the reader, which may span
+// any number of buffer blocks, and consume them. The frame references the
+// buffer blocks, so the payload is never copied.
+void
+spdy_send_buffered_data_frame(
+        spdy_io_stream *    stream,
+        unsigned            flags,
+        TSIOBufferReader    reader,
+        size_t              nbytes);
+
+// Tell the client we are going away. The last stream ID is the last one
+// the client opened.
+void
+spdy_send_goaway(
+        spdy_io_control *       io,
+        spdy::protocol_version  version,
+        spdy::error             status);
+
 void
 spdy_send_ping(
         spdy_io_control *       io,
         spdy::protocol_version  version,
         unsigned                ping_id);
 
+// Take the queued frames, staging the control frames and handing the DATA
+// frames to the scheduler. Only the session continuation may call this.
+void
+spdy_schedule_frames(
+        spdy_io_control *   io);
+
+// Write every queued frame into the session output buffer, compressing
+// header blocks on the way. Only the session continuation may call this.
+// Return the number of frames written.
+unsigned
+spdy_write_frames(
+        spdy_io_control *   io);
+
 #endif /* PROTOCOL_H_46E29A3D_9EE6_4C4F_A355_FF42DE19EF18 */
 /* vim: set sw=4 ts=4 tw=79 et : */
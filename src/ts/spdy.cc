@@ -16,28 +16,60 @@
 
 #include <ts/ts.h>
 #include <spdy/spdy.h>
+#include <spdy/zpool.h>
 #include <base/logging.h>
 
 #include "io.h"
 #include "http.h"
 #include "protocol.h"
+#include "stats.h"
 
 #include <getopt.h>
+#include <stdlib.h>
 #include <limits>
+#include <vector>
+#include <algorithm>
+#include <inttypes.h>
 
 static bool use_system_resolver = false;
 
 static int spdy_vconn_io(TSCont, TSEvent, void *);
 
+// Count the times we hit one of the frame limits.
 static void
+count_limit(spdy::parse_status status)
+{
+    switch (status) {
+    case spdy::PARSE_FRAME_TOO_LARGE:
+        spdy_stat_increment(SPDY_STAT_LIMIT_FRAME_SIZE);
+        break;
+    case spdy::PARSE_HEADER_BLOCK_TOO_LARGE:
+        spdy_stat_increment(SPDY_STAT_LIMIT_HEADER_BYTES);
+        break;
+    case spdy::PARSE_TOO_MANY_HEADERS:
+        spdy_stat_increment(SPDY_STAT_LIMIT_HEADERS);
+        break;
+    default:
+        break;
+    }
+}
+
+// The recv_* functions return a parse_status for errors that are fatal to
+// the session. Stream errors are handled by resetting the stream.
+
+static spdy::parse_status
 recv_rst_stream(
         const spdy::message_header& header,
         spdy_io_control *           io,
         const uint8_t __restrict *  ptr)
 {
-    spdy::rst_stream_message rst;
+    spdy::rst_stream_message    rst;
+    spdy::parse_status          status;
 
-    rst = spdy::rst_stream_message::parse(ptr, header.datalen);
+    status = spdy::rst_stream_message::try_parse(ptr, io->frames.payload_size(), rst);
+    if (status != spdy::PARSE_OK) {
+        return status;
+    }
 
     debug_protocol("[%p/%u] received %s frame stream=%u status_code=%s (%u)",
             io, rst.stream_id,
@@ -45,18 +77,23 @@ recv_rst_stream(
             cstringof((spdy::error)rst.status_code), rst.status_code);
 
     io->destroy_stream(rst.stream_id);
+    return spdy::PARSE_OK;
 }
 
-static void
+static spdy::parse_status
 recv_syn_stream(
         const spdy::message_header& header,
         spdy_io_control *           io,
         const uint8_t __restrict *  ptr)
 {
     spdy::syn_stream_message    syn;
+    spdy::parse_status          status;
     spdy_io_stream *            stream;
 
-    syn = spdy::syn_stream_message::parse(ptr, header.datalen);
+    status = spdy::syn_stream_message::try_parse(ptr, io->frames.payload_size(), syn);
+    if (status != spdy::PARSE_OK) {
+        return status;
+    }
 
     debug_protocol(
             "[%p/%u] received %s frame stream=%u associated=%u priority=%u",
@@ -68,94 +105,158 @@ recv_syn_stream(
         debug_protocol("[%p/%u] invalid stream-id %u",
                 io, syn.stream_id, syn.stream_id);
         spdy_send_reset_stream(io, syn.stream_id, spdy::PROTOCOL_ERROR);
-        return;
+        return spdy::PARSE_OK;
     }
 
-    switch (header.control.version) {
-    case spdy::PROTOCOL_VERSION_2: // fallthru
-    case spdy::PROTOCOL_VERSION_3: break;
-    default:
+    // Bind the session to the protocol version of its first stream. All
+    // the streams in a session share the header compression state, so
+    // they have to agree on the version.
+    if (io->codec == nullptr) {
+        io->codec = spdy::header_codec::get(header.control.version);
+    }
+
+    if (io->codec == nullptr || io->codec->version != header.control.version) {
         debug_protocol("[%p/%u] bad protocol version %d",
                 io, syn.stream_id, header.control.version);
-        spdy_send_reset_stream(io, syn.stream_id, spdy::PROTOCOL_ERROR);
-        return;
+        spdy_send_reset_stream(io, syn.stream_id, spdy::UNSUPPORTED_VERSION);
+        return spdy::PARSE_OK;
     }
 
-    spdy::key_value_block kvblock(
-            spdy::key_value_block::parse(
-                    (spdy::protocol_version)header.control.version,
-                    io->decompressor,
-                    ptr + spdy::syn_stream_message::size,
-                    header.datalen - spdy::syn_stream_message::size)
-    );
-
     if ((stream = io->create_stream(syn.stream_id)) == 0) {
         debug_protocol("[%p/%u] failed to create stream %u",
                 io, syn.stream_id, syn.stream_id);
         spdy_send_reset_stream(io, syn.stream_id, spdy::INVALID_STREAM);
-        return;
+        return spdy::PARSE_OK;
     }
 
     stream->io = io;
     stream->version = (spdy::protocol_version)header.control.version;
+    stream->request.version = stream->version;
+    stream->priority = syn.priority;
+
+    // Decode the header block straight into the stream's HTTP request. The
+    // frame reader already decompressed it.
+    status = io->codec->parse(
+            io->frames.header_block(),
+            io->frames.header_block_size(),
+            std::ref(stream->request),
+            spdy_io_control::limits.max_headers);
+
+    if (status != spdy::PARSE_OK) {
+        debug_protocol("[%p/%u] bad header block: %s",
+                io, stream->stream_id, cstringof(status));
+        count_limit(status);
+        spdy_send_reset_stream(io, stream->stream_id, spdy::PROTOCOL_ERROR);
+        io->destroy_stream(stream->stream_id);
+        return spdy::PARSE_OK;
+    }
 
-    if (!kvblock.url().is_complete()) {
-        debug_protocol("[%p/%u] incomplete URL", io, stream->stream_id);
+    if (!stream->request.finish()) {
+        debug_protocol("[%p/%u] incomplete URL or malformed headers",
+                io, stream->stream_id);
         // 3.2.1; missing URL, protocol error; 400 Bad Request
         http_send_error(stream, TS_HTTP_STATUS_BAD_REQUEST);
         spdy_send_reset_stream(io, stream->stream_id, spdy::CANCEL);
         io->destroy_stream(stream->stream_id);
-        return;
+        return spdy::PARSE_OK;
     }
 
+    // The stream starts at the end of this event, when all the streams
+    // that arrived together can be started in priority order.
+    io->queue_stream(stream);
+    return spdy::PARSE_OK;
+}
+
+// Start the origin requests of queued streams, highest priority first,
+// while the session has free origin request slots.
+static void
+dispatch_spdy_streams(spdy_io_control * io)
+{
     spdy_io_stream::open_options options = spdy_io_stream::open_none;
     if (use_system_resolver) {
         options = spdy_io_stream::open_with_system_resolver;
     }
 
-    std::lock_guard<spdy_io_stream::lock_type> lk(stream->lock);
-    if (!stream->open(kvblock, options)) {
-        io->destroy_stream(stream->stream_id);
+    while (!io->pending.empty()) {
+        if (spdy_io_control::max_in_flight &&
+                io->in_flight.load() >= spdy_io_control::max_in_flight) {
+            break;
+        }
+
+        unsigned stream_id = io->pending.pop();
+        io->npending.fetch_sub(1);
+
+        // The client might have reset the stream while it was waiting.
+        spdy_io_stream * stream = io->find_stream(stream_id);
+        if (stream == nullptr) {
+            continue;
+        }
+
+        // Take the slot before the stream can finish on another thread.
+        bool opened;
+        {
+            scoped_stream_lock lk(stream);
+            stream->dispatched = true;
+            io->in_flight.fetch_add(1);
+            opened = stream->open(options);
+            if (!opened) {
+                stream->dispatched = false;
+                io->in_flight.fetch_sub(1);
+            }
+        }
+
+        // Destroying the stream takes the stream lock, so we must not be
+        // holding it.
+        if (!opened) {
+            io->destroy_stream(stream->stream_id);
+        }
     }
 }
 
-static void
+static spdy::parse_status
 recv_ping(
         const spdy::message_header& header,
         spdy_io_control *           io,
         const uint8_t __restrict *  ptr)
 {
-    spdy::ping_message ping;
+    spdy::ping_message  ping;
+    spdy::parse_status  status;
 
-    ping = spdy::ping_message::parse(ptr, header.datalen);
+    status = spdy::ping_message::try_parse(ptr, io->frames.payload_size(), ping);
+    if (status != spdy::PARSE_OK) {
+        return status;
+    }
 
     debug_protocol("[%p] received PING id=%u", io, ping.ping_id);
 
     // Client must send even ping-ids. Ignore the odd ones since
     // we never send them.
     if ((ping.ping_id % 2) == 0) {
-        return;
+        return spdy::PARSE_OK;
     }
 
     spdy_send_ping(io, (spdy::protocol_version)header.control.version, ping.ping_id);
+    return spdy::PARSE_OK;
 }
 
-static void
+static spdy::parse_status
 dispatch_spdy_control_frame(
         const spdy::message_header& header,
         spdy_io_control *           io,
         const uint8_t __restrict *  ptr)
 {
+    spdy::parse_status status = spdy::PARSE_OK;
+
     switch (header.control.type) {
     case spdy::CONTROL_SYN_STREAM:
-        recv_syn_stream(header, io, ptr);
+        status = recv_syn_stream(header, io, ptr);
         break;
     case spdy::CONTROL_SYN_REPLY:
     case spdy::CONTROL_RST_STREAM:
-        recv_rst_stream(header, io, ptr);
+        status = recv_rst_stream(header, io, ptr);
         break;
     case spdy::CONTROL_PING:
-        recv_ping(header, io, ptr);
+        status = recv_ping(header, io, ptr);
         break;
     case spdy::CONTROL_SETTINGS:
     case spdy::CONTROL_GOAWAY:
@@ -171,100 +272,200 @@ dispatch_spdy_control_frame(
         TSError("[spdy] ignoring invalid control frame type %u", header.control.type);
     }
 
-    io->reenable();
+    return status;
 }
 
-static size_t
-count_bytes_available(
-        TSIOBuffer          buffer,
-        TSIOBufferReader    reader)
+static spdy::parse_status
+dispatch_spdy_frame(spdy_io_control * io)
 {
-    TSIOBufferBlock block;
-    size_t count = 0;
-
-    block = TSIOBufferStart(buffer);
-    while (block) {
-        const char * ptr;
-        int64_t nbytes;
+    const spdy::message_header& header(io->frames.header());
 
-        ptr = TSIOBufferBlockReadStart(block, reader, &nbytes);
-        if (ptr && nbytes) {
-            count += nbytes;
+    if (header.is_control) {
+        if (spdy::header_codec::get(header.control.version) == nullptr) {
+            TSError("[spdy] client is version %u, but we implement versions %u and %u",
+                header.control.version, spdy::PROTOCOL_VERSION_2,
+                spdy::PROTOCOL_VERSION_3);
         }
 
-        block = TSIOBufferBlockNext(block);
+        return dispatch_spdy_control_frame(header, io, io->frames.payload());
     }
 
-    return count;
+    debug_protocol("[%p] SPDY data frame, stream=%u flags=0x%x, %u bytes",
+        io, header.data.stream_id, header.flags, header.datalen);
+    TSError("[spdy] no data frame support yet");
+    return spdy::PARSE_OK;
 }
 
+// The client sent something we can't make sense of. Send GOAWAY and stop
+// reading; the streams we already have can still finish.
 static void
-consume_spdy_frame(spdy_io_control * io)
+drop_spdy_session(spdy_io_control * io, spdy::parse_status status)
 {
-    spdy::message_header    header;
-    TSIOBufferBlock         blk;
-    const uint8_t *         ptr;
-    int64_t                 nbytes;
+    const spdy::message_header& header(io->frames.header());
+    spdy::protocol_version      version = spdy::PROTOCOL_VERSION_3;
 
-next_frame:
+    TSError("[spdy] dropping session %p: %s in %s frame", io,
+            cstringof(status), header.is_control ?
+                cstringof(header.control.type) : "DATA");
 
-    blk = TSIOBufferReaderStart(io->input.reader);
-    ptr = (const uint8_t *)TSIOBufferBlockReadStart(blk, io->input.reader, &nbytes);
-    if (!ptr) {
-        // This should not fail because we only try to consume the header when
-        // there are enough bytes to read the header. Experimentally, however,
-        // it does fail. I wonder why.
-        TSError("TSIOBufferBlockReadStart failed unexpectedly");
-        return;
+    // Answer in the client's version, if it is one we know.
+    if (header.is_control && header.control.version == spdy::PROTOCOL_VERSION_2) {
+        version = spdy::PROTOCOL_VERSION_2;
     }
 
-    if (nbytes < spdy::message_header::size) {
-        // We should never get here, because we check for space before
-        // entering. Unfortunately this does happen :(
-        debug_plugin("short read %" PRId64 " bytes, expected at least %u, real count %zu",
-                nbytes, spdy::message_header::size,
-                count_bytes_available(io->input.buffer, io->input.reader));
+    count_limit(status);
+
+    io->closing = true;
+    spdy_send_goaway(io, version, spdy::PROTOCOL_ERROR);
+    TSVConnShutdown(io->vconn, 1 /* read */, 0 /* write */);
+}
+
+static void
+consume_spdy_frames(spdy_io_control * io)
+{
+    TSIOBufferBlock blk;
+    int64_t         consumed = 0;
+
+    if (io->closing) {
+        io->input.consume(TSIOBufferReaderAvail(io->input.reader));
         return;
     }
 
-    header = spdy::message_header::parse(ptr, (size_t)nbytes);
-    TSAssert(header.datalen > 0); // XXX
+    // Feed every block we have to the frame reader. Frames can start and
+    // end anywhere, so one block can finish one frame and hold any number
+    // of following frames, and the reader picks up where it left off the
+    // next time we get more data.
+    blk = TSIOBufferReaderStart(io->input.reader);
+    while (blk) {
+        const uint8_t * ptr;
+        int64_t         nbytes;
+
+        ptr = (const uint8_t *)TSIOBufferBlockReadStart(blk, io->input.reader, &nbytes);
+        while (ptr && nbytes > 0) {
+            size_t count = io->frames.consume(ptr, nbytes);
+
+            ptr += count;
+            nbytes -= count;
+            consumed += count;
+
+            if (io->frames.failed()) {
+                drop_spdy_session(io, io->frames.status());
+                break;
+            }
+
+            if (io->frames.complete()) {
+                spdy::parse_status status = dispatch_spdy_frame(io);
+                if (status != spdy::PARSE_OK) {
+                    drop_spdy_session(io, status);
+                    break;
+                }
+            }
+        }
 
-    if (header.is_control) {
-        if (header.control.version != spdy::PROTOCOL_VERSION) {
-            TSError("[spdy] client is version %u, but we implement version %u",
-                header.control.version, spdy::PROTOCOL_VERSION);
+        if (io->closing) {
+            io->input.consume(TSIOBufferReaderAvail(io->input.reader));
+            return;
         }
-    } else {
-        debug_protocol("[%p] SPDY data frame, stream=%u flags=0x%x, %u bytes",
-            io, header.data.stream_id, header.flags, header.datalen);
+
+        blk = TSIOBufferBlockNext(blk);
     }
 
-    if (header.datalen >= spdy::MAX_FRAME_LENGTH) {
-        // XXX puke
+    // The frame reader keeps whatever it needs, so we can let go of
+    // everything we read.
+    io->input.consume(consumed);
+}
+
+// Schedule the paused streams to resume reading from the origin server,
+// highest priority first.
+static void
+resume_spdy_streams(spdy_io_control * io)
+{
+    std::vector<spdy_io_stream *> streams;
+
+    for (spdy_io_stream * stream = io->paused.pop_all(); stream; ) {
+        spdy_io_stream * next = stream->next;
+        streams.push_back(stream);
+        stream = next;
     }
 
-    if (header.datalen <= (nbytes - spdy::message_header::size)) {
-        // We have all the data in-hand ... parse it.
-        io->input.consume(spdy::message_header::size);
-        io->input.consume(header.datalen);
+    std::stable_sort(streams.begin(), streams.end(),
+        [](const spdy_io_stream * lhs, const spdy_io_stream * rhs) {
+            return lhs->priority < rhs->priority;
+        });
 
-        ptr += spdy::message_header::size;
+    // Each stream already holds the references that the event releases.
+    for (auto ptr(streams.begin()); ptr != streams.end(); ++ptr) {
+        TSContSchedule((*ptr)->continuation, 0, TS_THREAD_POOL_DEFAULT);
+    }
+}
 
-        if (header.is_control) {
-            dispatch_spdy_control_frame(header, io, ptr);
-        } else {
-            TSError("[spdy] no data frame support yet");
+// Throttle the streams when the session has more than buffer_high bytes of
+// DATA queued or buffered, and resume them once it drains below buffer_low.
+static void
+update_spdy_backpressure(spdy_io_control * io)
+{
+    int64_t buffered = io->queued_bytes.load(std::memory_order_relaxed) +
+        TSIOBufferReaderAvail(io->output.reader);
+
+    spdy_stat_increment(SPDY_STAT_SESSION_BUFFERED_BYTES, buffered - io->buffered);
+    spdy_stat_max(SPDY_STAT_SESSION_BUFFERED_MAX, buffered);
+    io->buffered = buffered;
+
+    if (buffered >= (int64_t)spdy_io_control::buffer_high) {
+        if (!io->throttled.load()) {
+            debug_protocol("[%p] throttling streams, %" PRId64 " bytes buffered",
+                    io, buffered);
+            spdy_stat_increment(SPDY_STAT_SESSION_THROTTLED);
+            io->throttled.store(true);
         }
 
-        if (TSIOBufferReaderAvail(io->input.reader) >= spdy::message_header::size) {
-            goto next_frame;
+        return;
+    }
+
+    if (io->throttled.load()) {
+        if (buffered > (int64_t)spdy_io_control::buffer_low) {
+            return;
         }
+
+        debug_protocol("[%p] resuming streams, %" PRId64 " bytes buffered",
+                io, buffered);
+        io->throttled.store(false);
+    }
+
+    // Pairs with the fence in pause_stream().
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!io->paused.empty()) {
+        resume_spdy_streams(io);
+    }
+}
+
+static void
+close_spdy_session(spdy_io_control * io)
+{
+    TSVConnClose(io->vconn);
+
+    // Nobody is going to drain the session now, so let the paused streams
+    // finish. They hold references on the session.
+    io->throttled.store(false);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    resume_spdy_streams(io);
+
+    release(io);
+}
+
+// Start any streams that are waiting for an origin request slot, then
+// write every frame that was queued while the session handled an event
+// with one TSIOBufferWrite(), and reenable the write VIO at most once.
+static void
+flush_spdy_session(spdy_io_control * io, bool reenable)
+{
+    dispatch_spdy_streams(io);
+    io->end_event();
+    if (spdy_write_frames(io) && reenable) {
+        io->reenable();
     }
 
-    // Push the high water mark to the end of the frame so that we don't get
-    // called back until we have the whole thing.
-    io->input.watermark(spdy::message_header::size + header.datalen);
+    update_spdy_backpressure(io);
 }
 
 static int
@@ -286,17 +487,32 @@ spdy_vconn_io(TSCont contp, TSEvent ev, void * edata)
         io = spdy_io_control::get(contp);
         nbytes = TSIOBufferReaderAvail(io->input.reader);
         debug_plugin("received %d bytes", nbytes);
-        if ((unsigned)nbytes >= spdy::message_header::size) {
-            consume_spdy_frame(io);
+
+        // Frame parsing doesn't throw, but building replies can. Don't let
+        // that unwind into ATS.
+        io->begin_event();
+        try {
+            consume_spdy_frames(io);
+            flush_spdy_session(io, true);
+        } catch (const std::exception& ex) {
+            TSError("[spdy] dropping session %p: %s", io, ex.what());
+            close_spdy_session(io);
         }
 
-        // XXX frame parsing can throw. If it does, best to catch it, log it
-        // and drop the connection.
         break;
     case TS_EVENT_VCONN_WRITE_READY:
     case TS_EVENT_VCONN_WRITE_COMPLETE:
-        // No need to handle write events. We have already pushed all the data
-        // we have into the write buffer.
+        // Write the frames that the streams queued. The write VIO is
+        // running, so it picks them up without a reenable.
+        io = spdy_io_control::get(contp);
+        io->begin_event();
+        try {
+            flush_spdy_session(io, false);
+        } catch (const std::exception& ex) {
+            TSError("[spdy] dropping session %p: %s", io, ex.what());
+            close_spdy_session(io);
+        }
+
         break;
     case TS_EVENT_VCONN_EOS: // fallthru
     default:
@@ -304,13 +520,21 @@ spdy_vconn_io(TSCont contp, TSEvent ev, void * edata)
             debug_plugin("unexpected accept event %s", cstringof(ev));
         }
         io = spdy_io_control::get(contp);
-        TSVConnClose(io->vconn);
-        release(io);
+        close_spdy_session(io);
     }
 
     return TS_EVENT_NONE;
 }
 
+static void
+update_zpool_stats()
+{
+    spdy::zpool::statistics zstats(spdy::zpool::stats());
+
+    spdy_stat_set(SPDY_STAT_ZLIB_POOL_HITS, zstats.hits);
+    spdy_stat_set(SPDY_STAT_ZLIB_POOL_MISSES, zstats.misses);
+}
+
 static int
 spdy_accept_io(TSCont contp, TSEvent ev, void * edata)
 {
@@ -322,10 +546,10 @@ spdy_accept_io(TSCont contp, TSEvent ev, void * edata)
     switch (ev) {
     case TS_EVENT_NET_ACCEPT:
         io = retain(new spdy_io_control(vconn));
-        io->input.watermark(spdy::message_header::size);
         io->output.watermark(spdy::message_header::size);
+        update_zpool_stats();
         // XXX is contp leaked here?
-        contp = TSContCreate(spdy_vconn_io, TSMutexCreate());
+        contp = TSContCreate(spdy_vconn_io, io->mutex);
         TSContDataSet(contp, io);
         read_vio = TSVConnRead(vconn, contp, io->input.buffer, std::numeric_limits<int64_t>::max());
         write_vio = TSVConnWrite(vconn, contp, io->output.reader, std::numeric_limits<int64_t>::max());
@@ -338,15 +562,50 @@ spdy_accept_io(TSCont contp, TSEvent ev, void * edata)
     return TS_EVENT_NONE;
 }
 
+// Parse an integer option in the range [min, max]. Leave the value alone
+// and complain if the argument is not valid.
+static void
+parse_int_option(const char * name, const char * arg, int min, int max, int& val)
+{
+    char *  end;
+    long    tmp;
+
+    tmp = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || tmp < min || tmp > max) {
+        TSError("[spdy] invalid --%s value '%s', expected %d..%d",
+                name, arg, min, max);
+        return;
+    }
+
+    val = (int)tmp;
+}
+
 extern "C" void
 TSPluginInit(int argc, const char * argv[])
 {
     static const struct option longopts[] = {
         { "system-resolver", no_argument, NULL, 's' },
+        { "zlib-level", required_argument, NULL, 'l' },
+        { "zlib-window-bits", required_argument, NULL, 'w' },
+        { "zlib-mem-level", required_argument, NULL, 'm' },
+        { "max-frame-size", required_argument, NULL, 'F' },
+        { "max-header-bytes", required_argument, NULL, 'B' },
+        { "max-headers", required_argument, NULL, 'H' },
+        { "stream-arena-size", required_argument, NULL, 'A' },
+        { "stream-pool-size", required_argument, NULL, 'P' },
+        { "shared-session-mutex", no_argument, NULL, 'M' },
+        { "session-output-limit", required_argument, NULL, 'O' },
+        { "max-origin-requests", required_argument, NULL, 'R' },
+        { "session-buffer-high", required_argument, NULL, 'W' },
+        { "session-buffer-low", required_argument, NULL, 'L' },
+        { "data-frame-size", required_argument, NULL, 'D' },
+        { "data-flush-delay", required_argument, NULL, 'T' },
         { NULL, 0, NULL, 0 }
     };
 
     TSPluginRegistrationInfo info;
+    spdy::frame_limits& limits = spdy_io_control::limits;
+    int val;
 
     info.plugin_name = (char *)"spdy";
     info.vendor_name = (char *)"James Peach";
@@ -357,20 +616,134 @@ TSPluginInit(int argc, const char * argv[])
     }
 
     debug_plugin("initializing");
+    spdy_stats_init();
 
     for (;;) {
         switch (getopt_long(argc, (char * const *)argv, "s", longopts, NULL)) {
         case 's':
             use_system_resolver = true;
             break;
+        case 'l':
+            parse_int_option("zlib-level", optarg, -1, 9,
+                    spdy_io_control::compression.level);
+            break;
+        case 'w':
+            parse_int_option("zlib-window-bits", optarg, 9, 15,
+                    spdy_io_control::compression.window_bits);
+            break;
+        case 'm':
+            parse_int_option("zlib-mem-level", optarg, 1, 9,
+                    spdy_io_control::compression.mem_level);
+            break;
+        case 'F':
+            val = limits.max_frame_size;
+            parse_int_option("max-frame-size", optarg, 0,
+                    spdy::MAX_FRAME_LENGTH - 1, val);
+            limits.max_frame_size = val;
+            break;
+        case 'B':
+            val = limits.max_header_bytes;
+            parse_int_option("max-header-bytes", optarg, 0,
+                    std::numeric_limits<int>::max(), val);
+            limits.max_header_bytes = val;
+            break;
+        case 'H':
+            val = limits.max_headers;
+            parse_int_option("max-headers", optarg, 0,
+                    std::numeric_limits<int>::max(), val);
+            limits.max_headers = val;
+            break;
+        case 'A':
+            val = spdy_io_stream::arena_size;
+            parse_int_option("stream-arena-size", optarg, 256,
+                    std::numeric_limits<int>::max(), val);
+            spdy_io_stream::arena_size = val;
+            break;
+        case 'P':
+            val = spdy_io_stream::pool_size;
+            parse_int_option("stream-pool-size", optarg, 0,
+                    std::numeric_limits<int>::max(), val);
+            spdy_io_stream::pool_size = val;
+            break;
+        case 'M':
+            spdy_io_control::shared_mutex = true;
+            break;
+        case 'O':
+            val = spdy_io_control::output_limit;
+            parse_int_option("session-output-limit", optarg, 1,
+                    std::numeric_limits<int>::max(), val);
+            spdy_io_control::output_limit = val;
+            break;
+        case 'R':
+            val = spdy_io_control::max_in_flight;
+            parse_int_option("max-origin-requests", optarg, 0,
+                    std::numeric_limits<int>::max(), val);
+            spdy_io_control::max_in_flight = val;
+            break;
+        case 'W':
+            val = spdy_io_control::buffer_high;
+            parse_int_option("session-buffer-high", optarg, 1,
+                    std::numeric_limits<int>::max(), val);
+            spdy_io_control::buffer_high = val;
+            break;
+        case 'L':
+            val = spdy_io_control::buffer_low;
+            parse_int_option("session-buffer-low", optarg, 0,
+                    std::numeric_limits<int>::max(), val);
+            spdy_io_control::buffer_low = val;
+            break;
+        case 'D':
+            val = spdy_io_stream::data_frame_size;
+            parse_int_option("data-frame-size", optarg, 1,
+                    spdy::MAX_FRAME_LENGTH - 1, val);
+            spdy_io_stream::data_frame_size = val;
+            break;
+        case 'T':
+            val = spdy_io_stream::data_flush_delay;
+            parse_int_option("data-flush-delay", optarg, 0,
+                    std::numeric_limits<int>::max(), val);
+            spdy_io_stream::data_flush_delay = val;
+            break;
         case -1:
             goto init;
         default:
-            TSError("[spdy] usage: spdy.so [--system-resolver]");
+            TSError("[spdy] usage: spdy.so [--system-resolver] "
+                    "[--zlib-level=N] [--zlib-window-bits=N] "
+                    "[--zlib-mem-level=N] [--max-frame-size=N] "
+                    "[--max-header-bytes=N] [--max-headers=N] "
+                    "[--stream-arena-size=N] [--stream-pool-size=N] "
+                    "[--shared-session-mutex] [--session-output-limit=N] "
+                    "[--max-origin-requests=N] [--session-buffer-high=N] "
+                    "[--session-buffer-low=N] [--data-frame-size=N] "
+                    "[--data-flush-delay=N]");
         }
     }
 
 init:
+    debug_plugin("header compression level=%d window-bits=%d mem-level=%d",
+            spdy_io_control::compression.level,
+            spdy_io_control::compression.window_bits,
+            spdy_io_control::compression.mem_level);
+    debug_plugin("limits max-frame-size=%u max-header-bytes=%u max-headers=%u",
+            limits.max_frame_size, limits.max_header_bytes,
+            limits.max_headers);
+    debug_plugin("stream arena size=%zu pool size=%zu data frame size=%zu "
+            "flush delay=%ums", spdy_io_stream::arena_size,
+            spdy_io_stream::pool_size, spdy_io_stream::data_frame_size,
+            spdy_io_stream::data_flush_delay);
+    if (spdy_io_control::buffer_low > spdy_io_control::buffer_high) {
+        TSError("[spdy] --session-buffer-low is above --session-buffer-high, "
+                "using %zu", spdy_io_control::buffer_high);
+        spdy_io_control::buffer_low = spdy_io_control::buffer_high;
+    }
+
+    debug_plugin("session output limit=%zu max origin requests=%u",
+            spdy_io_control::output_limit, spdy_io_control::max_in_flight);
+    debug_plugin("session buffer high=%zu low=%zu",
+            spdy_io_control::buffer_high, spdy_io_control::buffer_low);
+    debug_plugin("stream continuations use %s mutex",
+            spdy_io_control::shared_mutex ? "the session" : "a per-stream");
+
     TSReleaseAssert(
         TSNetAcceptNamedProtocol(TSContCreate(spdy_accept_io, TSMutexCreate()),
         TS_NPN_PROTOCOL_SPDY_2) == TS_SUCCESS);
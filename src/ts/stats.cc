@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2012 James Peach
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <ts/ts.h>
+#include <base/logging.h>
+#include "stats.h"
+
+#include <atomic>
+
+static const detail::named_value<unsigned> stat_names[] =
+{
+    { "proxy.process.spdy.zlib.pool.hits", SPDY_STAT_ZLIB_POOL_HITS },
+    { "proxy.process.spdy.zlib.pool.misses", SPDY_STAT_ZLIB_POOL_MISSES },
+    { "proxy.process.spdy.limits.frame_size", SPDY_STAT_LIMIT_FRAME_SIZE },
+    { "proxy.process.spdy.limits.header_bytes", SPDY_STAT_LIMIT_HEADER_BYTES },
+    { "proxy.process.spdy.limits.headers", SPDY_STAT_LIMIT_HEADERS },
+    { "proxy.process.spdy.stream.arena.high_water", SPDY_STAT_ARENA_HIGH_WATER },
+    { "proxy.process.spdy.stream.pool.hits", SPDY_STAT_STREAM_POOL_HITS },
+    { "proxy.process.spdy.stream.pool.misses", SPDY_STAT_STREAM_POOL_MISSES },
+    { "proxy.process.spdy.session.flushes", SPDY_STAT_FLUSHES },
+    { "proxy.process.spdy.session.flushed_frames", SPDY_STAT_FLUSHED_FRAMES },
+    { "proxy.process.spdy.session.flush_max_frames", SPDY_STAT_FLUSH_MAX_FRAMES },
+    { "proxy.process.spdy.session.buffered_bytes", SPDY_STAT_SESSION_BUFFERED_BYTES },
+    { "proxy.process.spdy.session.buffered_max", SPDY_STAT_SESSION_BUFFERED_MAX },
+    { "proxy.process.spdy.session.throttled", SPDY_STAT_SESSION_THROTTLED },
+};
+
+static int stat_ids[SPDY_STAT_MAX];
+
+// TSStat has no maximum aggregation, so we track it here.
+static std::atomic<int64_t> stat_maxima[SPDY_STAT_MAX];
+
+void
+spdy_stats_init()
+{
+    static_assert(sizeof(stat_names) / sizeof(stat_names[0]) == SPDY_STAT_MAX,
+            "missing statistic names");
+
+    for (unsigned i = 0; i < countof(stat_names); ++i) {
+        stat_ids[stat_names[i].value] = TSStatCreate(stat_names[i].name,
+                TS_RECORDDATATYPE_INT, TS_STAT_NON_PERSISTENT,
+                TS_STAT_SYNC_SUM);
+    }
+}
+
+void
+spdy_stat_increment(spdy_stat_type stat, int64_t amount)
+{
+    TSStatIntIncrement(stat_ids[stat], amount);
+}
+
+void
+spdy_stat_set(spdy_stat_type stat, int64_t value)
+{
+    TSStatIntSet(stat_ids[stat], value);
+}
+
+void
+spdy_stat_max(spdy_stat_type stat, int64_t value)
+{
+    int64_t current = stat_maxima[stat].load(std::memory_order_relaxed);
+
+    while (value > current) {
+        if (stat_maxima[stat].compare_exchange_weak(current, value)) {
+            TSStatIntSet(stat_ids[stat], value);
+            return;
+        }
+    }
+}
+
+/* vim: set sw=4 ts=4 tw=79 et : */
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2012 James Peach
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef STATS_H_8A0E5C63_47D1_4B2F_9C1E_5D3B7F20A6E4
+#define STATS_H_8A0E5C63_47D1_4B2F_9C1E_5D3B7F20A6E4
+
+// Plugin statistics. These are published as proxy.process.spdy.* records.
+enum spdy_stat_type : unsigned {
+    SPDY_STAT_ZLIB_POOL_HITS,
+    SPDY_STAT_ZLIB_POOL_MISSES,
+    SPDY_STAT_LIMIT_FRAME_SIZE,
+    SPDY_STAT_LIMIT_HEADER_BYTES,
+    SPDY_STAT_LIMIT_HEADERS,
+    SPDY_STAT_ARENA_HIGH_WATER,
+    SPDY_STAT_STREAM_POOL_HITS,
+    SPDY_STAT_STREAM_POOL_MISSES,
+    SPDY_STAT_FLUSHES,
+    SPDY_STAT_FLUSHED_FRAMES,
+    SPDY_STAT_FLUSH_MAX_FRAMES,
+    SPDY_STAT_SESSION_BUFFERED_BYTES,
+    SPDY_STAT_SESSION_BUFFERED_MAX,
+    SPDY_STAT_SESSION_THROTTLED,
+    SPDY_STAT_MAX
+};
+
+// Register the plugin statistics. Must be called from TSPluginInit().
+void spdy_stats_init();
+
+void spdy_stat_increment(spdy_stat_type, int64_t = 1);
+void spdy_stat_set(spdy_stat_type, int64_t);
+
+// Raise the statistic to the given value if it is lower.
+void spdy_stat_max(spdy_stat_type, int64_t);
+
+#endif /* STATS_H_8A0E5C63_47D1_4B2F_9C1E_5D3B7F20A6E4 */
+/* vim: set sw=4 ts=4 tw=79 et : */
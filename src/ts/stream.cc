@@ -21,9 +21,12 @@
 #include "io.h"
 #include "protocol.h"
 #include "http.h"
+#include "stats.h"
 
 #include <netdb.h>
+#include <pthread.h>
 #include <limits>
+#include <vector>
 
 // NOTE: Reference counting SPDY streams.
 //
@@ -67,10 +70,11 @@ initiate_client_request(
 {
     TSReleaseAssert(stream->vconn == nullptr);
 
+    stream->create_io_buffers();
     stream->vconn = TSHttpConnect(addr);
     if (stream->vconn) {
-        TSVConnRead(stream->vconn, contp, stream->input.buffer, std::numeric_limits<int64_t>::max());
-        TSVConnWrite(stream->vconn, contp, stream->output.reader, std::numeric_limits<int64_t>::max());
+        TSVConnRead(stream->vconn, contp, stream->input->buffer, std::numeric_limits<int64_t>::max());
+        TSVConnWrite(stream->vconn, contp, stream->output->reader, std::numeric_limits<int64_t>::max());
     }
 
     return true;
@@ -80,19 +84,18 @@ static bool
 write_http_request(spdy_io_stream * stream)
 {
     spdy_io_buffer      iobuf;
-    scoped_mbuffer      buffer;
-    scoped_http_header  header(buffer.get(), stream->kvblock);
+    http_request&       request(stream->request);
     int64_t             nwritten = 0;
 
-    if (!header) {
+    if (!request.header) {
         return false;
     }
 
-    debug_http_header(stream, buffer.get(), header);
+    debug_http_header(stream, request.mbuffer.get(), request.header);
 
     // XXX Surely there's a better way to send the HTTP headers than forcing
     // ATS to reparse what we already have in pre-parsed form?
-    TSHttpHdrPrint(buffer.get(), header, iobuf.buffer);
+    TSHttpHdrPrint(request.mbuffer.get(), request.header, iobuf.buffer);
 
     TSIOBufferBlock blk = TSIOBufferReaderStart(iobuf.reader);
     while (blk) {
@@ -104,14 +107,14 @@ write_http_request(spdy_io_stream * stream)
             goto next;
         }
 
-        nwritten += TSIOBufferWrite(stream->output.buffer, ptr, nbytes);
+        nwritten += TSIOBufferWrite(stream->output->buffer, ptr, nbytes);
 
 next:
         blk = TSIOBufferBlockNext(blk);
     }
 
     // XXX is this needed?
-    TSIOBufferProduce(stream->output.buffer, nwritten);
+    TSIOBufferProduce(stream->output->buffer, nwritten);
     return true;
 }
 
@@ -121,10 +124,10 @@ read_http_headers(spdy_io_stream * stream)
     if (TSIsDebugTagSet("spdy.http")) {
         debug_http("[%p/%u] received %" PRId64 " header bytes",
                 stream, stream->stream_id,
-                TSIOBufferReaderAvail(stream->input.reader));
+                TSIOBufferReaderAvail(stream->input->reader));
     }
 
-    if (stream->hparser.parse(stream->input.reader) < 0) {
+    if (stream->hparser->parse(stream->input->reader) < 0) {
         // XXX handle header parsing error
         return false;
     }
@@ -132,6 +135,32 @@ read_http_headers(spdy_io_stream * stream)
     return true;
 }
 
+// Forward the buffered response body. Once it is complete, the last DATA
+// frame carries FIN and we are done with the origin server; the caller
+// closes the stream, which closes the origin connection. A short tail
+// waits for more content to fill its frame, but only until the flush
+// timer goes off.
+static void
+send_http_content(spdy_io_stream * stream, bool eos, bool flush = false)
+{
+    TSIOBufferReader reader = stream->input->reader;
+
+    flush = flush || spdy_io_stream::data_flush_delay == 0;
+    if (http_send_content(stream, reader, eos, flush)) {
+        stream->http_state = spdy_io_stream::http_closed;
+        return;
+    }
+
+    if (TSIOBufferReaderAvail(reader) && !stream->flush_scheduled) {
+        // The timer event holds references, like any other stream event.
+        stream->flush_scheduled = true;
+        retain(stream);
+        retain(stream->io);
+        TSContSchedule(stream->continuation,
+                spdy_io_stream::data_flush_delay, TS_THREAD_POOL_DEFAULT);
+    }
+}
+
 static int
 spdy_stream_io(TSCont contp, TSEvent ev, void * edata)
 {
@@ -141,6 +170,8 @@ spdy_stream_io(TSCont contp, TSEvent ev, void * edata)
     } context;
 
     spdy_io_stream * stream = spdy_io_stream::get(contp);
+    bool eos;
+    bool closed = false;
 
     debug_http("[%p/%u] received %s event",
             stream, stream->stream_id, cstringof(ev));
@@ -153,7 +184,7 @@ spdy_stream_io(TSCont contp, TSEvent ev, void * edata)
         return TS_EVENT_NONE;
     }
 
-    std::lock_guard<spdy_io_stream::lock_type> lk(stream->lock);
+    scoped_stream_lock lk(stream);
 
     switch (ev) {
     case TS_EVENT_HOST_LOOKUP:
@@ -164,10 +195,15 @@ spdy_stream_io(TSCont contp, TSEvent ev, void * edata)
             inet_address addr(TSHostLookupResultAddrGet(context.dns));
             debug_http("[%p/%u] resolved %s => %s",
                     stream->io, stream->stream_id,
-                    stream->kvblock.url().hostport.c_str(), cstringof(addr));
+                    stream->request.url.hostport.c_str(), cstringof(addr));
             addr.port() = htons(80); // XXX should be parsed from hostport
             if (initiate_client_request(stream, addr.saddr(), contp)) {
                 ENTER(stream, spdy_io_stream::http_send_headers);
+            }
+
+            // The origin server connection holds references until the
+            // stream closes it.
+            if (stream->vconn) {
                 retain(stream);
                 retain(stream->io);
             }
@@ -178,6 +214,13 @@ spdy_stream_io(TSCont contp, TSEvent ev, void * edata)
             http_send_error(stream, TS_HTTP_STATUS_BAD_GATEWAY);
         }
 
+        // If the lookup failed or we couldn't connect, the stream is done
+        // and its origin request slot can go to the next one.
+        if (stream->is_closed()) {
+            stream->close();
+        }
+
+        lk.unlock();
         release(stream->io);
         release(stream);
         return TS_EVENT_NONE;
@@ -191,6 +234,7 @@ spdy_stream_io(TSCont contp, TSEvent ev, void * edata)
             if (write_http_request(stream)) {
                 TSVIOReenable(context.vio);
                 LEAVE(stream, spdy_io_stream::http_send_headers);
+                stream->create_http_parser();
                 ENTER(stream, spdy_io_stream::http_receive_headers);
             }
         }
@@ -205,6 +249,7 @@ spdy_stream_io(TSCont contp, TSEvent ev, void * edata)
     case TS_EVENT_VCONN_READ_COMPLETE:
     case TS_EVENT_VCONN_EOS:
         context.vio = (TSVIO)edata;
+        eos = (ev != TS_EVENT_VCONN_READ_READY);
 
         if (IN(stream, spdy_io_stream::http_receive_headers)) {
             if (read_http_headers(stream)) {
@@ -217,29 +262,97 @@ spdy_stream_io(TSCont contp, TSEvent ev, void * edata)
         // Parsing the headers might have completed and had more data left
         // over. If there's any data still buffered we can push it out now.
         if (IN(stream, spdy_io_stream::http_send_headers)) {
-            http_send_response(stream, stream->hparser.mbuffer.get(),
-                        stream->hparser.header.get());
+            http_parser& hparser(*stream->hparser);
+
+            http_send_response(stream, hparser.mbuffer.get(),
+                        hparser.header.get());
+            stream->framer = spdy::data_framer(spdy_io_stream::data_frame_size,
+                    http_content_length(stream, hparser.mbuffer.get(),
+                        hparser.header.get()));
             LEAVE(stream, spdy_io_stream::http_send_headers);
         }
 
         if (IN(stream, spdy_io_stream::http_receive_content)) {
-            http_send_content(stream, stream->input.reader);
+            // If the client isn't keeping up, leave the data in our buffer
+            // so that ATS stops reading from the origin server. We still
+            // forward everything at the end of the response.
+            if (ev == TS_EVENT_VCONN_READ_READY &&
+                    stream->io->pause_stream(stream)) {
+                debug_http("[%p/%u] pausing origin reads",
+                        stream->io, stream->stream_id);
+                return TS_EVENT_NONE;
+            }
+
+            send_http_content(stream, eos);
         }
 
-        if (ev == TS_EVENT_VCONN_EOS || ev == TS_EVENT_VCONN_READ_COMPLETE) {
+        // If the response ended before its body started, there was no
+        // DATA frame to carry FIN.
+        if (eos && !IN(stream, spdy_io_stream::http_closed)) {
             stream->http_state = spdy_io_stream::http_closed;
             spdy_send_data_frame(stream, spdy::FLAG_FIN, nullptr, 0);
-            TSVConnClose(stream->vconn);
         }
 
-        // Kick the IO control block write VIO to make it send the
-        // SPDY frames we spooled.
-        stream->io->reenable();
+        // The frames we queued are written by the session continuation,
+        // which the first of them woke up.
 
         if (IN(stream, spdy_io_stream::http_closed)) {
             stream->close();
+
+            // Drop the references that the origin server connection held.
+            lk.unlock();
+            release(stream->io);
+            release(stream);
+        }
+
+        return TS_EVENT_NONE;
+
+    case TS_EVENT_IMMEDIATE:
+        // The session output drained, so forward what we buffered and
+        // start reading from the origin server again, unless the session
+        // got throttled again in the meantime.
+        stream->paused = false;
+        if (IN(stream, spdy_io_stream::http_receive_content) &&
+                !stream->io->pause_stream(stream)) {
+            debug_http("[%p/%u] resuming origin reads",
+                    stream->io, stream->stream_id);
+            send_http_content(stream, false);
+            if (IN(stream, spdy_io_stream::http_closed)) {
+                stream->close();
+                closed = true;
+            } else {
+                TSVIOReenable(TSVConnReadVIOGet(stream->vconn));
+            }
+        }
+
+        lk.unlock();
+
+        // Drop the references that the origin server connection held, if
+        // we closed it, as well as those of the resume event.
+        if (closed) {
+            release(stream->io);
+            release(stream);
+        }
+
+        release(stream->io);
+        release(stream);
+        return TS_EVENT_NONE;
+
+    case TS_EVENT_TIMEOUT:
+        // Nothing filled the short tail we held back, so send it now. A
+        // paused stream sends it when it resumes.
+        stream->flush_scheduled = false;
+        if (IN(stream, spdy_io_stream::http_receive_content) &&
+                !stream->paused) {
+            debug_http("[%p/%u] flushing %" PRId64 " held bytes",
+                    stream->io, stream->stream_id,
+                    TSIOBufferReaderAvail(stream->input->reader));
+            send_http_content(stream, false, true);
         }
 
+        lk.unlock();
+        release(stream->io);
+        release(stream);
         return TS_EVENT_NONE;
 
     default:
@@ -252,7 +365,7 @@ spdy_stream_io(TSCont contp, TSEvent ev, void * edata)
 static bool
 block_and_resolve_host(
         spdy_io_stream * stream,
-        const std::string& hostport)
+        const spdy::arena_string& hostport)
 {
     int error;
     struct addrinfo * res0 = NULL;
@@ -286,7 +399,7 @@ block_and_resolve_host(
 static bool
 initiate_host_resolution(
         spdy_io_stream * stream,
-        const std::string& hostport)
+        const spdy::arena_string& hostport)
 {
     // XXX split the host and port and stash the port in the resulting sockaddr
     stream->action = TSHostLookup(stream->continuation, hostport.c_str(), hostport.size());
@@ -298,13 +411,66 @@ initiate_host_resolution(
     return true;
 }
 
+size_t spdy_io_stream::arena_size = spdy::arena::default_chunk_size;
+size_t spdy_io_stream::pool_size = 64;
+size_t spdy_io_stream::data_frame_size = spdy::data_framer::default_target;
+unsigned spdy_io_stream::data_flush_delay = 5;
+
+// A TSMBuffer never reclaims the space of the headers that we destroy in
+// it, so retire a stream after this many requests rather than let its
+// buffers grow without bound.
+static const unsigned max_stream_generations = 256;
+
+// Per-thread pool of idle streams. Like the zlib pool, a stream goes back
+// to the pool of the thread that releases it, so there is no locking.
+struct stream_pool
+{
+    std::vector<spdy_io_stream *> streams;
+
+    ~stream_pool() {
+        for (auto ptr(streams.begin()); ptr != streams.end(); ++ptr) {
+            delete *ptr;
+        }
+    }
+};
+
+static pthread_key_t    pool_key;
+static pthread_once_t   pool_once = PTHREAD_ONCE_INIT;
+
+static void
+destroy_stream_pool(void * ptr)
+{
+    delete (stream_pool *)ptr;
+}
+
+static void
+create_stream_pool_key()
+{
+    pthread_key_create(&pool_key, destroy_stream_pool);
+}
+
+static stream_pool *
+current_stream_pool()
+{
+    stream_pool * pool;
+
+    pthread_once(&pool_once, create_stream_pool_key);
+    pool = (stream_pool *)pthread_getspecific(pool_key);
+    if (pool == nullptr) {
+        pool = new stream_pool();
+        pthread_setspecific(pool_key, pool);
+    }
+
+    return pool;
+}
+
 spdy_io_stream::spdy_io_stream(unsigned s)
-    : stream_id(s), http_state(0), action(nullptr), vconn(nullptr),
-    continuation(nullptr), kvblock(), io(nullptr),
-    input(), output(), hparser()
+    : stream_id(s), http_state(0), priority(0), io(nullptr), action(nullptr),
+    vconn(nullptr), continuation(nullptr), arena(arena_size),
+    request(&arena), input(), output(), hparser(), returned_payloads(),
+    idle_payloads(nullptr), dispatched(false), paused(false), next(nullptr),
+    flush_scheduled(false), generation(0)
 {
-    this->continuation = TSContCreate(spdy_stream_io, TSMutexCreate());
-    TSContDataSet(this->continuation, this);
 }
 
 spdy_io_stream::~spdy_io_stream()
@@ -315,6 +481,83 @@ spdy_io_stream::~spdy_io_stream()
     if (this->continuation) {
         TSContDestroy(this->continuation);
     }
+
+    // No frame can hold a payload buffer now, since each holds a reference.
+    for (spdy_payload_buffer * payload = this->returned_payloads.pop_all();
+            payload; ) {
+        spdy_payload_buffer * next = payload->next;
+        delete payload;
+        payload = next;
+    }
+
+    while (spdy_payload_buffer * payload = this->idle_payloads) {
+        this->idle_payloads = payload->next;
+        delete payload;
+    }
+}
+
+spdy_io_stream *
+spdy_io_stream::create(unsigned stream_id)
+{
+    stream_pool * pool = current_stream_pool();
+
+    if (!pool->streams.empty()) {
+        spdy_io_stream * stream = pool->streams.back();
+
+        pool->streams.pop_back();
+        stream->stream_id = stream_id;
+        spdy_stat_increment(SPDY_STAT_STREAM_POOL_HITS);
+        return stream;
+    }
+
+    spdy_stat_increment(SPDY_STAT_STREAM_POOL_MISSES);
+    return new spdy_io_stream(stream_id);
+}
+
+void
+spdy_io_stream::dispose()
+{
+    stream_pool * pool = current_stream_pool();
+
+    if (pool->streams.size() < pool_size && this->recycle()) {
+        pool->streams.push_back(this);
+    } else {
+        delete this;
+    }
+}
+
+bool
+spdy_io_stream::recycle()
+{
+    // The last reference is gone, so nothing can be pending on the stream.
+    TSReleaseAssert(this->action == nullptr);
+    TSReleaseAssert(this->vconn == nullptr);
+
+    if (++this->generation >= max_stream_generations) {
+        return false;
+    }
+
+    this->stream_id = 0;
+    this->http_state = 0;
+    this->priority = 0;
+    this->dispatched = false;
+    this->paused = false;
+    this->flush_scheduled = false;
+    this->framer = spdy::data_framer();
+    this->io = nullptr;
+
+    this->request.reset();
+    this->arena.reset();
+    if (this->input) {
+        this->input->reset();
+        this->output->reset();
+    }
+
+    if (this->hparser) {
+        this->hparser->reset();
+    }
+
+    return true;
 }
 
 void
@@ -327,29 +570,102 @@ spdy_io_stream::close()
 
     if (this->vconn) {
         TSVConnClose(this->vconn);
-        this->action = nullptr;
+        this->vconn = nullptr;
     }
 
+    // The request has been sent, so we can release all the header state.
+    // Report the high water mark so that the arena size can be tuned.
+    debug_http("[%p/%u] arena high water %zu bytes",
+            this->io, this->stream_id, this->arena.high_water());
+    spdy_stat_max(SPDY_STAT_ARENA_HIGH_WATER, this->arena.high_water());
+
+    this->request.url.clear();
+    this->arena.reset();
+
     this->http_state = http_closed;
+    this->io->stream_finished(this);
+}
+
+void
+spdy_io_stream::create_io_buffers()
+{
+    if (!this->input) {
+        this->input.reset(new spdy_io_buffer());
+        this->output.reset(new spdy_io_buffer());
+    }
+}
+
+spdy_payload_buffer *
+spdy_io_stream::take_payload()
+{
+    spdy_payload_buffer * payload;
+
+    if (this->idle_payloads == nullptr) {
+        this->idle_payloads = this->returned_payloads.pop_all();
+    }
+
+    if (this->idle_payloads) {
+        payload = this->idle_payloads;
+        this->idle_payloads = payload->next;
+    } else {
+        payload = new spdy_payload_buffer();
+    }
+
+    payload->next = nullptr;
+    payload->stream = retain(this);
+    return payload;
+}
+
+void
+spdy_io_stream::return_payload(spdy_payload_buffer * payload)
+{
+    spdy_io_stream * stream = payload->stream;
+
+    // Queue the buffer before we let go of the stream, which can destroy
+    // it along with its buffers.
+    payload->reset();
+    payload->stream = nullptr;
+    stream->returned_payloads.push(payload);
+    release(stream);
+}
+
+void
+spdy_io_stream::create_http_parser()
+{
+    if (!this->hparser) {
+        this->hparser.reset(new http_parser());
+    }
 }
 
 bool
 spdy_io_stream::open(
-        spdy::key_value_block& kv,
         open_options options)
 {
     TSReleaseAssert(this->io != nullptr);
 
-    if (this->is_closed()) {
-        this->kvblock = kv;
+    // A pooled stream can come with a continuation that is locked by the
+    // session it served last.
+    if (this->continuation && spdy_io_control::shared_mutex &&
+            TSContMutexGet(this->continuation) != this->io->mutex) {
+        TSContDestroy(this->continuation);
+        this->continuation = nullptr;
+    }
 
+    if (this->continuation == nullptr) {
+        TSMutex mutex = spdy_io_control::shared_mutex
+            ? this->io->mutex : TSMutexCreate();
+        this->continuation = TSContCreate(spdy_stream_io, mutex);
+        TSContDataSet(this->continuation, this);
+    }
+
+    if (this->is_closed()) {
         retain(this);
         retain(this->io);
 
         ENTER(this, spdy_io_stream::http_resolve_host);
         bool success = (options & open_with_system_resolver)
-            ? block_and_resolve_host(this, kvblock.url().hostport)
-            : initiate_host_resolution(this, kvblock.url().hostport);
+            ? block_and_resolve_host(this, request.url.hostport)
+            : initiate_host_resolution(this, request.url.hostport);
 
         if (!success) {
             release(this);